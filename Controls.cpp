@@ -15,7 +15,7 @@
 ITextEdit::ITextEdit(IPlugBase* pPlug, IRECT pR, int paramIdx, IText* pText, const char* str, ETextEntryOptions textEntryOptions)
 	: IControl(pPlug, pR)
 	, mIdx(paramIdx)
-	, mStr(str, kExpressionLengthMax)
+	, mStr(str, 0, kExpressionLengthMax)
 {
 	mDisablePrompt = true;
 	mText = *pText;
@@ -30,9 +30,10 @@ bool ITextEdit::Draw(IGraphics* pGraphics)
 	pGraphics->FillIRect(&mText.mTextEntryBGColor, &mRECT);
 	IRECT textRect = mRECT.GetHPadded(-3);
 
-	// copy into fixed-size buffer because DrawIText needs a non-const string
-	char textEditText[kExpressionLengthMax];
-	strncpy(textEditText, mStr.c_str(), kExpressionLengthMax - 1);
+	// copy because DrawIText needs a non-const string.
+	// programs can be much too long to copy into a buffer on the stack, so the copy is a string too.
+	std::string textCopy(mStr);
+	char* textEditText = &textCopy[0];
 
 #if defined(OS_OSX)
   // line spacing is too large when rendering on High Sierra (and presumably Mojave as well)
@@ -10,6 +10,7 @@
 #include "Interface.h"
 #include "IControl.h"
 #include "resource.h"
+#include <chrono>
 
 #if SA_API
 static const char * kAboutBoxText = "Version " VST3_VER_STR "\nCreated by Damien Quartz\nBuilt on " __DATE__;
@@ -17,18 +18,27 @@ static const char * kAboutBoxText = "Version " VST3_VER_STR "\nCreated by Damien
 
 Evaluator::Evaluator(IPlugInstanceInfo instanceInfo)
 	: IPLUG_CTOR(kNumParams, Presets::Count(), instanceInfo)
-	, mProgram(0)
+	, mProgram(nullptr)
+	, mProgramInUse(nullptr)
+	, mInitializedProgram(nullptr)
 	, mProgramMemorySize(0)
-	, mProgramIsValid(false)
+	, mSilence(nullptr)
 	, mTransport(kTransportPlaying)
 	, mGain(1.)
 	, mBitDepth(15)
 	, mScopeUpdate(0)
 	, mRunMode(kRunModeAlways)
 	, mMidiNoteResetsTick(false)
+	, mRandomRepeats(false)
+	, mRandomSeed(std::chrono::system_clock::now().time_since_epoch().count())
 {
 	TRACE;
 
+	// we want to always have a program we can run, so this is what CompileProgram publishes when compilation fails.
+	Program::CompileError silenceError;
+	int silenceErrorPosition;
+	mSilence = Program::Compile("[*] = w/2", 0, silenceError, silenceErrorPosition);
+
 	//arguments are: name, defaultVal, minVal, maxVal, step, label
 	GetParam(kGain)->InitDouble("volume", 50., 0., 100.0, 1, "%");
 
@@ -55,6 +65,8 @@ Evaluator::Evaluator(IPlugInstanceInfo instanceInfo)
 
 	GetParam(kMidiNoteResetsTime)->InitBool("midi note on sets t = 0", false);
 
+	GetParam(kRandomRepeats)->InitBool("R repeats with t", false);
+
 	for (int i = 0; i < Presets::Count(); ++i)
 	{
 		MakePresetFromData(Presets::Get(i));
@@ -97,6 +109,15 @@ Evaluator::Evaluator(IPlugInstanceInfo instanceInfo)
 Evaluator::~Evaluator()
 {
 	delete mInterface;
+	if (mProgram.load() != mSilence)
+	{
+		delete mProgram.load();
+	}
+	delete mSilence;
+	for (Program* program : mRetiredPrograms)
+	{
+		delete program;
+	}
 }
 
 void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nFrames)
@@ -116,21 +137,43 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 #endif
 	const double qdenom = (GetSampleRate() / (GetParam(kTempo)->Value() / 60.0)) / 128.0;
 
-	mProgram->Set('w', range);
-	mProgram->Set('~', (Program::Value)GetSampleRate());
+	Program* program = AcquireProgram();
+	// initializeeeee
+	if (program != mInitializedProgram.load())
+	{
+		mInitializedProgram.store(program);
+		mTick = 0;
+		if (program != mSilence)
+		{
+			for (int paramIdx = kVControl0; paramIdx <= kVControl7; ++paramIdx)
+			{
+				Program::Value vidx = paramIdx - kVControl0;
+				program->SetVC(vidx, GetParam(paramIdx)->Int());
+			}
+		}
+	}
+
+	program->Set('w', range);
+	program->Set('~', (Program::Value)GetSampleRate());
+	program->SetRandomMode(mRandomRepeats ? Program::RM_COUNTER : Program::RM_SEQUENTIAL, mRandomSeed);
 
 	double* in1 = inputs[0];
 	double* in2 = inputs[1];
 	double* out1 = outputs[0];
 	double* out2 = outputs[1];
 
+	// the program reads and writes interleaved stereo frames.
+	// this is sized in Reset, so it should only grow here if the host sends a larger block than it told us about.
+	if (mBlockBuffer.size() < (size_t)nFrames * 2)
+	{
+		mBlockBuffer.resize(nFrames * 2);
+	}
+
 	Program::RuntimeError error = Program::RE_NONE;
 	ITimeInfo timeInfo;
 	GetTime(&timeInfo);
-	Program::Value results[2];
-	double left = 0;
-	double right = 0;
-	for (int s = 0; s < nFrames; ++s, ++in1, ++in2, ++out1, ++out2)
+	int s = 0;
+	while (s < nFrames)
 	{
 		while (!mMidiQueue.Empty())
 		{
@@ -149,8 +192,8 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 						mTick = 0;
 					}
 					mNotes.push_back(*pMsg);
-					mProgram->Set('n', pMsg->NoteNumber());
-					mProgram->Set('v', pMsg->Velocity());
+					program->Set('n', pMsg->NoteNumber());
+					program->Set('v', pMsg->Velocity());
 					break;
 				}
 				// fallthrough to handle velocity of zero
@@ -171,18 +214,18 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 
 				if (mNotes.empty())
 				{
-					mProgram->Set('n', 0);
-					mProgram->Set('v', 0);
+					program->Set('n', 0);
+					program->Set('v', 0);
 				}
 				else
 				{
-					mProgram->Set('n', mNotes.back().NoteNumber());
-					mProgram->Set('v', mNotes.back().Velocity());
+					program->Set('n', mNotes.back().NoteNumber());
+					program->Set('v', mNotes.back().Velocity());
 				}
 				break;
 
 			case IMidiMsg::kControlChange:
-				mProgram->SetCC(pMsg->mData1, pMsg->mData2);
+				program->SetCC(pMsg->mData1, pMsg->mData2);
 				break;
 
 			default:
@@ -192,6 +235,15 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 			mMidiQueue.Remove();
 		}
 
+		// nothing the program can see changes until the next midi message,
+		// so we render everything up to that point with a single call to RunBlock.
+		int e = nFrames;
+		if (!mMidiQueue.Empty() && mMidiQueue.Peek()->mOffset < e)
+		{
+			e = mMidiQueue.Peek()->mOffset;
+		}
+		const int frames = e - s;
+
 		bool run = mTransport == kTransportPlaying;
 
 		switch (mRunMode)
@@ -207,42 +259,52 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 
 		if (run)
 		{
-			mProgram->Set('t', mTick);
-			mProgram->Set('m', (Program::Value)round(mTick / mdenom));
-			mProgram->Set('q', (Program::Value)round(mTick / qdenom));
-			results[0] = (Program::Value)((*in1 + 1) * (range / 2));
-			results[1] = (Program::Value)((*in2 + 1) * (range / 2));
-			error = mProgram->Run(results, 2);
-			left = mGain * (-1.0 + 2.0*((double)(results[0] % range) / (range - 1)));
-			right = mGain * (-1.0 + 2.0*((double)(results[1] % range) / (range - 1)));
-			++mTick;
+			Program::Value* frame = mBlockBuffer.data();
+			for (int f = 0; f < frames; ++f, frame += 2)
+			{
+				frame[0] = (Program::Value)((in1[f] + 1) * (range / 2));
+				frame[1] = (Program::Value)((in2[f] + 1) * (range / 2));
+			}
+
+			Program::TickState tickState(mTick, mdenom, qdenom);
+			error = program->RunBlock(mBlockBuffer.data(), mBlockBuffer.data(), 2, frames, tickState);
+			mTick = tickState.tick;
 		}
-		else
+
+		const Program::Value* frame = mBlockBuffer.data();
+		for (int f = 0; f < frames; ++f, frame += 2, ++in1, ++in2, ++out1, ++out2)
 		{
-			left = 0;
-			right = 0;
-		}
+			double left = 0;
+			double right = 0;
+			if (run)
+			{
+				left = mGain * (-1.0 + 2.0*((double)(frame[0] % range) / (range - 1)));
+				right = mGain * (-1.0 + 2.0*((double)(frame[1] % range) / (range - 1)));
+			}
 
-		*out1 = left;
-		*out2 = right;
+			*out1 = left;
+			*out2 = right;
 
-		if (mScopeUpdate == 0)
-		{
-			mInterface->UpdateOscilloscope(left, right);
-			// we need to update the oscilloscope this many times every updateSeconds
-			const int samplesPerInterval = mInterface->GetOscilloscopeWidth();
-			const double updateInterval = GetParam(kScopeWindow)->Value();
-			mScopeUpdate = (int)(GetSampleRate()*updateInterval / samplesPerInterval);
-		}
-		else
-		{
-			--mScopeUpdate;
+			if (mScopeUpdate == 0)
+			{
+				mInterface->UpdateOscilloscope(left, right);
+				// we need to update the oscilloscope this many times every updateSeconds
+				const int samplesPerInterval = mInterface->GetOscilloscopeWidth();
+				const double updateInterval = GetParam(kScopeWindow)->Value();
+				mScopeUpdate = (int)(GetSampleRate()*updateInterval / samplesPerInterval);
+			}
+			else
+			{
+				--mScopeUpdate;
+			}
 		}
+
+		s = e;
 	}
 
 	mMidiQueue.Flush(nFrames);
 
-	if (mProgramIsValid && mInterface != nullptr)
+	if (program != mSilence && mInterface != nullptr)
 	{
 		if (error == Program::RE_NONE)
 		{
@@ -260,6 +322,8 @@ void Evaluator::ProcessDoubleReplacing(double** inputs, double** outputs, int nF
 
 		SetWatchText(mInterface);
 	}
+
+	ReleaseProgram();
 }
 
 void Evaluator::Reset()
@@ -267,18 +331,12 @@ void Evaluator::Reset()
 	TRACE;
 	IMutexLock lock(this);
 
-	// re-init vars
-	if (mProgram != nullptr)
-	{
-		delete mProgram;
-		mProgram = nullptr;
-		mProgramIsValid = false;
-	}
-	// force recompile
+	// force recompile, which re-inits vars because the new program starts with fresh memory
 	OnParamChange(kExpression);
 	OnParamChange(kTransportState);
 
 	mMidiQueue.Resize(GetBlockSize());
+	mBlockBuffer.resize(GetBlockSize() * 2);
 	mNotes.clear();
 	mScopeUpdate = 0;
 }
@@ -292,6 +350,13 @@ void Evaluator::ProcessMidiMsg(IMidiMsg *pMsg)
 
 void Evaluator::OnParamChange(int paramIdx)
 {
+	// compiling doesn't need the mutex, so we don't take it and block the audio thread for however long that takes.
+	if (paramIdx == kExpression)
+	{
+		CompileProgram();
+		return;
+	}
+
 	IMutexLock lock(this);
 
 	switch (paramIdx)
@@ -314,57 +379,9 @@ void Evaluator::OnParamChange(int paramIdx)
 		mMidiNoteResetsTick = GetParam(kMidiNoteResetsTime)->Bool();
 		break;
 
-	case kExpression:
-	{
-		Program::CompileError error;
-		int errorPosition;
-		const char* programText = mInterface->GetProgramText();
-		// we get the memory size from the interface because we *might* expose this in the UI.
-		// but I'm not totally convinced there is much utility in doing so.
-		mProgramMemorySize = mInterface->GetProgramMemorySize();
-		mProgram = Program::Compile(programText, mProgramMemorySize, error, errorPosition);
-		// we want to always have a program we can run,
-		// so if compilation fails, we create one that simply evaluates to silence.
-		mProgramIsValid = error == Program::CE_NONE;
-		if (!mProgramIsValid)
-		{
-			static const int maxError = 1024;
-			static char errorDesc[maxError];
-			static const int maxLoc = 47;
-			static char programLoc[maxLoc];
-			int len = strlen(programText + errorPosition);
-			if (len > maxLoc - 2) len = maxLoc - 2;
-			memset(programLoc, '\0', maxLoc);
-			strncpy(programLoc, programText + errorPosition, len);
-			for (int i = 0; i < maxLoc; ++i)
-			{
-				if (programLoc[i] == '\n')
-				{
-					programLoc[i] = '\0';
-					break;
-				}
-			}
-			snprintf(errorDesc, maxError,
-				"Compile Error:\n\n%s\n\nAt:\n\n%s",
-				Program::GetErrorString(error),
-				programLoc);
-			mInterface->SetConsoleText(errorDesc);
-			mProgram = Program::Compile("[*] = w/2", 0, error, errorPosition);
-		}
-
-		// initializeeeee
-		mTick = 0;
-		if (mProgramIsValid)
-		{
-			for (paramIdx = kVControl0; paramIdx <= kVControl7; ++paramIdx)
-			{
-				Program::Value vidx = paramIdx - kVControl0;
-				mProgram->SetVC(vidx, GetParam(paramIdx)->Int());
-			}
-		}
-		RedrawParamControls();
-	}
-	break;
+	case kRandomRepeats:
+		mRandomRepeats = GetParam(kRandomRepeats)->Bool();
+		break;
 
 	case kTransportState:
 	{	
@@ -393,19 +410,129 @@ void Evaluator::OnParamChange(int paramIdx)
 	default:
 		if (paramIdx >= kWatch && paramIdx < kWatch + kWatchNum && mInterface != nullptr)
 		{
+			AcquireProgram();
 			SetWatchText(mInterface);
+			ReleaseProgram();
 			RedrawParamControls();
 		}
-		else if (paramIdx >= kVControl0 && paramIdx <= kVControl7 && mProgramIsValid)
+		else if (paramIdx >= kVControl0 && paramIdx <= kVControl7)
 		{
-			Program::Value vidx = paramIdx - kVControl0;
-			mProgram->SetVC(vidx, GetParam(paramIdx)->Int());
+			Program* program = AcquireProgram();
+			if (program != mSilence)
+			{
+				Program::Value vidx = paramIdx - kVControl0;
+				program->SetVC(vidx, GetParam(paramIdx)->Int());
+			}
+			ReleaseProgram();
 			RedrawParamControls();
 		}
 		break;
 	}
 }
 
+void Evaluator::CompileProgram()
+{
+	std::unique_lock<std::mutex> compileLock(mCompileMutex);
+
+	Program::CompileError error;
+	int errorPosition;
+	const char* programText = mInterface->GetProgramText();
+	// we get the memory size from the interface because we *might* expose this in the UI.
+	// but I'm not totally convinced there is much utility in doing so.
+	mProgramMemorySize = mInterface->GetProgramMemorySize();
+	Program* program = Program::Compile(programText, mProgramMemorySize, error, errorPosition);
+	// if compilation fails, we run mSilence instead, which simply evaluates to silence.
+	const bool isValid = error == Program::CE_NONE;
+	// this isn't static like the others because it's used after we let go of mCompileMutex
+	static const int maxError = 1024;
+	char errorDesc[maxError];
+	if (!isValid)
+	{
+		static const int maxLoc = 47;
+		static char programLoc[maxLoc];
+		int len = strlen(programText + errorPosition);
+		if (len > maxLoc - 2) len = maxLoc - 2;
+		memset(programLoc, '\0', maxLoc);
+		strncpy(programLoc, programText + errorPosition, len);
+		for (int i = 0; i < maxLoc; ++i)
+		{
+			if (programLoc[i] == '\n')
+			{
+				programLoc[i] = '\0';
+				break;
+			}
+		}
+		snprintf(errorDesc, maxError,
+			"Compile Error:\n\n%s\n\nAt:\n\n%s",
+			Program::GetErrorString(error),
+			programLoc);
+		program = mSilence;
+	}
+	else
+	{
+		// programs that don't carry anything from one frame to the next render several frames at once, the rest run as EE_THREADED
+		program->SetExecutionEngine(Program::EE_LANES);
+	}
+
+	// publish the new program, the audio thread initializes it the next time it runs (see ProcessDoubleReplacing).
+	// the old one can't be deleted until we know the audio thread isn't still running it.
+	Program* retired = mProgram.exchange(program);
+	if (retired != nullptr && retired != mSilence)
+	{
+		mRetiredPrograms.push_back(retired);
+	}
+	ReclaimPrograms();
+
+	// the audio thread updates the console while holding the mutex, so we need it to touch the interface.
+	// Reset compiles while it holds the mutex, so we let go of mCompileMutex first to always take them in the same order.
+	compileLock.unlock();
+	IMutexLock lock(this);
+	if (!isValid)
+	{
+		mInterface->SetConsoleText(errorDesc);
+	}
+	RedrawParamControls();
+}
+
+Program* Evaluator::AcquireProgram()
+{
+	// the program could be retired and reclaimed between loading it and marking it as in use,
+	// so it's only safe to use once it's still the current program after being marked.
+	Program* program = mProgram.load();
+	mProgramInUse.store(program);
+	while (program != mProgram.load())
+	{
+		program = mProgram.load();
+		mProgramInUse.store(program);
+	}
+	return program;
+}
+
+void Evaluator::ReleaseProgram()
+{
+	mProgramInUse.store(nullptr);
+}
+
+void Evaluator::ReclaimPrograms()
+{
+	// a retired program can't become the one in use again, so anything that isn't in use now is safe to delete.
+	// whatever is left over is deleted the next time we get here.
+	const Program* inUse = mProgramInUse.load();
+	const Program* initialized = mInitializedProgram.load();
+	for (auto iter = mRetiredPrograms.begin(); iter != mRetiredPrograms.end();)
+	{
+		if (*iter != inUse && *iter != initialized)
+		{
+			delete *iter;
+			iter = mRetiredPrograms.erase(iter);
+		}
+		else
+		{
+			++iter;
+		}
+	}
+}
+
 // need to start the version at a really high number cuz
 // i didn't include it at first so unversioned data will have length 
 // of the expression string as the first bit of data.
@@ -414,7 +541,8 @@ static const int kStateVCParams = kStateFirstVersion + 1;
 static const int kStateProgramName = kStateVCParams + 1;
 static const int kStateTempo = kStateProgramName + 1;
 static const int kStateMidiReset = kStateTempo + 1;
-static const int kStateVersion = kStateMidiReset;
+static const int kStateRandomSeed = kStateMidiReset + 1; // add the seed for R and the param that uses it
+static const int kStateVersion = kStateRandomSeed;
 
 void Evaluator::MakePresetFromData(const Presets::Data& data)
 {
@@ -443,6 +571,8 @@ void Evaluator::MakePresetFromData(const Presets::Data& data)
 		chunk.PutStr(watches[i]);
 	}
 	chunk.PutStr(data.name);
+	// presets keep whatever seed this instance has
+	chunk.Put(&mRandomSeed);
 	IPlugBase::SerializeParams(&chunk);
 
 	// create it - const cast on data.name because this method take char*, even though it doesn't change it
@@ -460,6 +590,7 @@ void Evaluator::SerializeOurState(ByteChunk* pChunk)
 		pChunk->PutStr(mInterface->GetWatch(i));
 	}
 	pChunk->PutStr(mInterface->GetProgramName());
+	pChunk->Put(&mRandomSeed);
 }
 
 // this over-ridden method is called when the host is trying to store the plug-in state and needs to get the current data from your algorithm
@@ -548,9 +679,18 @@ int Evaluator::UnserializeState(ByteChunk* pChunk, int startPos)
 
 	startPos = nextPos;
 
+	// older states don't have a seed, so they keep the one this instance started with
+	if (version >= kStateRandomSeed)
+	{
+		nextPos = pChunk->Get(&mRandomSeed, startPos);
+	}
+
+	startPos = nextPos;
+
 	const int numParams = version < kStateVCParams ? kScopeWindow + 1
 						: version < kStateTempo ? kVControl7 + 1
 						: version < kStateMidiReset ? kTempo + 1
+						: version < kStateRandomSeed ? kMidiNoteResetsTime + 1
 						: kNumParams;
 
 	return IPlugBase::UnserializeParams(pChunk, startPos, numParams); // must remember to call UnserializeParams at the end
@@ -590,6 +730,7 @@ const char * Evaluator::GetProgramState() const
 {
 	static const int max_state = 1024;
 	static char state[max_state];
+	const Program* program = mProgramInUse.load();
 
 	snprintf(state, max_state,
 		"time                   input\n"
@@ -597,12 +738,12 @@ const char * Evaluator::GetProgramState() const
 		"t=%-20llu w=%-20llu\n"
 		"m=%-20llu n=%-20llu\n"
 		"q=%-20llu v=%-20llu\n",
-		mProgram->Get('t'),
-		mProgram->Get('w'),
-		mProgram->Get('m'),
-		mProgram->Get('n'),
-		mProgram->Get('q'),
-		mProgram->Get('v')
+		program->Get('t'),
+		program->Get('w'),
+		program->Get('m'),
+		program->Get('n'),
+		program->Get('q'),
+		program->Get('v')
 		);
 
 	return state;
@@ -612,6 +753,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 {
 	static const int max_text = 1024;
 	static char text[max_text];
+	const Program* program = mProgramInUse.load();
 
 	char* printTo = text;
 	for (int i = 0; i < kWatchNum; ++i)
@@ -629,7 +771,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 			char var = *watch;
 			if (isalpha(var) && islower(var))
 			{
-				printTo += sprintf(printTo, "%llu\n", mProgram->Get(var));
+				printTo += sprintf(printTo, "%llu\n", program->Get(var));
 			}
 			else
 			{
@@ -646,7 +788,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 				Program::Value addr = 0;
 				if (isalpha(var) && islower(var))
 				{
-					addr = mProgram->Get(var);
+					addr = program->Get(var);
 				}
 				else // try to parse the number
 				{
@@ -661,7 +803,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 						break;
 					}
 				}
-				printTo += sprintf(printTo, "%llu\n", mProgram->Peek(addr));
+				printTo += sprintf(printTo, "%llu\n", program->Peek(addr));
 			}
 			else if (watch[0] == 'C')
 			{
@@ -669,7 +811,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 				Program::Value cc = 0;
 				if (isalpha(var) && islower(var))
 				{
-					cc = mProgram->Get(var);
+					cc = program->Get(var);
 				}
 				else // try to parse the number
 				{
@@ -684,7 +826,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 						break;
 					}
 				}
-				printTo += sprintf(printTo, "%llu\n", mProgram->GetCC(cc));
+				printTo += sprintf(printTo, "%llu\n", program->GetCC(cc));
 			}
 			else if (watch[0] == 'V')
 			{
@@ -692,7 +834,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 				Program::Value vc = 0;
 				if (isalpha(var) && islower(var))
 				{
-					vc = mProgram->Get(var);
+					vc = program->Get(var);
 				}
 				else // try to parse the number
 				{
@@ -707,7 +849,7 @@ void Evaluator::SetWatchText(Interface* forInterface) const
 						break;
 					}
 				}
-				printTo += sprintf(printTo, "%llu\n", mProgram->GetVC(vc));
+				printTo += sprintf(printTo, "%llu\n", program->GetVC(vc));
 			}
 			else
 			{
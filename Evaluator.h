@@ -13,6 +13,8 @@
 #include "Program.h"
 #include "Presets.h"
 #include "IMidiQueue.h"
+#include <atomic>
+#include <mutex>
 #include <vector>
 
 class Interface;
@@ -36,7 +38,8 @@ public:
 	// catch the About menu item to display what we wants in a box
 	bool HostRequestingAboutBox() override;
 
-	// get a string that represents the internal state of the program we want to display in the UI
+	// get a string that represents the internal state of the program we want to display in the UI.
+	// these read the program returned by AcquireProgram, so must only be called between it and ReleaseProgram.
 	const char * GetProgramState() const;
 	void SetWatchText(Interface* forInterface) const;
 
@@ -45,22 +48,48 @@ private:
 	void MakePresetFromData(const Presets::Data& data);
 	void SerializeOurState(ByteChunk* pChunk);
 
+	// compile the program text and publish the result for the audio thread to pick up.
+	// this does not take the mutex, so compiling never holds up ProcessDoubleReplacing.
+	void CompileProgram();
+	// get the current program and mark it as in use so that it won't be deleted if a new one is published.
+	// only code holding the mutex may call this, which guarantees there is only ever one user to keep track of.
+	Program* AcquireProgram();
+	void ReleaseProgram();
+	// delete retired programs that are not in use
+	void ReclaimPrograms();
+
 	// the UI
 	Interface*			mInterface;
 
 	// plug state
-	Program*				mProgram;
+	// the most recently compiled program, which is swapped for a new one by CompileProgram.
+	std::atomic<Program*>	mProgram;
+	// the program between AcquireProgram and ReleaseProgram, null when nothing is using one.
+	std::atomic<Program*>	mProgramInUse;
+	// the program the audio thread last initialized, so it knows to initialize the one AcquireProgram returns when it is a different one.
+	// ReclaimPrograms doesn't delete this one either, so a new program can't be allocated at its address and be mistaken for it.
+	std::atomic<Program*>	mInitializedProgram;
+	// programs that have been replaced but might still be in use, only accessed by CompileProgram.
+	std::vector<Program*>	mRetiredPrograms;
+	// serializes calls to CompileProgram, which can come from the UI thread and from the host.
+	std::mutex			mCompileMutex;
 	int					mProgramMemorySize;
-	// will be false if user input produced a compilation error.
-	// we want to keep track of this so we don't update the UI in ProcessDoubleReplacing.
-	bool					mProgramIsValid;
+	// what CompileProgram publishes when user input produced a compilation error, so that we always have a program we can run.
+	// it's never retired, so a program is valid exactly when it isn't this one,
+	// which we check so we don't update the UI or apply the V controls for it.
+	Program*			mSilence;
 	TransportState	    mTransport;
 	double				mGain;
 	int					mBitDepth;
 	int					mScopeUpdate;
 	RunMode				mRunMode;
 	bool				mMidiNoteResetsTick;
+	bool				mRandomRepeats;
+	// the seed of Program::RM_COUNTER, saved with the state so that R gives the same numbers every time a session is played
+	uint64_t			mRandomSeed;
 	Program::Value		mTick;
+	// interleaved stereo frames passed to Program::RunBlock, used for both input and output.
+	std::vector<Program::Value> mBlockBuffer;
 	IMidiQueue			mMidiQueue;
 	std::vector<IMidiMsg> mNotes;
 };
@@ -556,6 +556,24 @@ void Interface::CreateControls(IGraphics* pGraphics)
 		pGraphics->AttachControl(timeResetToggle);
 	}
 
+	// ---R repeats, on the same line as the midi note toggle
+	{
+		IText textStyle = kLabelTextStyle;
+		textStyle.mAlign = IText::kAlignNear;
+
+		IRECT captionRect = MakeIRect(kTResetLabel);
+		captionRect.L = timeResetToggle->GetRECT()->R + 15;
+		captionRect.R = captionRect.L + kTResetLabel_W;
+		const char * label = mPlug->GetParam(kRandomRepeats)->GetNameForHost();
+		pGraphics->MeasureIText(&textStyle, const_cast<char*>(label), &captionRect);
+		pGraphics->AttachControl(new ITextControl(mPlug, captionRect, &textStyle, label));
+
+		const int width = captionRect.W() + 5;
+		captionRect.L += width;
+		captionRect.R = captionRect.L + captionRect.H();
+		pGraphics->AttachControl(new ToggleControl(mPlug, captionRect, kRandomRepeats, kExprBackgroundColor, kGreenColor));
+	}
+
 #if SA_API
 	// tempo label and edit box
 	{
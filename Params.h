@@ -23,11 +23,12 @@ enum EParams
 	// it will be set to be not automatible, which will hide it in the VST3 version, at least.
 	kTempo,
 	kMidiNoteResetsTime, // does receiving a note-on set t to zero
+	kRandomRepeats, // does R give the same numbers every time t has the same value (see Program::RM_COUNTER)
 	kNumParams,
 	
 	// used for text edit fields so the UI can call OnParamChange
 	kExpression = 101,
-	kExpressionLengthMax = 1024,
+	kExpressionLengthMax = 1024 * 1024,
 	
 	kWatch = 202, // starting paramIdx for watches
 	kWatchNum = 10, // total number of watches available
@@ -10,27 +10,110 @@
 #define _USE_MATH_DEFINES
 
 #include "Program.h"
+#include <algorithm>
 #include <chrono>
+#include <cstddef>
 #include <ctype.h>
 #include <deque>
+#include <iterator>
+#include <list>
 #include <math.h>
 #include <map>
+#include <stddef.h>
+#include <string.h>
+#include <string>
+#include <unordered_map>
 
-const std::map<Program::Char, Program::Op::Code> UnaryOperators =
-{
-	{ '@', Program::Op::PEK },
-	{ 'F', Program::Op::FRQ },
-	{ '#', Program::Op::SQR },
-	{ '$', Program::Op::SIN },
-	{ 'T', Program::Op::TRI },
-	{ '+', Program::Op::NOP },
-	{ '-', Program::Op::NEG },
-	{ '~', Program::Op::COM },
-	{ '!', Program::Op::NOT },
-	{ 'C', Program::Op::CCV },
-	{ 'V', Program::Op::VCV },
-	{ 'R', Program::Op::RND }
-};
+// the JIT generates x86-64 code for the System V calling convention
+#if (defined(__x86_64__) || defined(_M_X64)) && !defined(_WIN32)
+#define JIT_AVAILABLE 1
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define JIT_AVAILABLE 0
+#endif
+
+// what the parser needs to know about each character, looked up by the character's value as an unsigned char.
+// the table is generated at compile time from CharInfoOf, so classifying a character is a single load.
+namespace Chars
+{
+	enum Class
+	{
+		SPACE = 1 << 0, // skipped between tokens, the same characters as isspace in the "C" locale
+		LOWER = 1 << 1, // a variable name
+		UPPER = 1 << 2, // an illegal variable name, unless it is a unary operator
+		UNARY = 1 << 3, // a unary operator, see Info::unary
+	};
+
+	struct Info
+	{
+		uint8_t classes;
+		// the op for a unary operator, NOP for unary + because it doesn't do anything
+		Program::Op::Code unary;
+		// the op for a binary operator that is just this character, NOP for anything else
+		Program::Op::Code binary;
+	};
+
+	constexpr Program::Op::Code UnaryOf(const unsigned char c)
+	{
+		return c == '@' ? Program::Op::PEK
+			: c == 'F' ? Program::Op::FRQ
+			: c == '#' ? Program::Op::SQR
+			: c == '$' ? Program::Op::SIN
+			: c == 'T' ? Program::Op::TRI
+			: c == '-' ? Program::Op::NEG
+			: c == '~' ? Program::Op::COM
+			: c == '!' ? Program::Op::NOT
+			: c == 'C' ? Program::Op::CCV
+			: c == 'V' ? Program::Op::VCV
+			: c == 'R' ? Program::Op::RND
+			: Program::Op::NOP;
+	}
+
+	constexpr Program::Op::Code BinaryOf(const unsigned char c)
+	{
+		return c == '*' ? Program::Op::MUL
+			: c == '/' ? Program::Op::DIV
+			: c == '%' ? Program::Op::MOD
+			: c == '+' ? Program::Op::ADD
+			: c == '-' ? Program::Op::SUB
+			: c == '&' ? Program::Op::AND
+			: c == '^' ? Program::Op::XOR
+			: c == '|' ? Program::Op::OR
+			: Program::Op::NOP;
+	}
+
+	constexpr Info InfoOf(const unsigned char c)
+	{
+		return Info{ (uint8_t)(
+			(c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' || c == '\r' ? SPACE : 0)
+			| (c >= 'a' && c <= 'z' ? LOWER : 0)
+			| (c >= 'A' && c <= 'Z' ? UPPER : 0)
+			| (UnaryOf(c) != Program::Op::NOP || c == '+' ? UNARY : 0)),
+			UnaryOf(c), BinaryOf(c) };
+	}
+
+	template<size_t... C>
+	struct Table
+	{
+		static constexpr Info info[sizeof...(C)] = { InfoOf(C)... };
+	};
+	template<size_t... C>
+	constexpr Info Table<C...>::info[sizeof...(C)];
+
+	// builds Table<0, 1, ..., 255>
+	template<size_t N, size_t... C>
+	struct MakeTable : MakeTable<N - 1, N - 1, C...> {};
+	template<size_t... C>
+	struct MakeTable<0, C...> { typedef Table<C...> Type; };
+
+	typedef MakeTable<256>::Type Infos;
+	static_assert(Infos::info['$'].unary == Program::Op::SIN && (Infos::info['\n'].classes & SPACE), "the character table is wrong");
+
+	inline const Info& Of(const Program::Char c) { return Infos::info[(unsigned char)c]; }
+	// whether c is in any of classes
+	inline bool Is(const Program::Char c, const int classes) { return (Of(c).classes & classes) != 0; }
+}
 
 // used to store const values relating to [*], 
 // which allows for reading the sum of all inputs or writing the same value to all outputs.
@@ -40,24 +123,84 @@ namespace Wildcard
 	const Program::Value Value = -1;
 }
 
-Program::Program(const std::vector<Op>& inOps, const size_t userMemorySize)
-	: ops(inOps)
+Program::StateReport::StateReport()
+	: userMemory(VS_UNUSED)
+	, usesRandom(false)
+{
+	std::fill(std::begin(variables), std::end(variables), VS_UNUSED);
+}
+
+bool Program::StateReport::IsStateless(const RandomMode randomMode) const
+{
+	return (!usesRandom || randomMode == RM_COUNTER) && userMemory != VS_CARRIED && std::find(std::begin(variables), std::end(variables), VS_CARRIED) == std::end(variables);
+}
+
+Program::CompiledProgram::CompiledProgram(std::vector<Instruction>&& inCode, std::vector<Instruction>&& inInvariantCode, std::vector<Value>&& inConstants, std::vector<Divisor>&& inDivisors, const size_t userMemorySize, const size_t inStackSize, const bool isVerified, const bool runsInLanes, const StateReport& inStateReport, const size_t temporaryCount, const uint64_t removedCount)
+	: code(std::move(inCode))
+	, invariantCode(std::move(inInvariantCode))
+	, constants(std::move(inConstants))
+	, divisors(std::move(inDivisors))
+	, removedInstructionCount(removedCount)
 	, userMemSize(userMemorySize)
-	, memSize(userMemorySize + 256) // 256 to enough room for all possible values of Char
+	, memSize(GetMemorySize(userMemorySize))
+	, tempSize(temporaryCount)
+	, stackSize(inStackSize)
+	, verified(isVerified)
+	, lanes(runsInLanes)
+	, stateReport(inStateReport)
+	, jitCode(nullptr)
+	, jitCodeSize(0)
+{
+}
+
+Program::CompiledProgram::~CompiledProgram()
+{
+#if JIT_AVAILABLE
+	if (jitCode != nullptr)
+	{
+		munmap((void*)jitCode, jitCodeSize);
+	}
+#endif
+}
+
+Program::ExecutionState::ExecutionState(const CompiledProgram& compiled)
+	: divisors(compiled.divisors)
+	, oscillatorW(0)
+	, squareDivisor(Divisor::DS_CONSTANT, 0)
+	, sineDivisor(Divisor::DS_CONSTANT, 0)
+	, sineTable(nullptr)
+	, frequencyRate(0)
+	, frequencyGeneration(1)
+	, pc(0)
+	, mem(compiled.memSize + compiled.tempSize, 0)
+	// always have at least one slot so that stack is never empty
+	, stack(compiled.stackSize > 0 ? compiled.stackSize : 1, 0)
+	, sp(0)
 	, rng(std::chrono::system_clock::now().time_since_epoch().count())
+	, randomMode(RM_SEQUENTIAL)
+	, randomSeed(0)
 {
-	mem = new Value[memSize];
-	memset(mem, 0, sizeof(Value)*memSize);
+	if (compiled.lanes)
+	{
+		laneStack.resize(std::max(compiled.stackSize, (size_t)1));
+		laneTemps.resize(compiled.tempSize);
+	}
 	// initialize cc memory space - we want to accurately represent the midi device
 	memset(cc, 0, sizeof(cc));
 	memset(vc, 0, sizeof(vc));
-	// default sample rate so the F operator will function
-	Set('~', 44100);
+	memset(frequencyTable, 0, sizeof(frequencyTable));
 }
 
-Program::~Program()
+Program::Program(const std::shared_ptr<CompiledProgram>& compiledProgram)
+	: compiled(compiledProgram)
+	, state(*compiledProgram)
+	, execEngine(EE_THREADED)
+	, jitCode(nullptr)
 {
-	delete[] mem;
+	// the handlers of the checked and unchecked engines are in different places, so the code is decoded for the one that will run it
+	std::call_once(compiled->threadedOnce, [this] { compiled->verified ? ExecuteThreaded<false>(nullptr, 0, true) : ExecuteThreaded<true>(nullptr, 0, true); });
+	// default sample rate so the F operator will function
+	Set('~', 44100);
 }
 
 // static
@@ -68,6 +211,17 @@ Program::Value Program::GetAddress(const Char var, const size_t userMemorySize)
 	return userMemorySize + static_cast<unsigned char>(var);
 }
 
+size_t Program::GetMemorySize(const size_t userMemorySize)
+{
+	// 256 to enough room for all possible values of Char
+	return userMemorySize + 256;
+}
+
+inline Program::Value& Program::VarRef(const Char var)
+{
+	return state.mem[GetAddress(var, compiled->userMemSize)];
+}
+
 //////////////////////////////////////////////////////////////////////////
 // COMPILATION
 //////////////////////////////////////////////////////////////////////////
@@ -106,6 +260,160 @@ const char * Program::GetErrorString(Program::CompileError error)
 	}
 }
 
+// a bump allocator for everything the compiler needs while it is working.
+// nothing is freed until the arena is reset at the start of the next compile, and the arena keeps its memory,
+// so once a thread has compiled a program, compiling one of a similar size again doesn't need to allocate.
+class CompilationArena
+{
+public:
+	// the arena for the calling thread, so that compiles on different threads don't need to lock anything
+	static CompilationArena& Get()
+	{
+		static thread_local CompilationArena arena;
+		return arena;
+	}
+
+	CompilationArena() : current(0), used(0) {}
+
+	void* Allocate(const size_t size)
+	{
+		const size_t aligned = Align(size);
+		for (; current < blocks.size(); ++current, used = 0)
+		{
+			Block& block = blocks[current];
+			if (block.size - used >= aligned)
+			{
+				void* ptr = block.data.get() + used;
+				used += aligned;
+				return ptr;
+			}
+		}
+
+		// none of the blocks have room, so add one at least twice the size of the last
+		const size_t size2 = std::max(aligned, blocks.empty() ? kFirstBlockSize : blocks.back().size * 2);
+		blocks.push_back(Block{ std::unique_ptr<uint8_t[]>(new uint8_t[size2]), size2 });
+		used = aligned;
+		return blocks.back().data.get();
+	}
+
+	// memory is only given back when it was the last thing allocated, which is the common case of a vector growing.
+	void Free(void* ptr, const size_t size)
+	{
+		const size_t aligned = Align(size);
+		if (current < blocks.size() && used >= aligned && (uint8_t*)ptr == blocks[current].data.get() + used - aligned)
+		{
+			used -= aligned;
+		}
+	}
+
+	// forget everything that has been allocated.
+	// when the last compile needed more than one block, they are replaced with a single block big enough for all of them.
+	// that is never more than kMaxKeptSize, so one very long program doesn't hold on to its memory for as long as the thread lives.
+	void Reset()
+	{
+		size_t total = 0;
+		for (const Block& block : blocks)
+		{
+			total += block.size;
+		}
+		if (total > kMaxKeptSize)
+		{
+			blocks.clear();
+		}
+		else if (blocks.size() > 1)
+		{
+			blocks.clear();
+			blocks.push_back(Block{ std::unique_ptr<uint8_t[]>(new uint8_t[total]), total });
+		}
+		current = 0;
+		used = 0;
+	}
+
+private:
+	static const size_t kFirstBlockSize = 64 * 1024;
+	// enough to compile about 20000 characters without allocating, a longer program gives back what it needed at the next compile
+	static const size_t kMaxKeptSize = 4 * 1024 * 1024;
+	// everything is aligned as strictly as operator new would
+	static size_t Align(const size_t size) { return (size + alignof(std::max_align_t) - 1) & ~(alignof(std::max_align_t) - 1); }
+
+	struct Block
+	{
+		std::unique_ptr<uint8_t[]> data;
+		size_t size;
+	};
+	std::vector<Block> blocks;
+	// the block we are allocating from and how much of it is used
+	size_t current;
+	size_t used;
+};
+
+// allocates from the CompilationArena of the calling thread, so it must only be used for things that don't outlive a compile
+template<typename T>
+struct ArenaAllocator
+{
+	typedef T value_type;
+
+	ArenaAllocator() {}
+	template<typename U> ArenaAllocator(const ArenaAllocator<U>&) {}
+
+	T* allocate(const size_t n) { return (T*)CompilationArena::Get().Allocate(n * sizeof(T)); }
+	void deallocate(T* ptr, const size_t n) { CompilationArena::Get().Free(ptr, n * sizeof(T)); }
+
+	template<typename U> bool operator==(const ArenaAllocator<U>&) const { return true; }
+	template<typename U> bool operator!=(const ArenaAllocator<U>&) const { return false; }
+};
+
+template<typename T> using ArenaVector = std::vector<T, ArenaAllocator<T>>;
+template<typename K, typename V> using ArenaMap = std::map<K, V, std::less<K>, ArenaAllocator<std::pair<const K, V>>>;
+
+// what Parse needs to remember about a construct it is in the middle of parsing while it parses something nested in it
+struct ParseFrame
+{
+	enum Kind : uint8_t
+	{
+		STATEMENT,  // an expression that may end with a semi-colon
+		ASSIGNMENT, // waiting on the left side of a possible '=', or the right side of one
+		TERNARY,    // waiting on the condition of a possible '?', or one of its branches
+		BINARY,     // waiting on an operand of a binary operator
+		PAREN,      // waiting on the expression in parens
+		BRACKET,    // waiting on the expression in brackets
+	};
+
+	enum Phase : uint8_t
+	{
+		NEXT,    // check for another '=' or '?'
+		RIGHT,   // the right side of '='
+		ELEMENT, // an element of the array on the right side of '='
+		THEN,    // what follows '?'
+		ELSE,    // what follows ':'
+	};
+
+	// what Parse should do next, returned by ParseAtom
+	enum Action
+	{
+		FAIL,
+		START_STATEMENT,
+		START_ATOM,
+		RESUME,
+	};
+
+	Kind kind;
+	Phase phase;
+	// the PEK or GET being assigned to
+	Program::Op::Code code;
+	// the first of state.binaryOps that belongs to a BINARY, the first of state.unaryOps that belongs to a PAREN or BRACKET
+	size_t first;
+	// the CND or JMP of a TERNARY that needs to know where to jump, the number of values an ASSIGNMENT assigns
+	size_t address;
+	size_t count;
+
+	explicit ParseFrame(const Kind inKind, const size_t inFirst = 0)
+		: kind(inKind), phase(NEXT), code(Program::Op::NOP), first(inFirst), address(0), count(0)
+	{
+
+	}
+};
+
 // used during compilation to keep track of things
 struct CompilationState
 {
@@ -116,7 +424,15 @@ struct CompilationState
 	int bracketCount;
 	int parseDepth;
 	Program::CompileError error;
-	std::vector<Program::Op> ops;
+	// how many R have been pushed, which numbers them for RM_COUNTER
+	Program::Value randomSites;
+	ArenaVector<Program::Op> ops;
+	// the unary operators in front of each atom being parsed, which are pushed once the atom is (see ParseAtom)
+	ArenaVector<Program::Op::Code> unaryOps;
+	// the binary operators waiting on their right operand, which are pushed once an operator that binds looser than them is found
+	ArenaVector<Program::Op::Code> binaryOps;
+	// the constructs Parse is in the middle of parsing, innermost last
+	ArenaVector<ParseFrame> frames;
 
 	CompilationState(const Program::Char* inSource, const size_t userMemorySize)
 		: source(inSource)
@@ -126,6 +442,7 @@ struct CompilationState
 		, bracketCount(0)
 		, parseDepth(0)
 		, error(Program::CE_NONE)
+		, randomSites(0)
 	{
 
 	}
@@ -133,52 +450,128 @@ struct CompilationState
 	// some helpers
 	Program::Char operator*() const { return source[parsePos]; }
 	size_t Push(Program::Op::Code code, Program::Value value = 0) { ops.push_back(Program::Op(code, value)); return ops.size()-1; }
-	void SkipWhitespace()
+	// push the unary operators from unaryOps[first] on, last one first, and remove them from unaryOps
+	void PushUnaryOps(const size_t first)
 	{
-		while (isspace(source[parsePos]))
+		while (unaryOps.size() > first)
 		{
-			++parsePos;
+			// each R is numbered in the order it is pushed, which doesn't depend on what the optimizer does later
+			Push(unaryOps.back(), unaryOps.back() == Program::Op::RND ? randomSites++ : 0);
+			unaryOps.pop_back();
 		}
-
-		// also skip any commented text while we are at it
-		if (source[parsePos] == '/' && source[parsePos + 1] == '/')
+	}
+	void SkipWhitespace()
+	{
+		for (;;)
 		{
-			parsePos += 2;
-			// read to the end of line or end of file
-			while (source[parsePos] != '\n' && source[parsePos] != '\0')
+			while (Chars::Is(source[parsePos], Chars::SPACE))
 			{
 				++parsePos;
 			}
 
-			// if we reached end of line and this is not end of file
-			// then we might have more whitespace to skip on the next line
-			if (source[parsePos] != '\0')
+			// also skip any commented text while we are at it
+			if (source[parsePos] != '/' || source[parsePos + 1] != '/')
+			{
+				return;
+			}
+			parsePos += 2;
+			// read to the end of line or end of file,
+			// after which we might have more whitespace to skip on the next line
+			while (source[parsePos] != '\n' && source[parsePos] != '\0')
 			{
-				SkipWhitespace();
+				++parsePos;
 			}
 		}
 	}
 };
 
-// forward declare Parse so that we can recurse back to it from anywhere.
-static int Parse(CompilationState& state);
+// how tightly a binary operator binds, higher binds tighter.
+// NOP, which is what PeekBinaryOperator returns when there isn't one, binds the loosest of all.
+static int Precedence(const Program::Op::Code code)
+{
+	switch (code)
+	{
+	case Program::Op::MUL: case Program::Op::DIV: case Program::Op::MOD:
+		return 7;
+	case Program::Op::ADD: case Program::Op::SUB:
+		return 6;
+	case Program::Op::CLT: case Program::Op::CLE: case Program::Op::CGT: case Program::Op::CGE:
+	case Program::Op::BSL: case Program::Op::BSR:
+		return 5;
+	case Program::Op::CEQ: case Program::Op::CNE:
+		return 4;
+	case Program::Op::AND:
+		return 3;
+	case Program::Op::XOR:
+		return 2;
+	case Program::Op::OR:
+		return 1;
+	default:
+		return 0;
+	}
+}
+
+// returns the binary operator at the current position and how many characters it is, or NOP if there isn't one
+static Program::Op::Code PeekBinaryOperator(const CompilationState& state, int& length)
+{
+	const Program::Char op = *state;
+	length = 1;
+	switch (op)
+	{
+	// '=' and '!' on their own are assignment and negation, so they are only operators when followed by an equals
+	case '=':
+	case '!':
+		if (state.source[state.parsePos + 1] != '=')
+		{
+			return Program::Op::NOP;
+		}
+		length = 2;
+		return op == '=' ? Program::Op::CEQ : Program::Op::CNE;
+
+	case '<':
+	case '>':
+	{
+		const Program::Char op2 = state.source[state.parsePos + 1];
+		// a bitshift
+		if (op2 == op)
+		{
+			length = 2;
+			return op == '<' ? Program::Op::BSL : Program::Op::BSR;
+		}
+		// for <= and >= we need to eat the equals character and push a different opcode
+		if (op2 == '=')
+		{
+			length = 2;
+			return op == '<' ? Program::Op::CLE : Program::Op::CGE;
+		}
+		return op == '<' ? Program::Op::CLT : Program::Op::CGT;
+	}
+
+	default:
+		return Chars::Of(op).binary;
+	}
+}
 
+// parses an atom: a number, a variable, or a parenthesized or bracketed expression, along with any unary operators in front of it.
+// the expression inside of parens or brackets is left to Parse, so this returns START_STATEMENT when one needs to be parsed
+// after it has pushed the frame that will finish the atom once the expression is done, and RESUME when it parsed the whole atom.
 static int ParseAtom(CompilationState& state)
 {
 	// Skip spaces
 	state.SkipWhitespace();
 
-	std::stack<Program::Op::Code> unaryOps;
+	// atoms nest, so the unary operators of this one go after those of the atoms we are inside of
+	const size_t firstUnaryOp = state.unaryOps.size();
 
 	// see if the current character is a unary operator
 	// and push the appropriate opcode onto the unaryOps stack.
 	// we don't push a NOP because it's pointless to have any.
-	while( UnaryOperators.count(*state) )
+	while( Chars::Is(*state, Chars::UNARY) )
 	{
-		const Program::Op::Code code = UnaryOperators.find(*state)->second;
+		const Program::Op::Code code = Chars::Of(*state).unary;
 		if ( code != Program::Op::NOP )
 		{
-			unaryOps.push(code);
+			state.unaryOps.push_back(code);
 		}
 		state.parsePos++;
 	}
@@ -188,23 +581,8 @@ static int ParseAtom(CompilationState& state)
 	{
 		state.parsePos++;
 		state.parenCount++;
-		if (Parse(state)) return 1;
-		if (*state != ')')
-		{
-			// Unmatched opening parenthesis
-			state.error = Program::CE_MISSING_PAREN;
-			return 1;
-		}
-		state.parsePos++;
-		state.parenCount--;
-
-		while (!unaryOps.empty())
-		{
-			state.Push(unaryOps.top());
-			unaryOps.pop();
-		}
-
-		return 0;
+		state.frames.push_back(ParseFrame(ParseFrame::PAREN, firstUnaryOp));
+		return ParseFrame::START_STATEMENT;
 	}
 
 	// check for bracket '['
@@ -212,6 +590,7 @@ static int ParseAtom(CompilationState& state)
 	{
 		state.parsePos++;
 		state.bracketCount++;
+		state.frames.push_back(ParseFrame(ParseFrame::BRACKET, firstUnaryOp));
 		// check for wildcard before attempting to parse an expression
 		state.SkipWhitespace();
 		if (*state == Wildcard::Char)
@@ -219,33 +598,14 @@ static int ParseAtom(CompilationState& state)
 			state.parsePos++;
 			state.Push(Program::Op::PSH, Wildcard::Value);
 			state.SkipWhitespace();
+			return ParseFrame::RESUME;
 		}
-		else if (Parse(state))
-		{
-			return 1;
-		}
-		if (*state != ']')
-		{
-			state.error = Program::CE_MISSING_BRACKET;
-			return 1;
-		}
-		state.parsePos++;
-		state.bracketCount--;
-
-		state.Push(Program::Op::GET);
-
-		while (!unaryOps.empty())
-		{
-			state.Push(unaryOps.top());
-			unaryOps.pop();
-		}
-
-		return 0;
+		return ParseFrame::START_STATEMENT;
 	}
 
-	if (isalpha(*state))
+	if (Chars::Is(*state, Chars::LOWER | Chars::UPPER))
 	{
-		if (islower(*state))
+		if (Chars::Is(*state, Chars::LOWER))
 		{
 			const Program::Char var = *state;
 			// push the address of the variable, which peek will need
@@ -257,7 +617,7 @@ static int ParseAtom(CompilationState& state)
 		else
 		{
 			state.error = Program::CE_ILLEGAL_VARIABLE_NAME;
-			return 1;
+			return ParseFrame::FAIL;
 		}
 	}
 	else // parse a numeric value
@@ -269,554 +629,2472 @@ static int ParseAtom(CompilationState& state)
 		if (endPtr == startPtr)
 		{
 			state.error = Program::CE_FAILED_TO_PARSE_NUMBER;
-			return 1;
+			return ParseFrame::FAIL;
 		}
 		state.Push(Program::Op::PSH, res);
 		// advance our index based on where the end pointer wound up
 		state.parsePos += (endPtr - startPtr) / sizeof(Program::Char);
 	}
 
-	while (!unaryOps.empty())
-	{
-		state.Push(unaryOps.top());
-		unaryOps.pop();
-	}
+	state.PushUnaryOps(firstUnaryOp);
 
-	return 0;
+	return ParseFrame::RESUME;
 }
 
-static int ParseFactors(CompilationState& state)
+// parses one statement, which is an expression optionally terminated by a semi-colon.
+// the grammar nests, but rather than recursing, everything that would be a recursive call keeps its place in a ParseFrame on state.frames,
+// so the native stack doesn't grow with how deeply the program nests, and the binary operators are parsed by precedence climbing
+// using state.binaryOps, instead of with one function per level of precedence, so every character is only looked at a constant number of times.
+static int Parse(CompilationState& state)
 {
-	if (ParseAtom(state)) return 1;
+	ArenaVector<ParseFrame>& frames = state.frames;
+	const size_t base = frames.size();
+	int next = ParseFrame::START_STATEMENT;
 	for (;;)
 	{
-		state.SkipWhitespace();
-
-		// Save the operation and position
-		Program::Char op = *state;
-		if (op != '/' && op != '*' && op != '%')
-		{
-			return 0;
-		}
-		state.parsePos++;
-		if (ParseAtom(state)) return 1;
-		// Perform the saved operation
-		if (op == '/')
-		{
-			state.Push(Program::Op::DIV);
-		}
-		else if (op == '%')
-		{
-			state.Push(Program::Op::MOD);
-		}
-		else
+		if (next == ParseFrame::START_STATEMENT)
 		{
-			state.Push(Program::Op::MUL);
+			// a statement is an assignment, which starts with a ternary, which starts with a binary expression, which starts with an atom.
+			// the frames are resumed in the reverse order as each of those finishes parsing.
+			state.parseDepth++;
+			frames.push_back(ParseFrame(ParseFrame::STATEMENT));
+			frames.push_back(ParseFrame(ParseFrame::ASSIGNMENT));
+			frames.push_back(ParseFrame(ParseFrame::TERNARY));
+			frames.push_back(ParseFrame(ParseFrame::BINARY, state.binaryOps.size()));
+			next = ParseFrame::START_ATOM;
 		}
-	}
-}
 
-static int ParseSummands(CompilationState& state)
-{
-	if (ParseFactors(state)) return 1;
-	for (;;)
-	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '-' && op != '+')
-		{
-			return 0;
-		}
-		state.parsePos++;
-		if (ParseFactors(state)) return 1;
-		switch (op)
+		if (next == ParseFrame::START_ATOM)
 		{
-		case '-': state.Push(Program::Op::SUB); break;
-		case '+': state.Push(Program::Op::ADD); break;
+			next = ParseAtom(state);
+			if (next == ParseFrame::FAIL) return 1;
+			continue;
 		}
-	}
-}
 
-static int ParseCmpOrShift(CompilationState& state)
-{
-	if (ParseSummands(state)) return 1;
-	for (;;)
-	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '<' && op != '>')
+		// the frame on top has finished parsing what it was waiting on, so it continues from where it left off
+		ParseFrame& frame = frames.back();
+		next = ParseFrame::RESUME;
+		switch (frame.kind)
 		{
-			return 0;
-		}
-		state.parsePos++;
-		Program::Char op2 = *state;
-		// not a bitshift, so do compare
-		if (op2 != op)
+		case ParseFrame::STATEMENT:
 		{
-			// for <= and >= we need to eat the equals character and push a different opcode
-			bool isEqual = op2 == '=';
-			if (isEqual)
+			// check for statement termination
+			state.SkipWhitespace();
+			if (*state == ';')
 			{
+				// if we have recursed into Parse due to opening parens
+				// or due to parsing a section of a ternary operator,
+				// we should throw an error if we encounter a semi-colon
+				// because those constructs will not evaluate correctly
+				// if a POP appears in the middle of the instructions.
+				if (state.parseDepth != 1)
+				{
+					state.error = Program::CE_ILLEGAL_STATEMENT_TERMINATION;
+					return 1;
+				}
 				state.parsePos++;
+				state.Push(Program::Op::POP);
+				// skip space immediately after statement termination
+				// in case this is the last symbol of the program but there is trailing whitespace
+				state.SkipWhitespace();
 			}
-			if (ParseSummands(state)) return 1;
-			switch (op)
+			state.parseDepth--;
+			frames.pop_back();
+			if (frames.size() == base)
 			{
-			case '<': state.Push(isEqual ? Program::Op::CLE : Program::Op::CLT); break;
-			case '>': state.Push(isEqual ? Program::Op::CGE : Program::Op::CGT); break;
+				return 0;
 			}
 		}
-		else
+		break;
+
+		case ParseFrame::ASSIGNMENT:
 		{
-			// is a bitshift, so eat it and continue
-			state.parsePos++;
-			if (ParseSummands(state)) return 1;
-			switch (op)
+			if (frame.phase == ParseFrame::NEXT)
 			{
-			case '<': state.Push(Program::Op::BSL); break;
-			case '>': state.Push(Program::Op::BSR); break;
+				state.SkipWhitespace();
+				if (*state != '=')
+				{
+					frames.pop_back();
+					break;
+				}
+				state.parsePos++;
+				// PEK and GET work by popping a value from the stack to use as the lookup address.
+				// so when we want to POK or PUT, we can use that same address to know where in memory to assign the result of the right side.
+				// we just need to remove the existing instruction so the address will still be on the stack after the instructions for the right side.
+				// we require the presence of a PEK or GET instruction because we don't want to allow statements like '5 = 4'
+				// instead, we accept '@5 = 4', which means "set memory address 5 to the value 4".
+				// similarly, 'a = 4' will assign 4 to the memory address reserved for the variable 'a' (see ParseAtom).
+				// [0] = 5 will put the value 5 into first output result
+				frame.code = state.ops.back().code;
+				if (frame.code == Program::Op::PEK || frame.code == Program::Op::GET)
+				{
+					state.ops.pop_back();
+				}
+				else
+				{
+					state.error = Program::CE_ILLEGAL_ASSIGNMENT;
+					return 1;
+				}
+
+				state.SkipWhitespace();
+				// check for the beginning of an "array" on the right side of the equals sign.
+				if (*state == '{')
+				{
+					state.parsePos++;
+					// how many values to POK or PUT
+					frame.count = 0;
+					frame.phase = ParseFrame::ELEMENT;
+				}
+				else // no array, so it's just a single expression
+				{
+					// decrement the parse depth before parsing because it's
+					// OK if the expression on the right hand side terminates in a semi-colon
+					state.parseDepth--;
+					frame.phase = ParseFrame::RIGHT;
+				}
+				next = ParseFrame::START_STATEMENT;
+				break;
 			}
-		}
-	}
-}
 
-static int ParseCEQ(CompilationState& state)
-{
-	if (ParseCmpOrShift(state)) return 1;
-	for (;;)
-	{
-		state.SkipWhitespace();
-		const Program::Char op = *state;
-		if (op != '=' && op != '!')
-		{
-			return 0;
-		}
-		state.parsePos++;
-		if (*state != '=')
-		{
-			// don't want to eat the first character if it is not followed by an equals, otherwise we will mess up assignments and negation
-			state.parsePos--;
-			return 0;
-		}
-		// eat the equals sign
-		state.parsePos++;
-		if (ParseCmpOrShift(state)) return 1;
-		switch (op)
-		{
-		case '=': state.Push(Program::Op::CEQ); break;
-		case '!': state.Push(Program::Op::CNE); break;
-		}
-	}
-}
+			if (frame.phase == ParseFrame::ELEMENT)
+			{
+				++frame.count;
+				if (*state == ',')
+				{
+					state.parsePos++;
+					next = ParseFrame::START_STATEMENT;
+					break;
+				}
 
-static int ParseAND(CompilationState& state)
-{
-	if (ParseCEQ(state)) return 1;
-	for (;;)
-	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '&')
-		{
-			return 0;
+				// if we didn't find a comma, we *should* find the closing brace
+				if (*state != '}')
+				{
+					state.error = Program::CE_MISSING_BRACE;
+					return 1;
+				}
+				state.parsePos++;
+			}
+			else
+			{
+				state.parseDepth++;
+				frame.count = 1;
+			}
+
+			// the statement on the right side of the '=' might have ended with a semi-colon,
+			// which means the last op will be a POP. we need to POK or PUT before that.
+			const bool hasPOP = state.ops.back().code == Program::Op::POP;
+			if (hasPOP)
+			{
+				state.ops.pop_back();
+			}
+			state.Push(frame.code == Program::Op::PEK ? Program::Op::POK : Program::Op::PUT, frame.count);
+			if (hasPOP)
+			{
+				state.Push(Program::Op::POP);
+			}
+			// the right side may be followed by another '='
+			frame.phase = ParseFrame::NEXT;
 		}
-		state.parsePos++;
-		if (ParseCEQ(state)) return 1;
-		state.Push(Program::Op::AND);
-	}
-}
+		break;
 
-static int ParseXOR(CompilationState& state)
-{
-	if (ParseAND(state)) return 1;
-	for (;;)
-	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '^')
+		case ParseFrame::TERNARY:
 		{
-			return 0;
+			if (frame.phase == ParseFrame::NEXT)
+			{
+				state.SkipWhitespace();
+				if (*state != '?')
+				{
+					frames.pop_back();
+					break;
+				}
+				state.parsePos++;
+
+				// result of the expression before the ? will be on the top of the stack now,
+				// the CND instruction needs to check that value and jump over the next expression if it is false.
+				// we won't know where to jump until after generating the instructions for the expression,
+				// so we stash where in the the ops list our CND op needs to go, which allows us to insert it when we have the address.
+				frame.address = state.Push(Program::Op::CND);
+
+				// parse expression following the ?
+				// we decrement parseDepth before parsing it because it's OK if the expression ends with a semi-colon.
+				// this will make the statement behave like an if statement.
+				state.parseDepth--;
+				frame.phase = ParseFrame::THEN;
+				next = ParseFrame::START_STATEMENT;
+				break;
+			}
+
+			state.parseDepth++;
+			if (frame.phase == ParseFrame::THEN)
+			{
+				state.SkipWhitespace();
+
+				// this means it ended with a semi-colon, we need to insert some instructions before this, so we remove it and add it back
+				const bool hasPop = state.ops.back().code == Program::Op::POP;
+				if (hasPop)
+				{
+					state.ops.pop_back();
+				}
+
+				// add a JMP instruction so we can skip what comes next, which is the "false" part of the expression
+				const size_t jmpOpAddr = state.Push(Program::Op::JMP);
+				// CND needs to jump to the instruction that follows the JMP
+				state.ops[frame.address].val = state.ops.size();
+				frame.address = jmpOpAddr;
+
+				// if there is a colon, the user has provided code to execute for "false".
+				// if there isn't, then we need to provide the result of the expression, which will simply be 0.
+				// in other words:
+				//		a = b ? c;
+				// is simply syntactic sugar for:
+				//		a = b ? c : 0;
+				if (*state == ':')
+				{
+					// if they put a semi-colon before the colon, Parse won't have caught it, so we do so here
+					if (hasPop)
+					{
+						state.error = Program::CE_ILLEGAL_STATEMENT_TERMINATION;
+						return 1;
+					}
+
+					// eat the colon
+					state.parsePos++;
+					// when parsing what follows the colon, we decrement parse depth first.
+					// this is so that if the line terminates with a semi-colon, we won't get an
+					// illegal statement termination error, unless we were already within parens.
+					state.parseDepth--;
+					frame.phase = ParseFrame::ELSE;
+					next = ParseFrame::START_STATEMENT;
+					break;
+				}
+
+				state.Push(Program::Op::PSH, 0);
+
+				// include the semi-colon that is in the source
+				if (hasPop)
+				{
+					state.Push(Program::Op::POP);
+				}
+			}
+
+			// if the statement terminated in a semi-colon we will have a POP on the end of the list.
+			// we need to jump directly to that POP because it *might* be replaced with a PEK or PUT.
+			if (state.ops.back().code == Program::Op::POP)
+			{
+				state.ops[frame.address].val = state.ops.size() - 1;
+			}
+			else
+			{
+				// when there's no POP we need to JMP to the instruction that will follow it.
+				state.ops[frame.address].val = state.ops.size();
+			}
+			// the ternary may be followed by another '?'
+			frame.phase = ParseFrame::NEXT;
+		}
+		break;
+
+		case ParseFrame::BINARY:
+		{
+			// an operand was just parsed, so what follows should be an operator or the end of the expression
+			state.SkipWhitespace();
+			int length = 0;
+			const Program::Op::Code op = PeekBinaryOperator(state, length);
+			// operators that bind at least as tightly as this one have both of their operands now
+			const int precedence = Precedence(op);
+			while (state.binaryOps.size() > frame.first && Precedence(state.binaryOps.back()) >= precedence)
+			{
+				state.Push(state.binaryOps.back());
+				state.binaryOps.pop_back();
+			}
+			if (op == Program::Op::NOP)
+			{
+				frames.pop_back();
+				break;
+			}
+			state.binaryOps.push_back(op);
+			state.parsePos += length;
+			next = ParseFrame::START_ATOM;
+		}
+		break;
+
+		case ParseFrame::PAREN:
+		{
+			if (*state != ')')
+			{
+				// Unmatched opening parenthesis
+				state.error = Program::CE_MISSING_PAREN;
+				return 1;
+			}
+			state.parsePos++;
+			state.parenCount--;
+
+			state.PushUnaryOps(frame.first);
+			frames.pop_back();
+		}
+		break;
+
+		case ParseFrame::BRACKET:
+		{
+			if (*state != ']')
+			{
+				state.error = Program::CE_MISSING_BRACKET;
+				return 1;
+			}
+			state.parsePos++;
+			state.bracketCount--;
+
+			state.Push(Program::Op::GET);
+
+			state.PushUnaryOps(frame.first);
+			frames.pop_back();
+		}
+		break;
 		}
-		state.parsePos++;
-		if (ParseAND(state)) return 1;
-		state.Push(Program::Op::XOR);
 	}
 }
 
-static int ParseOR(CompilationState& state)
+// how many values an op leaves on the stack minus how many it removes from it
+static int StackEffect(const Program::Op& op)
 {
-	if (ParseXOR(state)) return 1;
-	for (;;)
+	switch (op.code)
 	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '|')
-		{
-			return 0;
-		}
-		state.parsePos++;
-		if (ParseXOR(state)) return 1;
-		state.Push(Program::Op::OR);
+	case Program::Op::NOP:
+	case Program::Op::JMP:
+	case Program::Op::HLT:
+		return 0;
+
+	case Program::Op::PSH:
+	case Program::Op::LDV:
+		return 1;
+
+	// these pop an address and push what is there
+	case Program::Op::PEK:
+	case Program::Op::GET:
+	// unary operators
+	case Program::Op::FRQ:
+	case Program::Op::SQR:
+	case Program::Op::SIN:
+	case Program::Op::TRI:
+	case Program::Op::NEG:
+	case Program::Op::RND:
+	case Program::Op::CCV:
+	case Program::Op::VCV:
+	case Program::Op::NOT:
+	case Program::Op::COM:
+	// these replace the top of the stack
+	case Program::Op::STV:
+	case Program::Op::ADI:
+	case Program::Op::SBI:
+	case Program::Op::MLI:
+	case Program::Op::DVI:
+	case Program::Op::MDI:
+	case Program::Op::ANI:
+	case Program::Op::ORI:
+	case Program::Op::XRI:
+	case Program::Op::SLI:
+	case Program::Op::SRI:
+	case Program::Op::DVR:
+	case Program::Op::MDR:
+		return 0;
+
+	// pop the address and all of the values, push the first value back
+	case Program::Op::POK:
+	case Program::Op::PUT:
+		return -(int)op.val;
+
+	// pop the condition and both values, push one of the values back
+	case Program::Op::SEL:
+		return -2;
+
+	// binary operators, conditionals, and statement termination all pop one more than they push
+	default:
+		return -1;
 	}
 }
 
-static int ParseCND(CompilationState& state)
+// how many values an op needs to be on the stack when it runs
+static int StackInputs(const Program::Op& op)
 {
-	if (ParseOR(state)) return 1;
-	for (;;)
+	switch (op.code)
 	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '?')
-		{
-			return 0;
-		}
-		state.parsePos++;
+	case Program::Op::NOP:
+	case Program::Op::PSH:
+	case Program::Op::JMP:
+	case Program::Op::HLT:
+	case Program::Op::LDV:
+		return 0;
 
-		// result of the expression before the ? will be on the top of the stack now,
-		// the CND instruction needs to check that value and jump over the next expression if it is false.
-		// we won't know where to jump until after generating the instructions for the expression,
-		// so we stash where in the the ops list our CND op needs to go, which allows us to insert it when we have the address.
-		size_t cndOpAddr = state.Push(Program::Op::CND);
+	case Program::Op::POK:
+	case Program::Op::PUT:
+		return (int)op.val + 1;
 
-		// parse expression following the ?
-		// we decrement parseDepth before calling Parse because it's OK if the expression ends with a semi-colon.
-		// this will make the statement behave like an if statement.
-		state.parseDepth--;
-		if (Parse(state)) return 1;
-		state.parseDepth++;
+	case Program::Op::PEK:
+	case Program::Op::GET:
+	case Program::Op::FRQ:
+	case Program::Op::SQR:
+	case Program::Op::SIN:
+	case Program::Op::TRI:
+	case Program::Op::NEG:
+	case Program::Op::RND:
+	case Program::Op::CCV:
+	case Program::Op::VCV:
+	case Program::Op::NOT:
+	case Program::Op::COM:
+	case Program::Op::CND:
+	case Program::Op::POP:
+	case Program::Op::STV:
+	case Program::Op::ADI:
+	case Program::Op::SBI:
+	case Program::Op::MLI:
+	case Program::Op::DVI:
+	case Program::Op::MDI:
+	case Program::Op::ANI:
+	case Program::Op::ORI:
+	case Program::Op::XRI:
+	case Program::Op::SLI:
+	case Program::Op::SRI:
+	case Program::Op::DVR:
+	case Program::Op::MDR:
+		return 1;
 
-		state.SkipWhitespace();
+	case Program::Op::SEL:
+		return 3;
 
-		// this means it ended with a semi-colon, we need to insert some instructions before this, so we remove it and add it back
-		bool hasPop = state.ops.back().code == Program::Op::POP;
-		if (hasPop)
-		{
-			state.ops.pop_back();
-		}
-		
-		// add a JMP instruction so we can skip what comes next, which is the "false" part of the expression
-		size_t jmpOpAddr = state.Push(Program::Op::JMP);
-		// CND needs to jump to the instruction that follows the JMP
-		state.ops[cndOpAddr].val = state.ops.size();
-		
-		// if there is a colon, the user has provided code to execute for "false".
-		// if there isn't, then we need to provide the result of the expression, which will simply be 0.
-		// in other words:
-		//		a = b ? c;
-		// is simply syntactic sugar for:
-		//		a = b ? c : 0;
-		if (*state == ':')
-		{	
-			// if they put a semi-colon before the colon, Parse won't have caught it, so we do so here
-			if (hasPop)
-			{
-				state.error = Program::CE_ILLEGAL_STATEMENT_TERMINATION;
-				return 1;
-			}
+	default:
+		return 2;
+	}
+}
 
-			// eat the colon
-			state.parsePos++;
-			// when parsing what follows the colon, we decrement parse depth before recursing to Parse.
-			// this is so that if the line terminates with a semi-colon, we won't get an
-			// illegal statement termination error, unless we were already within parens.
-			state.parseDepth--;
-			if (Parse(state)) return 1;
-			state.parseDepth++;
-		}	
-		else
+// determine the maximum depth the stack can reach when running ops by following every path through the code.
+static size_t ComputeStackSize(const ArenaVector<Program::Op>& ops)
+{
+	// the compiler only ever generates forward jumps, so a single pass in order
+	// is enough to know the depth on entry to every op before we get to it.
+	// when two paths arrive at the same op we keep the larger depth.
+	const int unreached = -1;
+	ArenaVector<int> depthAt(ops.size() + 1, unreached);
+	depthAt[0] = 0;
+
+	size_t maxDepth = 0;
+	for (size_t pc = 0; pc < ops.size(); ++pc)
+	{
+		if (depthAt[pc] == unreached)
 		{
-			state.Push(Program::Op::PSH, 0);
+			continue;
+		}
 
-			// include the semi-colon that is in the source
-			if (hasPop)
-			{
-				state.Push(Program::Op::POP);
-			}
+		const Program::Op& op = ops[pc];
+		int depth = depthAt[pc] + StackEffect(op);
+		// an op that pops from an empty stack will fail with RE_MISSING_OPERAND at runtime
+		if (depth < 0)
+		{
+			depth = 0;
 		}
+		maxDepth = std::max(maxDepth, (size_t)std::max(depthAt[pc], depth));
 
-		// if the statement terminated in a semi-colon we will have a POP on the end of the list.
-		// we need to jump directly to that POP because it *might* be replaced with a PEK or PUT.
-		if (state.ops.back().code == Program::Op::POP)
+		if ((op.code == Program::Op::CND || op.code == Program::Op::JMP) && op.val > pc && op.val <= ops.size())
 		{
-			state.ops[jmpOpAddr].val = state.ops.size() - 1;
+			depthAt[op.val] = std::max(depthAt[op.val], depth);
 		}
-		else
+
+		if (op.code != Program::Op::JMP)
 		{
-			// when there's no POP we need to JMP to the instruction that will follow it.
-			state.ops[jmpOpAddr].val = state.ops.size();
+			depthAt[pc + 1] = std::max(depthAt[pc + 1], depth);
 		}
 	}
+
+	return maxDepth;
 }
 
-static int ParsePOK(CompilationState& state)
+// prove that running ops can never pop more values than are on the stack, that every POP leaves the stack empty,
+// that at most the result is left on the stack at the end, and that every jump lands inside of the program.
+// those are all of the stack checks the engines would otherwise make for each op, so code that passes runs without them.
+// depthAt receives the depth of the stack on entry to each op, or -1 for ops that can't be reached.
+static bool Verify(const ArenaVector<Program::Op>& ops, ArenaVector<int>& depthAt)
 {
-	if (ParseCND(state)) return 1;
-	for (;;)
+	// the same walk as ComputeStackSize, except that every path to an op has to arrive with the same depth
+	const int unreached = -1;
+	depthAt.assign(ops.size() + 1, unreached);
+	depthAt[0] = 0;
+	auto Arrive = [&depthAt, unreached](const size_t pc, const int depth)
 	{
-		state.SkipWhitespace();
-		Program::Char op = *state;
-		if (op != '=')
-		{
-			return 0;
-		}
-		state.parsePos++;
-		// PEK and GET work by popping a value from the stack to use as the lookup address.
-		// so when we want to POK or PUT, we can use that same address to know where in memory to assign the result of the right side.
-		// we just need to remove the existing instruction so the address will still be on the stack after the instructions generated by ParseTRN complete.
-		// we require the presence of a PEK or GET instruction because we don't want to allow statements like '5 = 4'
-		// instead, we accept '@5 = 4', which means "set memory address 5 to the value 4".
-		// similarly, 'a = 4' will assign 4 to the memory address reserved for the variable 'a' (see ParseAtom).
-		// [0] = 5 will put the value 5 into first output result
-		Program::Op::Code code = state.ops.back().code;
-		if (code == Program::Op::PEK || code == Program::Op::GET)
-		{
-			state.ops.pop_back();
-		}
-		else
+		if (depthAt[pc] != unreached && depthAt[pc] != depth)
 		{
-			state.error = Program::CE_ILLEGAL_ASSIGNMENT;
-			return 1;
+			return false;
 		}
+		depthAt[pc] = depth;
+		return true;
+	};
 
-		state.SkipWhitespace();
-		// how many values to POK or PUT
-		int pcount = 0;
-		// check for the beginning of an "array" on the right side of the equals sign.		
-		if (*state == '{')
+	for (size_t pc = 0; pc < ops.size(); ++pc)
+	{
+		const int depth = depthAt[pc];
+		if (depth == unreached)
 		{
-			state.parsePos++;
-			for(;;)
-			{
-				if (Parse(state)) return 1;
-				++pcount;
-				
-				if (*state == ',')
-				{					
-					state.parsePos++;
-					continue;
-				}
-
-				// if we didn't find a comma, we *should* find the closing brace
-				if (*state == '}')
-				{
-					state.parsePos++;
-					break;					
-				}
-				else
-				{
-					state.error = Program::CE_MISSING_BRACE;
-					return 1;
-				}
-			}
+			continue;
 		}
-		else // no array, so it's just a single expression
+
+		const Program::Op& op = ops[pc];
+		const int after = depth + StackEffect(op);
+		if (depth < StackInputs(op) || (op.code == Program::Op::POP && after != 0))
 		{
-			// decrement the parse depth before recursing because it's 
-			// OK if the expression on the right hand side terminates in a semi-colon
-			state.parseDepth--;
-			if (Parse(state)) return 1;
-			state.parseDepth++;	
-			pcount = 1;
+			return false;
 		}
 
-		// the statement on the right side of the '=' might have ended with a semi-colon,
-		// which means the last op will be a POP. we need to POK or PUT before that.
-		const bool hasPOP = state.ops.back().code == Program::Op::POP;
-		if (hasPOP)
+		if (op.code == Program::Op::CND || op.code == Program::Op::JMP)
 		{
-			state.ops.pop_back();
+			if (op.val <= pc || op.val > ops.size() || !Arrive((size_t)op.val, after))
+			{
+				return false;
+			}
 		}
-		switch (code)
-		{
-		case Program::Op::PEK:
-			state.Push(Program::Op::POK, pcount);
-			break;
 
-		case Program::Op::GET:
-			state.Push(Program::Op::PUT, pcount);
-			break;
-			
-		// fix warning in osx
-		default:
-			break;
-		}
-		if (hasPOP)
+		if (op.code != Program::Op::JMP && !Arrive(pc + 1, after))
 		{
-			state.Push(Program::Op::POP);
+			return false;
 		}
 	}
+
+	return depthAt[ops.size()] <= 1;
 }
 
-// we start here so that we don't have to change the forward declare for ParseAtom when we add another level
-static int Parse(CompilationState& state)
+// whether verified ops can run for several frames at once (see CompiledProgram::lanes).
+// RND is allowed because RunBlock only uses lanes for it with RM_COUNTER, where each frame's numbers only depend on its 't'.
+static bool RunsInLanes(const ArenaVector<Program::Op>& ops, const size_t memorySize)
 {
-	state.parseDepth++;
+	for (const Program::Op& op : ops)
 	{
-		if (ParsePOK(state)) return 1;
-		// check for statement termination
-		state.SkipWhitespace();
-		if (*state == ';')
+		if (op.code == Program::Op::POK || (op.code == Program::Op::STV && op.val < memorySize))
 		{
-			// if we have recursed into Parse due to opening parens
-			// or due to parsing a section of a ternary operator,
-			// we should throw an error if we encounter a semi-colon
-			// because those constructs will not evaluate correctly
-			// if a POP appears in the middle of the instructions.
-			if (state.parseDepth != 1)
-			{
-				state.error = Program::CE_ILLEGAL_STATEMENT_TERMINATION;
-				return 1;
-			}
-			state.parsePos++;
-			state.Push(Program::Op::POP);
-			// skip space immediately after statement termination
-			// in case this is the last symbol of the program but there is trailing whitespace
-			state.SkipWhitespace();
+			return false;
 		}
 	}
-	state.parseDepth--;
-	return 0;
+	return true;
 }
 
-Program* Program::Compile(const Char* source, const size_t userMemorySize, CompileError& outError, int& outErrorPosition)
-{
-	Program* program = nullptr;
-	CompilationState state(source, userMemorySize);
+//////////////////////////////////////////////////////////////////////////
+// OPTIMIZATION
+//////////////////////////////////////////////////////////////////////////
+// the optimization passes rewrite the ops generated by the parser into a shorter sequence that does the same thing.
+// a pass builds a new list of ops from the old one, recording where each old op wound up,
+// so that the addresses of CND and JMP instructions can be corrected once the pass is done.
 
-	while (*state != '\0')
+// mark every op that a CND or JMP can land on. these are places where the stack can arrive from somewhere else,
+// so passes must never combine an op with the ops that come before it when it is a jump target.
+static ArenaVector<bool> FindJumpTargets(const ArenaVector<Program::Op>& ops)
+{
+	ArenaVector<bool> targets(ops.size() + 1, false);
+	for (const Program::Op& op : ops)
 	{
-		if (Parse(state)) break;
-		// if we aren't at the end yet, we should have a POP as the last op.
-		if (*state != '\0' && state.ops.back().code != Op::POP)
+		if ((op.code == Program::Op::CND || op.code == Program::Op::JMP) && op.val <= ops.size())
 		{
-			state.error = CE_UNEXPECTED_CHAR;
-			break;
+			targets[op.val] = true;
 		}
 	}
+	return targets;
+}
 
-	// final error checking
-	if (state.error == CE_NONE)
+// oldToNew[i] is the index in ops of the first op emitted for what was at index i before the pass ran
+static void RemapJumps(ArenaVector<Program::Op>& ops, const ArenaVector<size_t>& oldToNew)
+{
+	for (Program::Op& op : ops)
 	{
-		// Now, expr should point to '\0', and _paren_count should be zero
-		if (state.parenCount != 0 || *state == ')')
-		{
-			state.error = CE_MISSING_PAREN;
-		}
-		else if (*state != '\0')
-		{
-			state.error = CE_UNEXPECTED_CHAR;
-		}
-		// make sure the program includes at least one PUT.
-		// we consider it a compilation error if it doesn't
-		// since the resulting program would output nothing 
-		// and therefore be useless.
-		else
+		if ((op.code == Program::Op::CND || op.code == Program::Op::JMP) && op.val < oldToNew.size())
 		{
-			bool hasPut = false;
-			for (auto& op : state.ops)
-			{
-				hasPut = hasPut || op.code == Op::PUT;
-			}
-
-			if (!hasPut)
-			{
-				state.error = CE_MISSING_PUT;
-			}
+			op.val = oldToNew[op.val];
 		}
 	}
+}
 
-	// now create a program or don't
-	if (state.error == CE_NONE)
+// evaluate a unary or binary op on constant operands the same way Exec would.
+// returns false for ops that don't have a constant result (or would be a runtime error, like dividing by zero).
+static bool Evaluate(const Program::Op::Code code, const Program::Value a, const Program::Value b, Program::Value& out)
+{
+	typedef Program::Op Op;
+	switch (code)
 	{
-		outError = CE_NONE;
-		outErrorPosition = -1;
-		program = new Program(state.ops, userMemorySize);
+	case Op::NEG: out = -a; return true;
+	case Op::COM: out = ~a; return true;
+	case Op::NOT: out = !a; return true;
+	case Op::MUL: out = a*b; return true;
+	case Op::DIV: out = b ? a / b : 0; return b != 0;
+	case Op::MOD: out = b ? a % b : 0; return b != 0;
+	case Op::ADD: out = a + b; return true;
+	case Op::SUB: out = a - b; return true;
+	case Op::BSL: out = a << (b % 64); return true;
+	case Op::BSR: out = a >> (b % 64); return true;
+	case Op::AND: out = a&b; return true;
+	case Op::OR:  out = a | b; return true;
+	case Op::XOR: out = a^b; return true;
+	case Op::CEQ: out = a == b; return true;
+	case Op::CNE: out = a != b; return true;
+	case Op::CLT: out = a < b; return true;
+	case Op::CLE: out = a <= b; return true;
+	case Op::CGT: out = a > b; return true;
+	case Op::CGE: out = a >= b; return true;
+	default: return false;
 	}
-	else
+}
+
+// is x (op) k == x for all x
+static bool IsRightIdentity(const Program::Op::Code code, const Program::Value k)
+{
+	typedef Program::Op Op;
+	switch (code)
 	{
-		outError = state.error;
-		outErrorPosition = state.parsePos;
+	case Op::ADD: case Op::SUB: case Op::OR: case Op::XOR: return k == 0;
+	case Op::BSL: case Op::BSR: return k % 64 == 0;
+	case Op::MUL: case Op::DIV: return k == 1;
+	case Op::AND: return k == ~(Program::Value)0;
+	default: return false;
 	}
-
-	return program;
 }
-#pragma endregion
-
-//////////////////////////////////////////////////////////////////////////
-// EXECUTION
-//////////////////////////////////////////////////////////////////////////
-#pragma region Execution
 
-const char * Program::GetErrorString(Program::RuntimeError error)
+// is k (op) x == x for all x
+static bool IsLeftIdentity(const Program::Op::Code code, const Program::Value k)
 {
-	switch (error)
+	typedef Program::Op Op;
+	switch (code)
 	{
-	case RE_NONE:
-		return "None";
-	case RE_DIVIDE_BY_ZERO:
-		return "Divide by zero";
-	case RE_MISSING_OPERAND:
-		return "Missing operand";
-	case RE_MISSING_OPCODE:
-		return "Unimplemented opcode";
-	case RE_INCONSISTENT_STACK:
-		return "Inconsistent stack";
-	case RE_EMPTY_PROGRAM:
-		return "Empty program (instruction count is zero)";
-	case RE_GET_OUT_OF_BOUNDS:
-		return "Input access is out of bounds";
-	case RE_PUT_OUT_OF_BOUNDS:
-		return "Output access is out of bounds";
-	default:
-		return "Unknown";
+	case Op::ADD: case Op::OR: case Op::XOR: return k == 0;
+	case Op::MUL: return k == 1;
+	case Op::AND: return k == ~(Program::Value)0;
+	default: return false;
 	}
 }
 
-Program::RuntimeError Program::Run(Value* results, const size_t size)
+// fold operations on constants into a single PSH and remove operations that don't change their operand,
+// like +0, *1, |0, and pairs of negations. subtraction of a negation becomes addition (and vice versa).
+// all arithmetic is done in Value, so it wraps around exactly like it does when the program runs.
+// returns the number of ops removed.
+static size_t FoldConstants(ArenaVector<Program::Op>& ops)
 {
-	RuntimeError error = RE_NONE;
-	const uint64_t icount = GetInstructionCount();
-	if (icount > 0)
+	typedef Program::Op Op;
+	const size_t unknown = (size_t)-1;
+	const ArenaVector<bool> targets = FindJumpTargets(ops);
+	ArenaVector<Op> out;
+	out.reserve(ops.size());
+	ArenaVector<size_t> oldToNew(ops.size() + 1);
+	// ops before this index in out can't be changed because something might jump between them and what comes next
+	size_t regionStart = 0;
+	// the index in out where the code for each value on the stack begins, for values pushed since regionStart
+	ArenaVector<size_t> starts;
+
+	for (size_t i = 0; i < ops.size(); ++i)
 	{
-		pc = 0;
-		for (; pc < icount && error == RE_NONE; ++pc)
+		const Op op = ops[i];
+		if (targets[i])
 		{
-			error = Exec(ops[pc], results, size);
+			regionStart = out.size();
+			starts.clear();
 		}
+		oldToNew[i] = out.size();
+
+		const int inputs = StackInputs(op);
+		const int outputs = inputs + StackEffect(op);
+		// the index in out of the constant operand at depth from the top of the stack, or unknown
+		auto constant = [&](size_t depth) -> size_t
+		{
+			if (starts.size() <= depth) return unknown;
+			const size_t start = starts[starts.size() - 1 - depth];
+			const size_t end = depth == 0 ? out.size() : starts[starts.size() - depth];
+			return start != unknown && start >= regionStart && end == start + 1 && out[start].code == Op::PSH ? start : unknown;
+		};
 
-		// under error-free execution we should have either 1 or 0 values in the stack.
-		// 1 when a program terminates with the result of an expression (eg: t*Fn)
-		// 0 when a program terminates with a POP (eg: t*Fn;)
-		// in the case of the POP, the value of the expression will already be in result.
-		if (error == RE_NONE)
+		bool handled = false;
+		if (inputs == 1 && outputs == 1 && op.code != Op::CND)
+		{
+			const size_t a = constant(0);
+			Program::Value result;
+			if (a != unknown && Evaluate(op.code, out[a].val, 0, result))
+			{
+				out[a].val = result;
+				handled = true;
+			}
+			// double negation and double complement cancel out
+			else if ((op.code == Op::NEG || op.code == Op::COM) && out.size() > regionStart && out.back().code == op.code && !starts.empty() && starts.back() != unknown)
+			{
+				out.pop_back();
+				handled = true;
+			}
+		}
+		else if (inputs == 2 && outputs == 1)
 		{
-			if (stack.size() > 1)
+			const size_t a = constant(1);
+			const size_t b = constant(0);
+			Program::Value result;
+			if (a != unknown && b != unknown && Evaluate(op.code, out[a].val, out[b].val, result))
+			{
+				out[a].val = result;
+				out.pop_back();
+				starts.pop_back();
+				handled = true;
+			}
+			else if (b != unknown && IsRightIdentity(op.code, out[b].val))
+			{
+				out.pop_back();
+				starts.pop_back();
+				handled = true;
+			}
+			else if (a != unknown && IsLeftIdentity(op.code, out[a].val))
+			{
+				// remove the PSH of the left operand, everything after it moves down by one.
+				// nothing after regionStart is a jump target, so only the starts need to be fixed up.
+				out.erase(out.begin() + a);
+				starts.pop_back();
+				starts.pop_back();
+				starts.push_back(a);
+				handled = true;
+			}
+			// a - -b is a + b, and a + -b is a - b
+			else if ((op.code == Op::ADD || op.code == Op::SUB) && out.size() > regionStart && out.back().code == Op::NEG && !starts.empty() && starts.back() != unknown)
 			{
-				error = RE_INCONSISTENT_STACK;
+				out.pop_back();
+				out.push_back(Op(op.code == Op::ADD ? Op::SUB : Op::ADD, 0));
+				starts.pop_back();
+				handled = true;
 			}
 		}
 
-		// clear the stack so it doesn't explode in size due to continual runtime errors
-		while (stack.size() > 0)
+		if (handled)
 		{
-			stack.pop();
+			continue;
 		}
-	}
-	else
-	{
-		error = RE_EMPTY_PROGRAM;
-	}
 
-	return error;
-}
+		// track where the result of this op starts
+		size_t start = out.size();
+		for (int n = 0; n < inputs; ++n)
+		{
+			start = starts.empty() ? unknown : starts.back();
+			if (!starts.empty()) starts.pop_back();
+		}
+		if (outputs == 1)
+		{
+			starts.push_back(start);
+		}
 
-#define POP1 if ( stack.size() < 1 ) goto bad_stack; Value a = stack.top(); stack.pop();
-#define POP2 if ( stack.size() < 2 ) goto bad_stack; Value b = stack.top(); stack.pop(); Value a = stack.top(); stack.pop();
-#define POP3 if ( stack.size() < 3 ) goto bad_stack; Value c = stack.top(); stack.pop(); Value b = stack.top(); stack.pop(); Value a = stack.top(); stack.pop();
-#define POP(n) if (stack.size() < n) goto bad_stack; std::vector<Value> args; for(int i = 0; i < n; ++i) { args.push_back(stack.top()); stack.pop(); }
+		out.push_back(op);
 
-// perform the operation
+		if (op.code == Op::CND || op.code == Op::JMP)
+		{
+			regionStart = out.size();
+			starts.clear();
+		}
+	}
+	oldToNew[ops.size()] = out.size();
+
+	RemapJumps(out, oldToNew);
+	const size_t removed = ops.size() - out.size();
+	ops.swap(out);
+	return removed;
+}
+
+// the version of a binary operator that takes its right operand from val, or NOP if there isn't one
+static Program::Op::Code ImmediateForm(const Program::Op::Code code)
+{
+	typedef Program::Op Op;
+	switch (code)
+	{
+	case Op::ADD: return Op::ADI;
+	case Op::SUB: return Op::SBI;
+	case Op::MUL: return Op::MLI;
+	case Op::DIV: return Op::DVI;
+	case Op::MOD: return Op::MDI;
+	case Op::AND: return Op::ANI;
+	case Op::OR:  return Op::ORI;
+	case Op::XOR: return Op::XRI;
+	case Op::BSL: return Op::SLI;
+	case Op::BSR: return Op::SRI;
+	default: return Op::NOP;
+	}
+}
+
+// replace common pairs of instructions with a single fused instruction:
+//   PSH address, PEK                  -> LDV address
+//   PSH address, <value>, POK 1       -> <value>, STV address
+//   PSH constant, <binary operator>   -> <operator>I constant
+// constant addresses are wrapped to memorySize here so the fused instructions can index memory directly.
+// returns the number of ops removed.
+static size_t FuseInstructions(ArenaVector<Program::Op>& ops, const size_t memorySize)
+{
+	typedef Program::Op Op;
+	const size_t unknown = (size_t)-1;
+	const ArenaVector<bool> targets = FindJumpTargets(ops);
+	ArenaVector<Op> out;
+	out.reserve(ops.size());
+	ArenaVector<size_t> oldToNew(ops.size() + 1);
+	// same bookkeeping as FoldConstants
+	size_t regionStart = 0;
+	ArenaVector<size_t> starts;
+
+	for (size_t i = 0; i < ops.size(); ++i)
+	{
+		const Op op = ops[i];
+		if (targets[i])
+		{
+			regionStart = out.size();
+			starts.clear();
+		}
+		oldToNew[i] = out.size();
+
+		const bool follows = !targets[i] && out.size() > regionStart;
+		if (follows && out.back().code == Op::PSH)
+		{
+			Op& prev = out.back();
+			const Op::Code immediate = ImmediateForm(op.code);
+			if (op.code == Op::PEK)
+			{
+				// the start of the value on the stack is unchanged
+				prev = Op(Op::LDV, prev.val % memorySize);
+				continue;
+			}
+			// dividing by a constant zero is left alone so that it still fails at runtime
+			if (immediate != Op::NOP && !((immediate == Op::DVI || immediate == Op::MDI) && prev.val == 0))
+			{
+				prev = Op(immediate, immediate == Op::SLI || immediate == Op::SRI ? prev.val % 64 : prev.val);
+				// the result starts where the left operand did
+				starts.pop_back();
+				continue;
+			}
+		}
+
+		if (op.code == Op::POK && op.val == 1 && !targets[i] && starts.size() >= 2)
+		{
+			const size_t address = starts[starts.size() - 2];
+			if (address != unknown && address >= regionStart && starts.back() == address + 1 && out[address].code == Op::PSH)
+			{
+				// nothing from address onward is a jump target, so removing the PSH only moves the value down
+				const Op store(Op::STV, out[address].val % memorySize);
+				out.erase(out.begin() + address);
+				out.push_back(store);
+				starts.pop_back();
+				starts.back() = address;
+				continue;
+			}
+		}
+
+		const int inputs = StackInputs(op);
+		const int outputs = inputs + StackEffect(op);
+		size_t start = out.size();
+		for (int n = 0; n < inputs; ++n)
+		{
+			start = starts.empty() ? unknown : starts.back();
+			if (!starts.empty()) starts.pop_back();
+		}
+		if (outputs == 1)
+		{
+			starts.push_back(start);
+		}
+
+		out.push_back(op);
+
+		if (op.code == Op::CND || op.code == Op::JMP)
+		{
+			regionStart = out.size();
+			starts.clear();
+		}
+	}
+	oldToNew[ops.size()] = out.size();
+
+	RemapJumps(out, oldToNew);
+	const size_t removed = ops.size() - out.size();
+	ops.swap(out);
+	return removed;
+}
+
+// the most ops either side of a ternary can have for SelectBranches to compute both of them
+static const size_t kMaxSelectArm = 8;
+
+// replace ternaries whose branches are short and can't fail or change anything with SEL,
+// which computes both branches and keeps one of them, so the result doesn't depend on a branch the cpu has to predict.
+// the parser generates [condition] CND else [then] JMP end else: [else] end: and this becomes [condition] [then] [else] SEL.
+// ternaries are visited from the last to the first, so a nested ternary is already a SEL when the one containing it is looked at.
+// returns the number of ops removed.
+static size_t SelectBranches(ArenaVector<Program::Op>& ops)
+{
+	typedef Program::Op Op;
+	const size_t count = ops.size();
+	// how many jumps land on each op, not counting the ones of ternaries that are being replaced
+	ArenaVector<size_t> landings(count + 1, 0);
+	for (const Op& op : ops)
+	{
+		if ((op.code == Op::CND || op.code == Op::JMP) && op.val <= count)
+		{
+			landings[op.val]++;
+		}
+	}
+	ArenaVector<bool> removed(count, false);
+	// how many SELs go right before each op
+	ArenaVector<size_t> selects(count + 1, 0);
+
+	// can the ops from first up to last be run when the branch isn't taken, leaving one more value on the stack than before.
+	// nothing may jump between them. selects[first] belong to a ternary that ends where this one starts, selects[last] to ones that end with it.
+	auto computable = [&](const size_t first, const size_t last) -> bool
+	{
+		int depth = 0;
+		size_t length = 0;
+		for (size_t i = first; i <= last; ++i)
+		{
+			for (size_t n = 0; i > first && n < selects[i]; ++n)
+			{
+				if (depth < 3) return false;
+				depth -= 2;
+				length++;
+			}
+			if (i == last)
+			{
+				break;
+			}
+			if (i > first && landings[i] != 0)
+			{
+				return false;
+			}
+			if (removed[i])
+			{
+				continue;
+			}
+			const Op& op = ops[i];
+			switch (op.code)
+			{
+			case Op::PSH: case Op::PEK: case Op::LDV:
+			case Op::FRQ: case Op::SQR: case Op::SIN: case Op::TRI:
+			case Op::NEG: case Op::NOT: case Op::COM: case Op::CCV: case Op::VCV:
+			case Op::MUL: case Op::ADD: case Op::SUB:
+			case Op::BSL: case Op::BSR: case Op::AND: case Op::OR: case Op::XOR:
+			case Op::CEQ: case Op::CNE: case Op::CLT: case Op::CLE: case Op::CGT: case Op::CGE:
+			case Op::ADI: case Op::SBI: case Op::MLI: case Op::DVI: case Op::MDI:
+			case Op::ANI: case Op::ORI: case Op::XRI: case Op::SLI: case Op::SRI:
+				break;
+			default:
+				return false;
+			}
+			if (depth < StackInputs(op)) return false;
+			depth += StackEffect(op);
+			if (++length > kMaxSelectArm) return false;
+		}
+		return depth == 1;
+	};
+
+	size_t replaced = 0;
+	for (size_t i = count; i-- > 0;)
+	{
+		const Op& cnd = ops[i];
+		if (cnd.code != Op::CND || cnd.val <= i + 1 || cnd.val > count)
+		{
+			continue;
+		}
+		const size_t jmp = cnd.val - 1;
+		const Op& end = ops[jmp];
+		if (end.code != Op::JMP || end.val < cnd.val || end.val > count || landings[i] != 0 || landings[i + 1] != 0 || landings[jmp] != 0 || landings[cnd.val] != 1)
+		{
+			continue;
+		}
+		if (!computable(i + 1, jmp) || !computable(cnd.val, end.val))
+		{
+			continue;
+		}
+		removed[i] = true;
+		removed[jmp] = true;
+		landings[cnd.val]--;
+		landings[end.val]--;
+		selects[end.val]++;
+		replaced++;
+	}
+	if (replaced == 0)
+	{
+		return 0;
+	}
+
+	ArenaVector<Op> out;
+	out.reserve(count);
+	ArenaVector<size_t> oldToNew(count + 1);
+	for (size_t i = 0; i <= count; ++i)
+	{
+		// anything else that jumps to the end of a ternary comes after its SEL
+		for (size_t n = 0; n < selects[i]; ++n)
+		{
+			out.push_back(Op(Op::SEL, 0));
+		}
+		oldToNew[i] = out.size();
+		if (i < count && !removed[i])
+		{
+			out.push_back(ops[i]);
+		}
+	}
+
+	RemapJumps(out, oldToNew);
+	const size_t removedCount = count - out.size();
+	ops.swap(out);
+	return removedCount;
+}
+
+static Program::Value Log2(Program::Value v)
+{
+	Program::Value log2 = 0;
+	while (v >>= 1)
+	{
+		++log2;
+	}
+	return log2;
+}
+
+// rewrite division and modulo by values that can't change while a block is running:
+//   DVI 2^k               -> SRI k
+//   MDI 2^k               -> ANI 2^k-1
+//   DVI constant          -> DVR with a constant divisor (and the same for MDI and MDR)
+//   LDV address, DIV      -> DVR when the program never writes to address and RunBlock doesn't either
+//   PSH index, VCV, DIV   -> DVR with a V control divisor
+// PSH constant, DIV is treated the same as DVI, in case FuseInstructions didn't run.
+// returns the number of ops removed.
+static size_t ReduceDivision(ArenaVector<Program::Op>& ops, std::vector<Program::Divisor>& divisors, const size_t memorySize, const size_t userMemorySize)
+{
+	typedef Program::Op Op;
+	typedef Program::Divisor Divisor;
+
+	// find the variables that can change during a block.
+	// RunBlock sets 't', 'm', and 'q' every frame and a POK can write to any address it computes.
+	ArenaVector<bool> written(memorySize, false);
+	written[Program::GetAddress('t', userMemorySize)] = true;
+	written[Program::GetAddress('m', userMemorySize)] = true;
+	written[Program::GetAddress('q', userMemorySize)] = true;
+	bool writesAnywhere = false;
+	for (const Op& op : ops)
+	{
+		// temporaries are written by STV but they are never divisors
+		if (op.code == Op::STV && op.val < memorySize)
+		{
+			written[op.val] = true;
+		}
+		writesAnywhere = writesAnywhere || op.code == Op::POK;
+	}
+
+	auto divisorIndex = [&](const Divisor::Source source, const Program::Value index) -> Program::Value
+	{
+		for (size_t i = 0; i < divisors.size(); ++i)
+		{
+			if (divisors[i].source == source && divisors[i].index == index)
+			{
+				return i;
+			}
+		}
+		divisors.push_back(Divisor(source, index));
+		if (source == Divisor::DS_CONSTANT)
+		{
+			divisors.back().Derive(index);
+		}
+		return divisors.size() - 1;
+	};
+
+	const ArenaVector<bool> targets = FindJumpTargets(ops);
+	ArenaVector<Op> out;
+	out.reserve(ops.size());
+	ArenaVector<size_t> oldToNew(ops.size() + 1);
+	size_t regionStart = 0;
+	for (size_t i = 0; i < ops.size(); ++i)
+	{
+		const Op op = ops[i];
+		if (targets[i])
+		{
+			regionStart = out.size();
+		}
+		oldToNew[i] = out.size();
+
+		const bool divide = op.code == Op::DIV || op.code == Op::DVI;
+		const Op::Code reciprocal = divide ? Op::DVR : Op::MDR;
+		const bool divideByConstant = (op.code == Op::DIV || op.code == Op::MOD) && !targets[i] && out.size() > regionStart && out.back().code == Op::PSH && out.back().val != 0;
+		if (op.code == Op::DVI || op.code == Op::MDI || divideByConstant)
+		{
+			// the optimizer never creates DVI or MDI with a zero divisor
+			const Program::Value k = divideByConstant ? out.back().val : op.val;
+			if (divideByConstant)
+			{
+				out.pop_back();
+			}
+			if ((k & (k - 1)) == 0)
+			{
+				out.push_back(divide ? Op(Op::SRI, Log2(k)) : Op(Op::ANI, k - 1));
+			}
+			else
+			{
+				out.push_back(Op(reciprocal, divisorIndex(Divisor::DS_CONSTANT, k)));
+			}
+			continue;
+		}
+
+		if ((op.code == Op::DIV || op.code == Op::MOD) && !targets[i] && out.size() > regionStart)
+		{
+			const Op& prev = out.back();
+			if (prev.code == Op::LDV && prev.val < memorySize && !writesAnywhere && !written[prev.val])
+			{
+				out.back() = Op(reciprocal, divisorIndex(Divisor::DS_MEMORY, prev.val));
+				continue;
+			}
+			if (prev.code == Op::VCV && out.size() - regionStart >= 2 && out[out.size() - 2].code == Op::PSH)
+			{
+				const Program::Value index = out[out.size() - 2].val;
+				out.pop_back();
+				out.back() = Op(reciprocal, divisorIndex(Divisor::DS_VC, index));
+				continue;
+			}
+		}
+
+		out.push_back(op);
+
+		if (op.code == Op::CND || op.code == Op::JMP)
+		{
+			regionStart = out.size();
+		}
+	}
+	oldToNew[ops.size()] = out.size();
+
+	RemapJumps(out, oldToNew);
+	const size_t removed = ops.size() - out.size();
+	ops.swap(out);
+	return removed;
+}
+
+// find pure expressions that are computed more than once in a straight run of code with the same inputs,
+// and compute them once, storing the result in a hidden temporary with STV that later uses read with LDV.
+// every op gets a value number for the value it leaves on the stack. two ops get the same number when they
+// do the same thing to values with the same numbers, and any memory they read hasn't been written in between,
+// so a POK or STV between two uses of a variable gives the uses different numbers.
+// temporaries are allocated at memorySize and up, temporaryCount receives how many are needed.
+// returns the number of ops removed. an expression is only reused when that removes more instructions than the STV adds.
+static size_t EliminateCommonSubexpressions(ArenaVector<Program::Op>& ops, const size_t memorySize, const size_t userMemorySize, size_t& temporaryCount)
+{
+	typedef Program::Op Op;
+	typedef Program::Value Value;
+	const size_t none = (size_t)-1;
+	const size_t count = ops.size();
+	const ArenaVector<bool> targets = FindJumpTargets(ops);
+
+	// for each op: the value number of its result, the index of the first op of its expression,
+	// the op that uses its result, and whether an earlier op in the same run computed the same value.
+	ArenaVector<size_t> number(count, none);
+	ArenaVector<size_t> start(count, none);
+	ArenaVector<size_t> consumer(count, none);
+	ArenaVector<bool> repeated(count, false);
+	// the op that computed each value number first
+	ArenaVector<size_t> first;
+	// how many ops before each op do something other than compute a value (like assignments and statement POPs).
+	// an expression containing one of those can't be removed, even if its value is the same.
+	ArenaVector<size_t> effectsBefore(count + 1, 0);
+
+	ArenaMap<ArenaVector<Value>, size_t> numbers;
+	// the op that pushed each value on the stack since the start of the run, none when it came from before that
+	ArenaVector<size_t> pushedBy;
+	// memory versions: writes to each address, writes to any address, and writes to results
+	ArenaVector<Value> version(memorySize, 0);
+	Value memoryWrites = 0;
+	Value resultWrites = 0;
+	const Value w = Program::GetAddress('w', userMemorySize);
+	const Value sr = Program::GetAddress('~', userMemorySize);
+
+	bool runEnded = true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Op& op = ops[i];
+		if (targets[i] || runEnded)
+		{
+			// values can't be reused across a jump
+			numbers.clear();
+			pushedBy.clear();
+			runEnded = false;
+		}
+
+		const int inputs = StackInputs(op);
+		const int outputs = inputs + StackEffect(op);
+		ArenaVector<Value> key = { (Value)op.code };
+		bool known = (int)pushedBy.size() >= inputs;
+		size_t from = i;
+		for (int n = 0; n < inputs && known; ++n)
+		{
+			const size_t input = pushedBy[pushedBy.size() - inputs + n];
+			known = input != none && number[input] != none;
+			if (known)
+			{
+				consumer[input] = i;
+				key.push_back(number[input]);
+				from = n == 0 ? start[input] : from;
+			}
+		}
+		pushedBy.resize(pushedBy.size() >= (size_t)inputs ? pushedBy.size() - inputs : 0);
+
+		bool pure = true;
+		switch (op.code)
+		{
+		case Op::PSH:
+		case Op::ADI: case Op::SBI: case Op::MLI: case Op::DVI: case Op::MDI:
+		case Op::ANI: case Op::ORI: case Op::XRI: case Op::SLI: case Op::SRI:
+			key.push_back(op.val);
+			break;
+		case Op::LDV:
+			key.push_back(op.val);
+			key.push_back(op.val < memorySize ? version[op.val] : 0);
+			key.push_back(memoryWrites);
+			break;
+		case Op::PEK:
+			key.push_back(memoryWrites);
+			break;
+		// these depend on 'w'
+		case Op::SIN: case Op::SQR: case Op::TRI:
+			key.push_back(version[w]);
+			key.push_back(memoryWrites);
+			break;
+		// this depends on '~'
+		case Op::FRQ:
+			key.push_back(version[sr]);
+			key.push_back(memoryWrites);
+			break;
+		case Op::GET:
+			key.push_back(resultWrites);
+			break;
+		case Op::NEG: case Op::NOT: case Op::COM: case Op::CCV: case Op::VCV:
+		case Op::MUL: case Op::DIV: case Op::MOD: case Op::ADD: case Op::SUB:
+		case Op::BSL: case Op::BSR: case Op::AND: case Op::OR: case Op::XOR:
+		case Op::CEQ: case Op::CNE: case Op::CLT: case Op::CLE: case Op::CGT: case Op::CGE:
+		case Op::SEL:
+			break;
+		case Op::STV:
+			if (op.val < memorySize) version[op.val]++;
+			memoryWrites++;
+			pure = false;
+			break;
+		case Op::POK:
+			// the address isn't known, so this could write anywhere
+			memoryWrites++;
+			pure = false;
+			break;
+		case Op::PUT:
+			resultWrites++;
+			pure = false;
+			break;
+		default:
+			pure = false;
+			break;
+		}
+
+		if (outputs == 1)
+		{
+			if (pure && known)
+			{
+				auto found = numbers.find(key);
+				if (found == numbers.end())
+				{
+					found = numbers.insert(std::make_pair(key, first.size())).first;
+					first.push_back(i);
+				}
+				else
+				{
+					repeated[i] = effectsBefore[i] == effectsBefore[from];
+				}
+				number[i] = found->second;
+				start[i] = from;
+			}
+			else
+			{
+				// a new value that nothing else can match
+				number[i] = first.size();
+				first.push_back(none);
+				start[i] = known ? from : none;
+			}
+			pushedBy.push_back(i);
+		}
+
+		effectsBefore[i + 1] = effectsBefore[i] + (pure && outputs == 1 ? 0 : 1);
+		if (op.code == Op::CND || op.code == Op::JMP)
+		{
+			runEnded = true;
+		}
+	}
+
+	// choose which repeats to replace. only the outermost repeat of an expression is replaced, since that removes everything inside of it.
+	// reusing a value number costs an STV, so it has to remove more than one instruction to be worth it.
+	// when a value number isn't worth it, its repeats are dropped, which can make the repeats inside of them outermost.
+	ArenaVector<size_t> temporary(first.size(), none);
+	auto outermost = [&](const size_t i) { return repeated[i] && (consumer[i] == none || !repeated[consumer[i]]); };
+	for (bool changed = true; changed; )
+	{
+		changed = false;
+		ArenaVector<size_t> saved(first.size(), 0);
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (outermost(i))
+			{
+				saved[number[i]] += i - start[i];
+			}
+		}
+		for (size_t i = 0; i < count; ++i)
+		{
+			if (outermost(i) && saved[number[i]] <= 1)
+			{
+				repeated[i] = false;
+				changed = true;
+			}
+		}
+	}
+
+	ArenaVector<Op> out;
+	out.reserve(count);
+	ArenaVector<size_t> oldToNew(count + 1);
+	temporaryCount = 0;
+	// ops in a replaced repeat are skipped up to and including the op at the end of it
+	ArenaVector<size_t> replaceUntil(count, none);
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (outermost(i))
+		{
+			replaceUntil[start[i]] = i;
+			if (temporary[number[i]] == none)
+			{
+				temporary[number[i]] = memorySize + temporaryCount++;
+			}
+		}
+	}
+
+	for (size_t i = 0; i < count; ++i)
+	{
+		oldToNew[i] = out.size();
+		if (replaceUntil[i] != none)
+		{
+			const size_t end = replaceUntil[i];
+			out.push_back(Op(Op::LDV, temporary[number[end]]));
+			for (; i < end; ++i)
+			{
+				oldToNew[i + 1] = out.size() - 1;
+			}
+			continue;
+		}
+
+		out.push_back(ops[i]);
+		if (number[i] != none && first[number[i]] == i && temporary[number[i]] != none)
+		{
+			out.push_back(Op(Op::STV, temporary[number[i]]));
+		}
+	}
+	oldToNew[count] = out.size();
+
+	RemapJumps(out, oldToNew);
+	const size_t removed = ops.size() - out.size();
+	ops.swap(out);
+	return removed;
+}
+
+// move expressions that can't change while a block is running out of the code that runs for every sample.
+// an expression is block invariant when it is made only of constants, controls, oscillators,
+// and variables that nothing writes to during a block, the same as the divisors ReduceDivision finds.
+// each one that takes more than a single op is computed once by invariantOps, which RunBlock runs before the first sample,
+// and stored in a hidden temporary that replaces it with an LDV.
+// temporaries are allocated after the temporaryCount that are already in use, which is updated to include them.
+// ops is only changed if it passes Verify, so that the stack is known to be the same on every path.
+// returns the number of ops removed.
+static size_t HoistInvariants(ArenaVector<Program::Op>& ops, ArenaVector<Program::Op>& invariantOps, const size_t memorySize, const size_t userMemorySize, size_t& temporaryCount)
+{
+	typedef Program::Op Op;
+	typedef Program::Value Value;
+	const size_t count = ops.size();
+
+	ArenaVector<int> depthAt;
+	if (!Verify(ops, depthAt))
+	{
+		return 0;
+	}
+
+	// the same rules as ReduceDivision for which variables can change during a block
+	ArenaVector<bool> written(memorySize, false);
+	written[Program::GetAddress('t', userMemorySize)] = true;
+	written[Program::GetAddress('m', userMemorySize)] = true;
+	written[Program::GetAddress('q', userMemorySize)] = true;
+	bool writesAnywhere = false;
+	for (const Op& op : ops)
+	{
+		if (op.code == Op::STV && op.val < memorySize)
+		{
+			written[op.val] = true;
+		}
+		writesAnywhere = writesAnywhere || op.code == Op::POK;
+	}
+	auto unwritten = [&](const Value address) { return !writesAnywhere && address < memorySize && !written[address]; };
+	const bool oscillatorsInvariant = unwritten(Program::GetAddress('w', userMemorySize));
+	const bool frequencyInvariant = unwritten(Program::GetAddress('~', userMemorySize));
+
+	// the ops that compute each value on the stack, from first to last, and whether they are block invariant.
+	// values are never invariant across a jump, since the ops that computed them aren't next to the ops that use them,
+	// so the values from before the start of a run are only counted.
+	struct StackValue { size_t first; size_t last; bool invariant; };
+	ArenaVector<StackValue> stack;
+	size_t stackBelow = 0;
+	// the first and last op of each expression to hoist, which never overlap
+	ArenaVector<std::pair<size_t, size_t>> hoisted;
+	auto consume = [&](const StackValue& value)
+	{
+		// hoisting a single op would only replace it with another one
+		if (value.invariant && value.last > value.first)
+		{
+			hoisted.push_back(std::make_pair(value.first, value.last));
+		}
+	};
+	auto flush = [&]()
+	{
+		for (const StackValue& value : stack)
+		{
+			consume(value);
+		}
+		stack.clear();
+	};
+
+	const ArenaVector<bool> targets = FindJumpTargets(ops);
+	bool runEnded = true;
+	for (size_t i = 0; i < count; ++i)
+	{
+		const Op& op = ops[i];
+		if (depthAt[i] < 0)
+		{
+			continue;
+		}
+		if (targets[i] || runEnded)
+		{
+			flush();
+			stackBelow = depthAt[i];
+			runEnded = false;
+		}
+
+		bool hoistable = false;
+		switch (op.code)
+		{
+		case Op::PSH:
+		case Op::NEG: case Op::NOT: case Op::COM: case Op::CCV: case Op::VCV:
+		case Op::MUL: case Op::ADD: case Op::SUB:
+		case Op::BSL: case Op::BSR: case Op::AND: case Op::OR: case Op::XOR:
+		case Op::CEQ: case Op::CNE: case Op::CLT: case Op::CLE: case Op::CGT: case Op::CGE:
+		case Op::ADI: case Op::SBI: case Op::MLI: case Op::DVI: case Op::MDI:
+		case Op::ANI: case Op::ORI: case Op::XRI: case Op::SLI: case Op::SRI:
+		case Op::SEL:
+			hoistable = true;
+			break;
+		case Op::LDV:
+			hoistable = unwritten(op.val);
+			break;
+		case Op::SIN: case Op::SQR: case Op::TRI:
+			hoistable = oscillatorsInvariant;
+			break;
+		case Op::FRQ:
+			hoistable = frequencyInvariant;
+			break;
+		// DIV and MOD can fail with RE_DIVIDE_BY_ZERO, which has to happen at the sample that does it.
+		// everything else reads something that can change during a block or has a side effect.
+		default:
+			break;
+		}
+
+		const int inputs = StackInputs(op);
+		const int outputs = inputs + StackEffect(op);
+		// the inputs of an invariant op are computed by the ops right before it, so the expression is all of them
+		const size_t known = std::min((size_t)inputs, stack.size());
+		bool invariant = hoistable && known == (size_t)inputs;
+		size_t first = i;
+		size_t next = i;
+		for (size_t n = 0; n < known; ++n)
+		{
+			const StackValue& input = stack[stack.size() - 1 - n];
+			invariant = invariant && input.invariant && input.last + 1 == next;
+			first = next = input.first;
+		}
+		if (!invariant)
+		{
+			for (size_t n = 0; n < known; ++n)
+			{
+				consume(stack[stack.size() - 1 - n]);
+			}
+		}
+		stack.resize(stack.size() - known);
+		stackBelow -= inputs - known;
+		if (outputs == 1)
+		{
+			stack.push_back(StackValue{ first, i, invariant });
+		}
+
+		if (op.code == Op::CND || op.code == Op::JMP)
+		{
+			runEnded = true;
+		}
+	}
+	flush();
+
+	if (hoisted.empty())
+	{
+		return 0;
+	}
+	std::sort(hoisted.begin(), hoisted.end());
+
+	// the same expression in more than one place only needs one temporary
+	ArenaMap<ArenaVector<Value>, Value> temporaries;
+	ArenaVector<Op> out;
+	out.reserve(count);
+	ArenaVector<size_t> oldToNew(count + 1);
+	size_t next = 0;
+	for (size_t i = 0; i < count; ++i)
+	{
+		oldToNew[i] = out.size();
+		if (next < hoisted.size() && hoisted[next].first == i)
+		{
+			const size_t last = hoisted[next++].second;
+			ArenaVector<Value> key;
+			for (size_t k = i; k <= last; ++k)
+			{
+				key.push_back((Value)ops[k].code);
+				key.push_back(ops[k].val);
+			}
+			auto found = temporaries.insert(std::make_pair(key, (Value)(memorySize + temporaryCount)));
+			if (found.second)
+			{
+				++temporaryCount;
+				invariantOps.insert(invariantOps.end(), ops.begin() + i, ops.begin() + last + 1);
+				invariantOps.push_back(Op(Op::STV, found.first->second));
+				invariantOps.push_back(Op(Op::POP, 0));
+			}
+			out.push_back(Op(Op::LDV, found.first->second));
+			for (; i < last; ++i)
+			{
+				oldToNew[i + 1] = out.size() - 1;
+			}
+			continue;
+		}
+		out.push_back(ops[i]);
+	}
+	oldToNew[count] = out.size();
+
+	RemapJumps(out, oldToNew);
+	const size_t removed = ops.size() - out.size();
+	ops.swap(out);
+	return removed;
+}
+
+// run all of the optimization passes on code generated by the parser.
+// divisors receives the divisors referenced by any DVR and MDR instructions,
+// invariantOps the code to run before each block (see HoistInvariants),
+// and temporaryCount the number of hidden temporaries the ops use.
+static void Optimize(ArenaVector<Program::Op>& ops, ArenaVector<Program::Op>& invariantOps, std::vector<Program::Divisor>& divisors, size_t& temporaryCount, const size_t memorySize, const size_t userMemorySize, const uint32_t optimizations)
+{
+	if (optimizations & Program::OPT_FOLD_CONSTANTS)
+	{
+		FoldConstants(ops);
+	}
+
+	// fusing has to come after the passes that don't know about the fused instructions
+	if (optimizations & Program::OPT_FUSE_INSTRUCTIONS)
+	{
+		FuseInstructions(ops, memorySize);
+	}
+
+	// after fusing, so that the length of a branch is what it will run, and division by a constant is always DVI or MDI.
+	// only for code that can run in lanes, where a CND the lanes disagree on finishes every lane on its own.
+	// everywhere else the branch is cheaper than computing both sides, even when it is hard to predict.
+	// the passes after this only add STV to temporaries, which doesn't change the answer.
+	if ((optimizations & Program::OPT_SELECT) && RunsInLanes(ops, memorySize))
+	{
+		SelectBranches(ops);
+	}
+
+	temporaryCount = 0;
+	if (optimizations & Program::OPT_ELIMINATE_COMMON_SUBEXPRESSIONS)
+	{
+		EliminateCommonSubexpressions(ops, memorySize, userMemorySize, temporaryCount);
+	}
+
+	if (optimizations & Program::OPT_REDUCE_DIVISION)
+	{
+		ReduceDivision(ops, divisors, memorySize, userMemorySize);
+	}
+
+	// this comes last because the other passes can't see the code it moves into invariantOps
+	if (optimizations & Program::OPT_HOIST_INVARIANTS)
+	{
+		HoistInvariants(ops, invariantOps, memorySize, userMemorySize, temporaryCount);
+	}
+}
+
+// find out which memory a read can see the value of from an earlier frame (see StateReport).
+// an address is written for sure at an op when it is written on every path from the start of the code to that op,
+// which takes a single pass because every jump is forward: the addresses written for sure at a jump target
+// are the ones written for sure at every jump to it and at the op before it, when that doesn't jump away.
+// a read of an address that isn't written for sure can see the value from the last frame, if anything writes it.
+// addresses are followed through the stack when they are constants, so PSH address, PEK is as good as LDV address.
+// invariantOps run before each block, they can only read memory that nothing writes.
+// depthAt and verified are what Verify found for ops, when it couldn't verify them the stack isn't known,
+// so every address is assumed to be computed.
+static Program::StateReport AnalyzeState(const ArenaVector<Program::Op>& ops, const ArenaVector<int>& depthAt, const bool verified, const ArenaVector<Program::Op>& invariantOps, const size_t memorySize, const size_t userMemorySize)
+{
+	typedef Program::Op Op;
+	typedef Program::Value Value;
+	typedef Program::VariableState VariableState;
+
+	// for each address: read at all, read when it wasn't written for sure, and written by an op that says where
+	ArenaVector<bool> read(memorySize, false);
+	ArenaVector<bool> readUnwritten(memorySize, false);
+	ArenaVector<bool> written(memorySize, false);
+	// POK and PEK with addresses that aren't constants
+	bool writesAnywhere = false;
+	bool readsAnywhere = false;
+	// the addresses written for sure at every read from anywhere
+	ArenaVector<Value> writtenAtAnyRead;
+	bool anyReadSeen = false;
+	Program::StateReport report;
+
+	// the addresses written for sure, kept sorted
+	typedef ArenaVector<Value> Addresses;
+	auto intersect = [](Addresses& into, const Addresses& other)
+	{
+		into.erase(std::remove_if(into.begin(), into.end(), [&](const Value a) { return !std::binary_search(other.begin(), other.end(), a); }), into.end());
+	};
+	auto scan = [&](const ArenaVector<Op>& code, const ArenaVector<int>& depthAt, const bool verified)
+	{
+		// the stack, with whether each value is a constant
+		struct Slot
+		{
+			bool constant;
+			Value value;
+			bool operator==(const Slot& other) const { return constant == other.constant && value == other.value; }
+		};
+		const Slot unknown = { false, 0 };
+		ArenaVector<Slot> stack;
+		// the values below this in stack are unknown. only the values near the top of the stack are kept for a jump,
+		// so that deeply nested code doesn't have to copy the whole stack for every jump.
+		size_t floor = 0;
+		static const size_t kJumpSlots = 16;
+		Addresses current;
+		bool reachable = true;
+		// the addresses written for sure and the top of the stack, from the top down, at each jump target the code hasn't got to yet.
+		// a value on the stack is only constant at a target when it is the same constant on every way there.
+		struct Arrival { Addresses written; Slot top[kJumpSlots]; size_t topSize; };
+		ArenaMap<size_t, Arrival> arriving;
+		const ArenaVector<bool> targets = FindJumpTargets(code);
+		auto slot = [&](const int depth) { return verified && depth >= 0 && (int)stack.size() - depth > (int)floor ? stack[stack.size() - 1 - depth] : unknown; };
+		auto jumpTo = [&](const size_t target)
+		{
+			auto found = arriving.find(target);
+			if (found == arriving.end())
+			{
+				Arrival& arrival = arriving[target];
+				arrival.written = current;
+				arrival.topSize = std::min(kJumpSlots, stack.size());
+				for (size_t depth = 0; depth < arrival.topSize; ++depth) arrival.top[depth] = slot((int)depth);
+				return;
+			}
+			Arrival& arrival = found->second;
+			intersect(arrival.written, current);
+			for (size_t depth = 0; depth < arrival.topSize; ++depth)
+			{
+				if (!(arrival.top[depth] == slot((int)depth))) arrival.top[depth] = unknown;
+			}
+		};
+
+		auto load = [&](const Value address)
+		{
+			const size_t a = (size_t)(address % memorySize);
+			read[a] = true;
+			if (!std::binary_search(current.begin(), current.end(), (Value)a)) readUnwritten[a] = true;
+		};
+		auto store = [&](const Value address)
+		{
+			const Value a = address % memorySize;
+			written[(size_t)a] = true;
+			auto at = std::lower_bound(current.begin(), current.end(), a);
+			if (at == current.end() || *at != a) current.insert(at, a);
+		};
+
+		for (size_t pc = 0; pc <= code.size(); ++pc)
+		{
+			auto found = targets[pc] ? arriving.find(pc) : arriving.end();
+			if (found != arriving.end())
+			{
+				// falling through to a target is one more way to get there
+				if (reachable) jumpTo(pc);
+				Arrival& arrival = found->second;
+				current.swap(arrival.written);
+				if (verified)
+				{
+					stack.resize(depthAt[pc], unknown);
+					floor = std::max(std::min(floor, stack.size()), stack.size() - arrival.topSize);
+					for (size_t depth = 0; depth < arrival.topSize; ++depth) stack[stack.size() - 1 - depth] = arrival.top[depth];
+				}
+				arriving.erase(found);
+				reachable = true;
+			}
+			if (pc == code.size() || !reachable)
+			{
+				continue;
+			}
+
+			const Op& op = code[pc];
+			const int inputs = StackInputs(op);
+			const int outputs = inputs + StackEffect(op);
+
+			switch (op.code)
+			{
+			case Op::LDV:
+				if (op.val < memorySize) load(op.val);
+				break;
+			case Op::STV:
+				if (op.val < memorySize) store(op.val);
+				break;
+			case Op::PEK:
+				if (slot(0).constant) load(slot(0).value);
+				else readsAnywhere = true;
+				break;
+			case Op::POK:
+				if (slot((int)op.val).constant)
+				{
+					for (Value i = 0; i < op.val && i < memorySize; ++i) store(slot((int)op.val).value + i);
+				}
+				else writesAnywhere = true;
+				break;
+			// the oscillators read 'w' and Fn reads '~'
+			case Op::SIN: case Op::SQR: case Op::TRI:
+				load(Program::GetAddress('w', userMemorySize));
+				break;
+			case Op::FRQ:
+				load(Program::GetAddress('~', userMemorySize));
+				break;
+			// with RM_COUNTER, R hashes 't'
+			case Op::RND:
+				load(Program::GetAddress('t', userMemorySize));
+				report.usesRandom = true;
+				break;
+			default:
+				break;
+			}
+			if (op.code == Op::PEK && !slot(0).constant)
+			{
+				if (!anyReadSeen) writtenAtAnyRead = current;
+				else intersect(writtenAtAnyRead, current);
+				anyReadSeen = true;
+			}
+
+			if (verified)
+			{
+				// addresses computed from constants, like @(2+1), are constants too
+				Slot result = op.code == Op::PSH ? Slot{ true, op.val } : unknown;
+				const Slot a = slot(inputs - 1);
+				const Slot b = slot(0);
+				if ((inputs == 1 || inputs == 2) && op.code != Op::CND && a.constant && b.constant && Evaluate(op.code, a.value, b.value, result.value))
+				{
+					result.constant = true;
+				}
+				stack.resize(stack.size() - inputs);
+				floor = std::min(floor, stack.size());
+				if (outputs == 1)
+				{
+					stack.push_back(result);
+				}
+			}
+
+			// after the condition is popped, so that the stack is the one at the target
+			if (op.code == Op::CND || op.code == Op::JMP)
+			{
+				jumpTo((size_t)op.val);
+				reachable = op.code == Op::CND;
+			}
+		}
+	};
+	ArenaVector<int> invariantDepthAt;
+	const bool invariantVerified = Verify(invariantOps, invariantDepthAt);
+	scan(invariantOps, invariantDepthAt, invariantVerified);
+	scan(ops, depthAt, verified);
+
+	// what RunBlock sets for every frame can't carry anything from one to the next
+	const Value t = Program::GetAddress('t', userMemorySize);
+	const Value m = Program::GetAddress('m', userMemorySize);
+	const Value q = Program::GetAddress('q', userMemorySize);
+	auto stateOf = [&](const size_t a) -> VariableState
+	{
+		const bool mayWrite = written[a] || writesAnywhere;
+		const bool mayRead = read[a] || readsAnywhere;
+		const bool readFromBefore = readUnwritten[a] || (readsAnywhere && !std::binary_search(writtenAtAnyRead.begin(), writtenAtAnyRead.end(), (Value)a));
+		if (mayWrite && readFromBefore && a != t && a != m && a != q) return Program::VS_CARRIED;
+		if (written[a]) return Program::VS_LOCAL;
+		if (mayRead) return Program::VS_INPUT;
+		return Program::VS_UNUSED;
+	};
+	for (size_t c = 0; c < 256; ++c)
+	{
+		report.variables[c] = stateOf((size_t)Program::GetAddress((Program::Char)c, userMemorySize));
+	}
+	// user memory is as bad as its worst address, which is the order of the states
+	for (size_t a = 0; a < userMemorySize && report.userMemory != Program::VS_CARRIED; ++a)
+	{
+		report.userMemory = std::max(report.userMemory, stateOf(a));
+	}
+	return report;
+}
+
+namespace
+{
+	// the most CompiledPrograms the compile cache keeps for source that no Program is running
+	const size_t kCompileCacheSize = 64;
+
+	// 64 bit FNV-1a, continuing from hash
+	uint64_t Hash(uint64_t hash, const void* data, const size_t size)
+	{
+		const uint8_t* bytes = (const uint8_t*)data;
+		for (size_t i = 0; i < size; ++i)
+		{
+			hash = (hash ^ bytes[i]) * 1099511628211ull;
+		}
+		return hash;
+	}
+
+	// CompiledPrograms that Compile can reuse, most recently used first.
+	// entries that a Program is running are never evicted, so every Program compiled from the same source shares one,
+	// and the least recently used of the rest are evicted when there are more than kCompileCacheSize of them.
+	struct CompileCache
+	{
+		struct Entry
+		{
+			uint64_t hash;
+			std::basic_string<Program::Char> source;
+			size_t   userMemorySize;
+			uint32_t optimizations;
+			std::shared_ptr<Program::CompiledProgram> compiled;
+		};
+
+		std::mutex mutex;
+		std::list<Entry> entries;
+		// entries by the hash of their source, userMemorySize, and optimizations
+		std::unordered_map<uint64_t, std::list<Entry>::iterator> index;
+		uint64_t hits = 0;
+		uint64_t misses = 0;
+
+		static CompileCache& Get()
+		{
+			static CompileCache instance;
+			return instance;
+		}
+
+		static uint64_t HashOf(const std::basic_string<Program::Char>& source, const size_t userMemorySize, const uint32_t optimizations)
+		{
+			uint64_t hash = Hash(14695981039346656037ull, source.data(), source.size() * sizeof(Program::Char));
+			hash = Hash(hash, &userMemorySize, sizeof(userMemorySize));
+			return Hash(hash, &optimizations, sizeof(optimizations));
+		}
+	};
+}
+
+// pack the ops into Instructions for a CompiledProgram, putting operands that don't fit in one into constants.
+// pooled is where each value is in constants, so that values used more than once are only in there once.
+static void Encode(const ArenaVector<Program::Op>& ops, std::vector<Program::Instruction>& code, std::vector<Program::Value>& constants, ArenaMap<Program::Value, int32_t>& pooled)
+{
+	static_assert(Program::Op::HLT <= UINT8_MAX, "Instruction::code is a byte");
+
+	code.reserve(ops.size());
+	for (const Program::Op& op : ops)
+	{
+		const int32_t operand = (int32_t)op.val;
+		if ((Program::Value)(int64_t)operand == op.val)
+		{
+			code.push_back(Program::Instruction(op.code, false, operand));
+		}
+		else
+		{
+			auto found = pooled.insert(std::make_pair(op.val, (int32_t)constants.size()));
+			if (found.second)
+			{
+				constants.push_back(op.val);
+			}
+			code.push_back(Program::Instruction(op.code, true, found.first->second));
+		}
+	}
+}
+
+Program::CompileCacheStats Program::GetCompileCacheStats()
+{
+	CompileCache& cache = CompileCache::Get();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	CompileCacheStats stats;
+	stats.hits = cache.hits;
+	stats.misses = cache.misses;
+	stats.size = cache.entries.size();
+	return stats;
+}
+
+void Program::ClearCompileCache()
+{
+	CompileCache& cache = CompileCache::Get();
+	std::lock_guard<std::mutex> lock(cache.mutex);
+	cache.entries.clear();
+	cache.index.clear();
+	cache.hits = 0;
+	cache.misses = 0;
+}
+
+Program* Program::Compile(const Char* source, const size_t userMemorySize, CompileError& outError, int& outErrorPosition, const uint32_t optimizations)
+{
+	CompileCache& cache = CompileCache::Get();
+	const std::basic_string<Char> sourceString(source);
+	const uint64_t hash = CompileCache::HashOf(sourceString, userMemorySize, optimizations);
+	{
+		std::lock_guard<std::mutex> lock(cache.mutex);
+		auto found = cache.index.find(hash);
+		// the hash could collide, so the source has to be compared too
+		if (found != cache.index.end() && found->second->source == sourceString
+			&& found->second->userMemorySize == userMemorySize && found->second->optimizations == optimizations)
+		{
+			cache.entries.splice(cache.entries.begin(), cache.entries, found->second);
+			++cache.hits;
+			outError = CE_NONE;
+			outErrorPosition = -1;
+			return new Program(found->second->compiled);
+		}
+		++cache.misses;
+	}
+
+	// everything allocated by the last compile on this thread is gone by now, so the arena can start over
+	CompilationArena::Get().Reset();
+	Program* program = nullptr;
+	CompilationState state(source, userMemorySize);
+
+	while (*state != '\0')
+	{
+		if (Parse(state)) break;
+		// if we aren't at the end yet, we should have a POP as the last op.
+		if (*state != '\0' && state.ops.back().code != Op::POP)
+		{
+			state.error = CE_UNEXPECTED_CHAR;
+			break;
+		}
+	}
+
+	// final error checking
+	if (state.error == CE_NONE)
+	{
+		// Now, expr should point to '\0', and _paren_count should be zero
+		if (state.parenCount != 0 || *state == ')')
+		{
+			state.error = CE_MISSING_PAREN;
+		}
+		else if (*state != '\0')
+		{
+			state.error = CE_UNEXPECTED_CHAR;
+		}
+		// make sure the program includes at least one PUT.
+		// we consider it a compilation error if it doesn't
+		// since the resulting program would output nothing 
+		// and therefore be useless.
+		else
+		{
+			bool hasPut = false;
+			for (auto& op : state.ops)
+			{
+				hasPut = hasPut || op.code == Op::PUT;
+			}
+
+			if (!hasPut)
+			{
+				state.error = CE_MISSING_PUT;
+			}
+		}
+	}
+
+	// now create a program or don't
+	if (state.error == CE_NONE)
+	{
+		outError = CE_NONE;
+		outErrorPosition = -1;
+		const size_t parsedCount = state.ops.size();
+		ArenaVector<Op> invariantOps;
+		std::vector<Divisor> divisors;
+		size_t temporaryCount;
+		Optimize(state.ops, invariantOps, divisors, temporaryCount, GetMemorySize(userMemorySize), userMemorySize, optimizations);
+		// the ops packed into what the CompiledProgram keeps, which is all of them that outlives the arena
+		std::vector<Instruction> code;
+		std::vector<Instruction> invariantCode;
+		std::vector<Value> constants;
+		ArenaMap<Value, int32_t> pooled;
+		Encode(state.ops, code, constants, pooled);
+		Encode(invariantOps, invariantCode, constants, pooled);
+		const size_t stackSize = std::max(ComputeStackSize(state.ops), ComputeStackSize(invariantOps));
+		ArenaVector<int> depthAt;
+		const bool verified = Verify(state.ops, depthAt);
+		const bool lanes = verified && RunsInLanes(state.ops, GetMemorySize(userMemorySize));
+		const StateReport stateReport = AnalyzeState(state.ops, depthAt, verified, invariantOps, GetMemorySize(userMemorySize), userMemorySize);
+		const uint64_t removedCount = parsedCount - code.size();
+		std::shared_ptr<CompiledProgram> compiled = std::make_shared<CompiledProgram>(std::move(code), std::move(invariantCode), std::move(constants), std::move(divisors), userMemorySize, stackSize, verified, lanes, stateReport, temporaryCount, removedCount);
+		{
+			std::lock_guard<std::mutex> lock(cache.mutex);
+			// replaces a colliding entry, or one for the same source that another thread compiled at the same time
+			auto found = cache.index.find(hash);
+			if (found != cache.index.end())
+			{
+				cache.entries.erase(found->second);
+			}
+			cache.entries.push_front(CompileCache::Entry{ hash, sourceString, userMemorySize, optimizations, compiled });
+			cache.index[hash] = cache.entries.begin();
+
+			size_t unused = 0;
+			for (auto entry = cache.entries.begin(); entry != cache.entries.end();)
+			{
+				// the cache holds the only reference when no Program is running it
+				if (entry->compiled.use_count() == 1 && ++unused > kCompileCacheSize)
+				{
+					cache.index.erase(entry->hash);
+					entry = cache.entries.erase(entry);
+				}
+				else
+				{
+					++entry;
+				}
+			}
+		}
+		program = new Program(compiled);
+	}
+	else
+	{
+		outError = state.error;
+		outErrorPosition = state.parsePos;
+	}
+
+	return program;
+}
+#pragma endregion
+
+//////////////////////////////////////////////////////////////////////////
+// EXECUTION
+//////////////////////////////////////////////////////////////////////////
+#pragma region Execution
+
+const char * Program::GetErrorString(Program::RuntimeError error)
+{
+	switch (error)
+	{
+	case RE_NONE:
+		return "None";
+	case RE_DIVIDE_BY_ZERO:
+		return "Divide by zero";
+	case RE_MISSING_OPERAND:
+		return "Missing operand";
+	case RE_MISSING_OPCODE:
+		return "Unimplemented opcode";
+	case RE_INCONSISTENT_STACK:
+		return "Inconsistent stack";
+	case RE_EMPTY_PROGRAM:
+		return "Empty program (instruction count is zero)";
+	case RE_GET_OUT_OF_BOUNDS:
+		return "Input access is out of bounds";
+	case RE_PUT_OUT_OF_BOUNDS:
+		return "Output access is out of bounds";
+	default:
+		return "Unknown";
+	}
+}
+
+Program::RuntimeError Program::Run(Value* results, const size_t size)
+{
+	if (compiled->code.empty())
+	{
+		return RE_EMPTY_PROGRAM;
+	}
+
+	UpdateDivisors();
+	UpdateInvariants();
+	return Execute(results, size);
+}
+
+Program::RuntimeError Program::RunBlock(const Value* inputs, Value* outputs, const size_t channels, const size_t frames, TickState& tickState, RuntimeError* firstError)
+{
+	if (compiled->code.empty())
+	{
+		if (firstError)
+		{
+			*firstError = RE_EMPTY_PROGRAM;
+		}
+		return RE_EMPTY_PROGRAM;
+	}
+
+	Value& t = VarRef('t');
+	Value& m = VarRef('m');
+	Value& q = VarRef('q');
+
+	UpdateDivisors();
+	UpdateInvariants();
+	RuntimeError error = RE_NONE;
+	RuntimeError first = RE_NONE;
+	size_t f = 0;
+	// the RM_SEQUENTIAL generator has to give its numbers to the frames in order
+	if (execEngine == EE_LANES && compiled->lanes && (state.randomMode == RM_COUNTER || !compiled->stateReport.usesRandom))
+	{
+		// every lane starts with the temporaries UpdateInvariants computed, the rest are written before they are read
+		for (size_t i = 0; i < compiled->tempSize; ++i)
+		{
+			for (size_t l = 0; l < kLanes; ++l)
+			{
+				state.laneTemps[i].v[l] = state.mem[compiled->memSize + i];
+			}
+		}
+
+		// 'm' and 'q' for every lane, computed the same way as for a single frame.
+		// they only go up as t does, so when the first and last lane are the same, so is everything in between,
+		// which is true most of the time because the denominators are much bigger than the number of lanes.
+		auto laneTicks = [](const Lanes& lt, const double denom, Lanes& out)
+		{
+			const Value first = (Value)round(lt.v[0] / denom);
+			const Value last = (Value)round(lt.v[kLanes - 1] / denom);
+			for (size_t l = 0; l < kLanes; ++l)
+			{
+				out.v[l] = first == last ? first : (Value)round(lt.v[l] / denom);
+			}
+		};
+
+		for (; f + kLanes <= frames; f += kLanes)
+		{
+			Lanes lt, lm, lq;
+			for (size_t l = 0; l < kLanes; ++l)
+			{
+				lt.v[l] = tickState.tick++;
+			}
+			laneTicks(lt, tickState.mdenom, lm);
+			laneTicks(lt, tickState.qdenom, lq);
+
+			Value* results = outputs + f*channels;
+			if (inputs != outputs)
+			{
+				memcpy(results, inputs + f*channels, sizeof(Value)*channels*kLanes);
+			}
+			error = ExecuteLanes(results, channels, lt, lm, lq, first);
+			// leave the variables the way running the last frame on its own would have
+			t = lt.v[kLanes - 1];
+			m = lm.v[kLanes - 1];
+			q = lq.v[kLanes - 1];
+		}
+	}
+
+	for (; f < frames; ++f)
+	{
+		const Value tick = tickState.tick++;
+		t = tick;
+		m = (Value)round(tick / tickState.mdenom);
+		q = (Value)round(tick / tickState.qdenom);
+
+		Value* results = outputs + f*channels;
+		if (inputs != outputs)
+		{
+			memcpy(results, inputs + f*channels, sizeof(Value)*channels);
+		}
+		error = Execute(results, channels);
+		if (first == RE_NONE)
+		{
+			first = error;
+		}
+	}
+
+	if (firstError)
+	{
+		*firstError = first;
+	}
+	return error;
+}
+
+Program::RuntimeError Program::Execute(Value* results, const size_t size)
+{
+	if (execEngine == EE_THREADED || execEngine == EE_LANES)
+	{
+		return compiled->verified ? ExecuteThreaded<false>(results, size, false) : ExecuteThreaded<true>(results, size, false);
+	}
+
+	if (execEngine == EE_JIT)
+	{
+		return (RuntimeError)jitCode(this, state.stack.data(), state.mem.data(), results, size, state.divisors.data());
+	}
+
+	return ExecuteFrom(0, results, size);
+}
+
+Program::RuntimeError Program::ExecuteFrom(const size_t pc, Value* results, const size_t size)
+{
+	RuntimeError error = RE_NONE;
+	const uint64_t icount = GetInstructionCount();
+	const bool verified = compiled->verified;
+	state.pc = pc;
+	for (; state.pc < icount && error == RE_NONE; ++state.pc)
+	{
+		const Op op = compiled->Decode(compiled->code[state.pc]);
+		error = verified ? Exec<false>(op, results, size) : Exec<true>(op, results, size);
+	}
+
+	// under error-free execution we should have either 1 or 0 values in the stack.
+	// 1 when a program terminates with the result of an expression (eg: t*Fn)
+	// 0 when a program terminates with a POP (eg: t*Fn;)
+	// in the case of the POP, the value of the expression will already be in result.
+	if (error == RE_NONE)
+	{
+		if (state.sp > 1)
+		{
+			error = RE_INCONSISTENT_STACK;
+		}
+	}
+
+	// clear the stack so the next run starts from empty after a runtime error
+	state.sp = 0;
+
+	return error;
+}
+
+// the high 64 bits of the 128 bit product of a and b
+static inline Program::Value MulHi(const Program::Value a, const Program::Value b)
+{
+#if defined(__SIZEOF_INT128__)
+	return (Program::Value)(((unsigned __int128)a * b) >> 64);
+#else
+	const uint64_t aLo = (uint32_t)a, aHi = a >> 32;
+	const uint64_t bLo = (uint32_t)b, bHi = b >> 32;
+	const uint64_t lolo = aLo*bLo, hilo = aHi*bLo, lohi = aLo*bHi, hihi = aHi*bHi;
+	// can't overflow: the largest possible sum is 2^64 - 1
+	const uint64_t cross = (lolo >> 32) + (uint32_t)hilo + lohi;
+	return hihi + (hilo >> 32) + (cross >> 32);
+#endif
+}
+
+// divide the 128 bit number hi:lo by d, which must be greater than hi so that the quotient fits in 64 bits.
+// this is only used when a divisor changes, so it doesn't need to be fast.
+static Program::Value DivideWide(Program::Value hi, Program::Value lo, const Program::Value d, Program::Value& remainder)
+{
+	for (int i = 0; i < 64; ++i)
+	{
+		const bool carry = (hi >> 63) != 0;
+		hi = (hi << 1) | (lo >> 63);
+		lo <<= 1;
+		if (carry || hi >= d)
+		{
+			hi -= d;
+			lo |= 1;
+		}
+	}
+	remainder = hi;
+	return lo;
+}
+
+// this is the unsigned 64 bit algorithm from libdivide (see "Division by Invariant Integers using Multiplication", Granlund & Montgomery).
+void Program::Divisor::Derive(const Value v)
+{
+	value = v;
+	magic = 0;
+	shift = 0;
+	add = 0;
+	if (v == 0)
+	{
+		return;
+	}
+
+	const Value log2 = Log2(v);
+	shift = log2;
+	if ((v & (v - 1)) == 0)
+	{
+		return;
+	}
+
+	// 2^(64 + log2) / v, which fits in 64 bits because v is greater than 2^log2
+	Value remainder;
+	Value m = DivideWide((Value)1 << log2, 0, v, remainder);
+	const Value e = v - remainder;
+	if (e >= ((Value)1 << log2))
+	{
+		// 2^(64 + log2) / v wasn't precise enough, so use one more bit, which the quotient is corrected for in Divide
+		const Value twice = remainder * 2;
+		m += m;
+		if (twice >= v || twice < remainder)
+		{
+			m += 1;
+		}
+		add = 1;
+	}
+	magic = m + 1;
+}
+
+inline Program::Value Program::Divisor::Divide(const Value n) const
+{
+	if (magic == 0)
+	{
+		return n >> shift;
+	}
+
+	const Value q = MulHi(magic, n);
+	return (add ? ((n - q) >> 1) + q : q) >> shift;
+}
+
+void Program::UpdateDivisors()
+{
+	for (Divisor& d : state.divisors)
+	{
+		const Value v = d.source == Divisor::DS_MEMORY ? state.mem[d.index]
+			           : d.source == Divisor::DS_VC ? GetVC(d.index)
+			           : d.value;
+		// divisors start out as zero, which DVR and MDR treat as dividing by zero, so there's nothing to derive until it changes
+		if (v != d.value)
+		{
+			d.Derive(v);
+		}
+	}
+}
+
+void Program::UpdateInvariants()
+{
+	// the optimizer only hoists expressions that can't fail, so there are no errors to check for.
+	// EE_THREADED doesn't keep state.sp up to date, so it could be anything when we get here.
+	state.sp = 0;
+	for (const Instruction& instruction : compiled->invariantCode)
+	{
+		Exec<false>(compiled->Decode(instruction), nullptr, 0);
+	}
+	state.sp = 0;
+}
+
+// the formula Sine uses to fill its tables, and falls back to when 'w' doesn't have one
+static Program::Value SineOf(const Program::Value a, Program::Value r)
+{
+	Program::Value hr = r / 2;
+	r += 1;
+	double s = sin(2 * M_PI * ((double)(a%r) / r));
+	return Program::Value(s*hr + hr);
+}
+
+namespace
+{
+	// results of Sine for every a % ('w' + 1), with a table for each 'w' that is a power of two up to 2^16,
+	// which covers every bit depth the plugin sets. they are laid out one after the other, smallest 'w' first.
+	// an entry holds the result plus one, zero means it hasn't been computed yet.
+	// every Program fills them in as it needs them, which is safe without a lock because they all compute the same value for an entry.
+	// nothing is allocated for them, and only the pages that are used take up any memory.
+	const size_t kSineTableCount = 17;
+	std::atomic<uint32_t> sineTables[(1 << kSineTableCount) - 1 + kSineTableCount];
+}
+
+// the shared table for w, or null if it doesn't have one
+static std::atomic<uint32_t>* SineTableFor(const Program::Value w)
+{
+	if (w == 0 || (w & (w - 1)) != 0 || w >= (1 << kSineTableCount))
+	{
+		return nullptr;
+	}
+	// the tables for 1, 2, ... w/2 hold w - 1 entries, plus one more for each of them
+	return sineTables + (w - 1) + Log2(w);
+}
+
+void Program::UpdateOscillators(const Value w)
+{
+	state.oscillatorW = w;
+	state.squareDivisor.Derive(w);
+	state.sineDivisor.Derive(w + 1);
+	state.sineTable = SineTableFor(w);
+}
+
+inline Program::Value Program::Sine(const Value a)
+{
+	const Value w = VarRef('w');
+	if (w != state.oscillatorW)
+	{
+		UpdateOscillators(w);
+	}
+
+	// the formula divides by 'w' + 1, which is zero for the largest Value
+	if (w + 1 == 0)
+	{
+		return 0;
+	}
+
+	if (state.sineTable == nullptr)
+	{
+		return SineOf(a, w);
+	}
+
+	const Value r = w + 1;
+	const Value i = a - state.sineDivisor.Divide(a)*r;
+	std::atomic<uint32_t>& entry = state.sineTable[i];
+	uint32_t value = entry.load(std::memory_order_relaxed);
+	if (value == 0)
+	{
+		value = (uint32_t)SineOf(i, w) + 1;
+		entry.store(value, std::memory_order_relaxed);
+	}
+	return value - 1;
+}
+
+inline Program::Value Program::Square(const Value a)
+{
+	const Value r = VarRef('w');
+	if (r != state.oscillatorW)
+	{
+		UpdateOscillators(r);
+	}
+
+	if (r == 0)
+	{
+		return 0;
+	}
+
+	// when 'w' is a power of two (which is how the plugin always sets it) this is a mask
+	const Value mod = state.squareDivisor.magic == 0 ? a & (r - 1) : a - state.squareDivisor.Divide(a)*r;
+	return mod < r / 2 ? 0 : r - 1;
+}
+
+inline Program::Value Program::Triangle(Value a)
+{
+	a *= 2;
+	const Value r = VarRef('w');
+	if (r != state.oscillatorW)
+	{
+		UpdateOscillators(r);
+	}
+
+	if (r == 0)
+	{
+		return 0;
+	}
+
+	const Value odd = state.squareDivisor.Divide(a) & 1;
+	return a*odd + (r - a - 1)*(1 - odd);
+}
+
+// the finalizer of SplitMix64, which turns a counter into a value that looks random
+static inline uint64_t MixBits(uint64_t z)
+{
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// what RM_COUNTER draws for the R at site when 't' is t.
+// every site gets its own key from the seed, so two Rs in the same frame don't give the same number.
+static inline Program::Value CounterRandom(const uint64_t seed, const Program::Value t, const Program::Value site)
+{
+	const uint64_t key = MixBits(seed + (site + 1) * 0x9E3779B97F4A7C15ull);
+	return MixBits(key ^ MixBits(t));
+}
+
+inline Program::Value Program::Random(const Value a, const Value site)
+{
+	if (a == 0)
+	{
+		return 0;
+	}
+
+	if (state.randomMode == RM_COUNTER)
+	{
+		return CounterRandom(state.randomSeed, VarRef('t'), site) % a;
+	}
+
+	return state.rng() % a;
+}
+
+// the stack is sized by ComputeStackSize, so pushes never need to check for room.
+// pops only need to check that there is something to pop when the code wasn't verified (see Verify).
+#define PUSH(v) state.stack[state.sp++] = (v)
+#define POP1 if ( Checked && state.sp < 1 ) goto bad_stack; Value a = state.stack[--state.sp];
+#define POP2 if ( Checked && state.sp < 2 ) goto bad_stack; Value b = state.stack[--state.sp]; Value a = state.stack[--state.sp];
+#define POP3 if ( Checked && state.sp < 3 ) goto bad_stack; Value c = state.stack[--state.sp]; Value b = state.stack[--state.sp]; Value a = state.stack[--state.sp];
+// pops n values and the address below them, leaving args pointing at the values, which remain in stack memory until the next PUSH
+#define POPN(n) if ( Checked && state.sp < (n) + 1 ) goto bad_stack; state.sp -= (n) + 1; Value a = state.stack[state.sp]; const Value* args = state.stack.data() + state.sp + 1;
+
+// perform the operation
+template<bool Checked>
 Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 {
 	RuntimeError error = RE_NONE;
@@ -824,14 +3102,15 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	{
 		// no operands - result is pushed to the stack
 	case Op::PSH:
-		stack.push(op.val);
+		PUSH(op.val);
 		break;
 
 	case Op::POP:
 	{
-		stack.pop();
+		if (Checked && state.sp < 1) goto bad_stack;
+		--state.sp;
 		// stack should now be empty, if it isn't that's an error
-		if (stack.size() > 0)
+		if (Checked && state.sp > 0)
 		{
 			error = RE_INCONSISTENT_STACK;
 		}
@@ -842,7 +3121,7 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	case Op::PEK:
 	{
 		POP1;
-		stack.push(Peek(a));
+		PUSH(Peek(a));
 	}
 	break;
 
@@ -850,113 +3129,78 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	{
 		POP1;
 		Value v = 0;
-		// wildcard GET should return the sum of all channels
-		if (a == Wildcard::Value)
-		{
-			for (size_t i = 0; i < size; ++i)
-			{
-				v += results[i];
-			}
-		}
-		else if (a < size)
-		{
-			v = results[a];
-		}
-		else
-		{
-			error = RE_GET_OUT_OF_BOUNDS;
-		}
-		stack.push(v);
+		error = GetResult(a, results, size, v);
+		PUSH(v);
 	}
 	break;
 
 	case Op::NEG:
 	{
 		POP1;
-		stack.push(-a);
+		PUSH(-a);
 	}
 	break;
 
 	case Op::SIN:
 	{
 		POP1;
-		Value r = Get('w');
-		Value hr = r / 2;
-		r += 1;
-		double s = sin(2 * M_PI * ((double)(a%r) / r));
-		stack.push(Value(s*hr + hr));
+		PUSH(Sine(a));
 	}
 	break;
 
 	case Op::SQR:
 	{
 		POP1;
-		const Value r = Get('w');
-		const Value v = a%r < r / 2 ? 0 : r - 1;
-		stack.push(v);
+		PUSH(Square(a));
 	}
 	break;
 
 	case Op::FRQ:
 	{
 		POP1;
-		if (a == 0)
-		{
-			stack.push(0);
-		}
-		else
-		{
-			// 3.023625 is a magic number arrived at by comparing our output to the Saw Wave in ReaSynth.
-			// 3.0 is what we'd expect to see if we were operating in floating point,
-			// but if we use 3.0 here, the pitch winds up being a little bit flat.
-			double f = round(4.0 * 3.023625 * pow(2.0, (double)a / 12.0) * (44100.0 / Get('~')));
-			stack.push((Value)f);
-		}
+		PUSH(Frequency(a));
 	}
 	break;
 
 	case Op::TRI:
 	{
 		POP1;
-		a *= 2;
-		const Value r = Get('w');
-		const Value v = a*((a / r) % 2) + (r - a - 1)*(1 - (a / r) % 2);
-		stack.push(v);
+		PUSH(Triangle(a));
 	}
 	break;
 
 	case Op::RND:
 	{
 		POP1;
-		stack.push(rng() % a);
+		PUSH(Random(a, op.val));
 	}
 	break;
 
 	case Op::CCV:
 	{
 		POP1;
-		stack.push(GetCC(a));
+		PUSH(GetCC(a));
 	}
 	break;
 
 	case Op::VCV:
 	{
 		POP1;
-		stack.push(GetVC(a));
+		PUSH(GetVC(a));
 	}
 	break;
 			
 	case Op::NOT:
 	{
 		POP1;
-		stack.push(!a);
+		PUSH(!a);
 	}
 	break;
 	
 	case Op::COM:
 	{
 		POP1;
-		stack.push(~a);
+		PUSH(~a);
 	}
 	break;
 
@@ -964,7 +3208,7 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	case Op::MUL:
 	{
 		POP2;
-		stack.push(a*b);
+		PUSH(a*b);
 	}
 	break;
 
@@ -974,7 +3218,7 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 		Value v = 0;
 		if (b) { v = a / b; }
 		else { error = RE_DIVIDE_BY_ZERO; }
-		stack.push(v);
+		PUSH(v);
 	}
 	break;
 
@@ -984,21 +3228,21 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 		Value v = 0;
 		if (b) { v = a%b; }
 		else { error = RE_DIVIDE_BY_ZERO; }
-		stack.push(v);
+		PUSH(v);
 	}
 	break;
 
 	case Op::ADD:
 	{
 		POP2;
-		stack.push(a + b);
+		PUSH(a + b);
 	}
 	break;
 
 	case Op::SUB:
 	{
 		POP2;
-		stack.push(a - b);
+		PUSH(a - b);
 	}
 	break;
 
@@ -1006,7 +3250,7 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	{
 		POP2;
 		const auto s = b % 64;
-		stack.push(a << s);
+		PUSH(a << s);
 	}
 	break;
 
@@ -1014,240 +3258,1435 @@ Program::RuntimeError Program::Exec(const Op& op, Value* results, size_t size)
 	{
 		POP2;
 		const auto s = b % 64;
-		stack.push(a >> s);
+		PUSH(a >> s);
 	}
 	break;
 
 	case Op::AND:
 	{
 		POP2;
-		stack.push(a&b);
+		PUSH(a&b);
 	}
 	break;
 
 	case Op::OR:
 	{
 		POP2;
-		stack.push(a | b);
+		PUSH(a | b);
 	}
 	break;
 
 	case Op::XOR:
 	{
 		POP2;
-		stack.push(a^b);
+		PUSH(a^b);
 	}
 	break;
 
 	case Op::CEQ:
 	{
 		POP2;
-		stack.push(a == b);
+		PUSH(a == b);
 	}
 	break;
 
 	case Op::CNE:
 	{
 		POP2;
-		stack.push(a != b);
+		PUSH(a != b);
 	}
 	break;
 
 	case Op::CLT:
 	{
 		POP2;
-		stack.push(a < b);
+		PUSH(a < b);
 	}
 	break;
 
 	case Op::CLE:
 	{
-		POP2;
-		stack.push(a <= b);
+		POP2;
+		PUSH(a <= b);
+	}
+	break;
+
+	case Op::CGT:
+	{
+		POP2;
+		PUSH(a > b);
+	}
+	break;
+
+	case Op::CGE:
+	{
+		POP2;
+		PUSH(a >= b);
+	}
+	break;
+
+	// number of operands is variable
+	case Op::POK:
+	{
+		// pop off the address and all of the values in one go (see Assign).
+		POPN(op.val);
+		PUSH(Assign(a, args, op.val));
+	}
+	break;
+
+	case Op::PUT:
+	{
+		// pop off the address and all of the values in one go (see Assign).
+		POPN(op.val);
+		Value v = 0;
+		error = PutResults(a, args, op.val, results, size, v);
+		// the address is popped, so this is guaranteed to have room
+		PUSH(v);
+	}
+	break;
+
+	// flow control.
+	// the pc is set to one less than the target address because it will be incremented after this method returns.
+	case Op::CND:
+	{
+		POP1;
+		if (!a) 
+		{ 
+			state.pc = op.val-1; 
+		}
+	}
+	break;
+
+	case Op::JMP:
+	{
+		state.pc = op.val-1;
+	}
+	break;
+
+	// fused instructions. addresses in val are already wrapped to memSize and divisors are never zero.
+	case Op::LDV:
+		PUSH(state.mem[op.val]);
+		break;
+
+	case Op::STV:
+	{
+		POP1;
+		state.mem[op.val] = a;
+		PUSH(a);
+	}
+	break;
+
+	case Op::ADI: { POP1; PUSH(a + op.val); } break;
+	case Op::SBI: { POP1; PUSH(a - op.val); } break;
+	case Op::MLI: { POP1; PUSH(a * op.val); } break;
+	case Op::DVI: { POP1; PUSH(a / op.val); } break;
+	case Op::MDI: { POP1; PUSH(a % op.val); } break;
+	case Op::ANI: { POP1; PUSH(a & op.val); } break;
+	case Op::ORI: { POP1; PUSH(a | op.val); } break;
+	case Op::XRI: { POP1; PUSH(a ^ op.val); } break;
+	case Op::SLI: { POP1; PUSH(a << op.val); } break;
+	case Op::SRI: { POP1; PUSH(a >> op.val); } break;
+
+	case Op::DVR:
+	case Op::MDR:
+	{
+		POP1;
+		const Divisor& d = state.divisors[op.val];
+		Value v = 0;
+		if (d.value) { v = op.code == Op::DVR ? d.Divide(a) : a - d.Divide(a)*d.value; }
+		else { error = RE_DIVIDE_BY_ZERO; }
+		PUSH(v);
+	}
+	break;
+
+	case Op::SEL: { POP3; PUSH(a ? b : c); } break;
+
+	// perform a no-op, but set the error as a result
+	default:
+	{
+		error = RE_MISSING_OPCODE;
+	}
+	break;
+
+bad_stack:
+	{
+		error = RE_MISSING_OPERAND;
+	}
+	break;
+	}
+
+	return error;
+}
+
+// GCC and Clang let us take the address of a label and goto it,
+// which means each handler can jump directly to the next one instead of returning to a switch.
+#if defined(__GNUC__) || defined(__clang__)
+#define COMPUTED_GOTO 1
+#else
+#define COMPUTED_GOTO 0
+#endif
+
+#if COMPUTED_GOTO
+#define OP(code) op_##code:
+#define DISPATCH() goto *((const char*)&&op_NOP + ip->handler)
+#else
+#define OP(code) case Op::code:
+#define DISPATCH() goto dispatch
+#endif
+
+#define NEXT() ++ip; DISPATCH()
+// the operand of the current instruction.
+// instructions with an operand in the constant pool are decoded to the POOLED handler instead of their own,
+// so the handlers only ever see operands that are inline.
+#define OPERAND ((Value)(int64_t)ip->operand)
+#define JUMP(target) ip = code + (target); DISPATCH()
+// operand checks and stack access for the threaded engine, which keeps the stack pointer in a local
+#define TPOP1 if ( Checked && n < 1 ) goto bad_stack; const Value a = st[--n];
+#define TPOP2 if ( Checked && n < 2 ) goto bad_stack; const Value b = st[--n]; const Value a = st[--n];
+#define TPOPN(count) if ( Checked && n < (count) + 1 ) goto bad_stack; n -= (count) + 1; const Value a = st[n]; const Value* args = st + n + 1;
+#define TPUSH(v) st[n++] = (v)
+#define UNARY(code, expr) OP(code) { TPOP1; TPUSH(expr); } NEXT();
+#define BINARY(code, expr) OP(code) { TPOP2; TPUSH(expr); } NEXT();
+#define IMMEDIATE(code, expr) OP(code) { TPOP1; const Value b = OPERAND; TPUSH(expr); } NEXT();
+
+template<bool Checked>
+Program::RuntimeError Program::ExecuteThreaded(Value* results, const size_t size, const bool decode)
+{
+#if COMPUTED_GOTO
+	// indexed by Op::Code. these are offsets from the first handler rather than addresses so that a ThreadedOp fits in 8 bytes.
+#define H(code) (int32_t)((const char*)&&op_##code - (const char*)&&op_NOP)
+	static const int32_t handlers[] =
+	{
+		H(NOP), H(PSH), H(PEK), H(POK), H(FRQ), H(SQR), H(SIN), H(TRI),
+		H(NEG), H(MUL), H(DIV), H(MOD), H(ADD), H(SUB), H(BSL), H(BSR),
+		H(AND), H(OR),  H(XOR), H(CEQ), H(CNE), H(CLT), H(CLE), H(CGT),
+		H(CGE), H(CND), H(POP), H(GET), H(PUT), H(RND), H(CCV), H(VCV),
+		H(NOT), H(COM), H(JMP), H(LDV), H(STV), H(ADI), H(SBI), H(MLI),
+		H(DVI), H(MDI), H(ANI), H(ORI), H(XRI), H(SLI), H(SRI), H(DVR),
+		H(MDR), H(SEL), H(HLT),
+	};
+	static_assert(sizeof(handlers) / sizeof(handlers[0]) == Op::HLT + 1, "every Op::Code needs a handler");
+#else
+	// the code of the POOLED handler, which isn't an Op::Code
+	const Op::Code kPooled = (Op::Code)(Op::HLT + 1);
+#endif
+
+	if (decode)
+	{
+		compiled->threadedOps.resize(compiled->code.size() + 1);
+		for (size_t i = 0; i <= compiled->code.size(); ++i)
+		{
+			const Op::Code opCode = i < compiled->code.size() ? (Op::Code)compiled->code[i].code : Op::HLT;
+			const bool pooled = i < compiled->code.size() && compiled->code[i].pooled;
+#if COMPUTED_GOTO
+			compiled->threadedOps[i].handler = pooled ? H(POOLED) : handlers[opCode];
+#else
+			compiled->threadedOps[i].code = pooled ? kPooled : opCode;
+#endif
+			compiled->threadedOps[i].operand = i < compiled->code.size() ? compiled->code[i].operand : 0;
+		}
+		return RE_NONE;
+	}
+
+	RuntimeError error = RE_NONE;
+	const ThreadedOp* const code = compiled->threadedOps.data();
+	const ThreadedOp* ip = code;
+	Value* const st = state.stack.data();
+	size_t n = 0;
+
+	DISPATCH();
+
+#if !COMPUTED_GOTO
+dispatch:
+	// switching on an int because of the POOLED handler
+	switch ((int)ip->code)
+	{
+#endif
+	OP(NOP) NEXT();
+	OP(PSH) TPUSH(OPERAND); NEXT();
+
+	OP(POP)
+	{
+		if (Checked && n < 1) goto bad_stack;
+		// stack should now be empty, if it isn't that's an error
+		if (--n > 0 && Checked)
+		{
+			error = RE_INCONSISTENT_STACK;
+			goto done;
+		}
+	}
+	NEXT();
+
+	UNARY(PEK, Peek(a));
+	UNARY(NEG, -a);
+	UNARY(SIN, Sine(a));
+	UNARY(SQR, Square(a));
+	UNARY(FRQ, Frequency(a));
+	UNARY(TRI, Triangle(a));
+	UNARY(RND, Random(a, OPERAND));
+	UNARY(CCV, GetCC(a));
+	UNARY(VCV, GetVC(a));
+	UNARY(NOT, !a);
+	UNARY(COM, ~a);
+
+	OP(GET)
+	{
+		TPOP1;
+		Value v;
+		if ((error = GetResult(a, results, size, v)) != RE_NONE) goto done;
+		TPUSH(v);
+	}
+	NEXT();
+
+	BINARY(MUL, a*b);
+	BINARY(ADD, a + b);
+	BINARY(SUB, a - b);
+	BINARY(BSL, a << (b % 64));
+	BINARY(BSR, a >> (b % 64));
+	BINARY(AND, a&b);
+	BINARY(OR, a | b);
+	BINARY(XOR, a^b);
+	BINARY(CEQ, a == b);
+	BINARY(CNE, a != b);
+	BINARY(CLT, a < b);
+	BINARY(CLE, a <= b);
+	BINARY(CGT, a > b);
+	BINARY(CGE, a >= b);
+
+	OP(DIV)
+	{
+		TPOP2;
+		if (!b) { error = RE_DIVIDE_BY_ZERO; goto done; }
+		TPUSH(a / b);
+	}
+	NEXT();
+
+	OP(MOD)
+	{
+		TPOP2;
+		if (!b) { error = RE_DIVIDE_BY_ZERO; goto done; }
+		TPUSH(a % b);
+	}
+	NEXT();
+
+	OP(POK)
+	{
+		const Value count = OPERAND;
+		TPOPN(count);
+		TPUSH(Assign(a, args, count));
+	}
+	NEXT();
+
+	OP(PUT)
+	{
+		const Value count = OPERAND;
+		TPOPN(count);
+		Value v;
+		if ((error = PutResults(a, args, count, results, size, v)) != RE_NONE) goto done;
+		TPUSH(v);
+	}
+	NEXT();
+
+	OP(CND)
+	{
+		TPOP1;
+		if (!a)
+		{
+			JUMP(OPERAND);
+		}
+	}
+	NEXT();
+
+	OP(JMP) JUMP(OPERAND);
+
+	OP(LDV) TPUSH(state.mem[OPERAND]); NEXT();
+
+	OP(STV)
+	{
+		TPOP1;
+		state.mem[OPERAND] = a;
+		TPUSH(a);
+	}
+	NEXT();
+
+	IMMEDIATE(ADI, a + b);
+	IMMEDIATE(SBI, a - b);
+	IMMEDIATE(MLI, a*b);
+	IMMEDIATE(DVI, a / b);
+	IMMEDIATE(MDI, a % b);
+	IMMEDIATE(ANI, a&b);
+	IMMEDIATE(ORI, a | b);
+	IMMEDIATE(XRI, a^b);
+	IMMEDIATE(SLI, a << b);
+	IMMEDIATE(SRI, a >> b);
+
+	OP(DVR)
+	{
+		TPOP1;
+		const Divisor& d = state.divisors[OPERAND];
+		if (!d.value) { error = RE_DIVIDE_BY_ZERO; goto done; }
+		TPUSH(d.Divide(a));
+	}
+	NEXT();
+
+	OP(MDR)
+	{
+		TPOP1;
+		const Divisor& d = state.divisors[OPERAND];
+		if (!d.value) { error = RE_DIVIDE_BY_ZERO; goto done; }
+		TPUSH(a - d.Divide(a)*d.value);
+	}
+	NEXT();
+
+	OP(SEL)
+	{
+		if (Checked && n < 3) goto bad_stack;
+		n -= 2;
+		const Value c = st[n - 1];
+		st[n - 1] = c ? st[n] : st[n + 1];
+	}
+	NEXT();
+
+	OP(HLT) goto done;
+
+	// an instruction with an operand in the constant pool. those are rare, so rather than having every handler check for them
+	// we let Exec run the instruction with its full operand, which also takes care of moving the pc for CND and JMP.
+#if COMPUTED_GOTO
+	op_POOLED:
+#else
+	case kPooled:
+#endif
+	{
+		state.sp = n;
+		state.pc = ip - code;
+		if ((error = Exec<Checked>(compiled->Decode(compiled->code[state.pc]), results, size)) != RE_NONE) goto done;
+		n = state.sp;
+		ip = code + state.pc + 1;
+	}
+	DISPATCH();
+
+#if !COMPUTED_GOTO
+	default:
+		error = RE_MISSING_OPCODE;
+		goto done;
+	}
+#endif
+
+bad_stack:
+	error = RE_MISSING_OPERAND;
+
+done:
+	// same as the end of Execute, a program can leave at most one value on the stack
+	if (Checked && error == RE_NONE && n > 1)
+	{
+		error = RE_INCONSISTENT_STACK;
+	}
+
+	return error;
+}
+
+// the handlers of the EE_LANES engine, which dispatch the same way as the EE_THREADED engine.
+// op is the current instruction, decoded with its full operand, and pc is its index.
+#if COMPUTED_GOTO
+#define LANE_OP(code) lane_##code:
+#define LANE_DISPATCH() if (pc == count) goto done; op = compiled->Decode(instructions[pc]); goto *laneHandlers[op.code]
+#else
+#define LANE_OP(code) case Op::code:
+#define LANE_DISPATCH() goto dispatch
+#endif
+#define LANE_NEXT() ++pc; LANE_DISPATCH()
+#define LANE_FALLBACK() return ExecuteLanesFrom(pc, sp, results, size, t, m, q, firstError)
+// run an op for every lane, where a (and b) are the values it pops in each lane.
+// the loops over lanes are simple enough for the compiler to turn into vector instructions.
+#define LANES(expr) for (size_t l = 0; l < kLanes; ++l) { expr; }
+#define LUNARY(code, expr) LANE_OP(code) { Lanes& r = stack[sp - 1]; LANES(const Value a = r.v[l]; r.v[l] = (expr)); } LANE_NEXT();
+#define LBINARY(code, expr) LANE_OP(code) { --sp; Lanes& r = stack[sp - 1]; const Lanes& rb = stack[sp]; LANES(const Value a = r.v[l]; const Value b = rb.v[l]; r.v[l] = (expr)); } LANE_NEXT();
+#define LIMMEDIATE(code, expr) LANE_OP(code) { Lanes& r = stack[sp - 1]; const Value b = op.val; LANES(const Value a = r.v[l]; r.v[l] = (expr)); } LANE_NEXT();
+
+// only code that CompiledProgram::lanes is true for gets here, so it never needs to check the stack,
+// the only memory it writes to is the temporaries, and nothing it does for one lane can change another.
+// when the lanes don't agree on which way a CND goes, or an op would fail in any of them,
+// each lane is finished on its own from that op, which makes errors happen exactly where they would have.
+Program::RuntimeError Program::ExecuteLanes(Value* results, const size_t size, const Lanes& t, const Lanes& m, const Lanes& q, RuntimeError& firstError)
+{
+#if COMPUTED_GOTO
+	// indexed by Op::Code, ops that never run in lanes go to the fallback
+	static const void* const laneHandlers[] =
+	{
+		&&lane_NOP, &&lane_PSH, &&lane_PEK, &&lane_default, &&lane_FRQ, &&lane_SQR, &&lane_SIN, &&lane_TRI,
+		&&lane_NEG, &&lane_MUL, &&lane_DIV, &&lane_MOD, &&lane_ADD, &&lane_SUB, &&lane_BSL, &&lane_BSR,
+		&&lane_AND, &&lane_OR,  &&lane_XOR, &&lane_CEQ, &&lane_CNE, &&lane_CLT, &&lane_CLE, &&lane_CGT,
+		&&lane_CGE, &&lane_CND, &&lane_POP, &&lane_GET, &&lane_PUT, &&lane_RND, &&lane_CCV, &&lane_VCV,
+		&&lane_NOT, &&lane_COM, &&lane_JMP, &&lane_LDV, &&lane_STV, &&lane_ADI, &&lane_SBI, &&lane_MLI,
+		&&lane_DVI, &&lane_MDI, &&lane_ANI, &&lane_ORI, &&lane_XRI, &&lane_SLI, &&lane_SRI, &&lane_DVR,
+		&&lane_MDR, &&lane_SEL, &&lane_default,
+	};
+	static_assert(sizeof(laneHandlers) / sizeof(laneHandlers[0]) == Op::HLT + 1, "every Op::Code needs a handler");
+#endif
+
+	const size_t memSize = compiled->memSize;
+	const Value tAddress = GetAddress('t', compiled->userMemSize);
+	const Value mAddress = GetAddress('m', compiled->userMemSize);
+	const Value qAddress = GetAddress('q', compiled->userMemSize);
+	const Instruction* const instructions = compiled->code.data();
+	const size_t count = compiled->code.size();
+	Lanes* const stack = state.laneStack.data();
+	Lanes* const temps = state.laneTemps.data();
+	size_t sp = 0;
+	size_t pc = 0;
+	Op op;
+
+	LANE_DISPATCH();
+
+#if !COMPUTED_GOTO
+dispatch:
+	if (pc == count) goto done;
+	op = compiled->Decode(instructions[pc]);
+	switch (op.code)
+	{
+#endif
+	LANE_OP(NOP) LANE_NEXT();
+
+	LANE_OP(PSH)
+	{
+		Lanes& r = stack[sp++];
+		LANES(r.v[l] = op.val);
+	}
+	LANE_NEXT();
+
+	LANE_OP(POP) --sp; LANE_NEXT();
+
+	LANE_OP(LDV)
+	{
+		Lanes& r = stack[sp++];
+		if ((size_t)op.val >= memSize) r = temps[op.val - memSize];
+		else if (op.val == tAddress) r = t;
+		else if (op.val == mAddress) r = m;
+		else if (op.val == qAddress) r = q;
+		else
+		{
+			// nothing writes to the other variables during a block, so they're the same in every lane
+			const Value v = state.mem[op.val];
+			LANES(r.v[l] = v);
+		}
+	}
+	LANE_NEXT();
+
+	LANE_OP(STV) temps[op.val - memSize] = stack[sp - 1]; LANE_NEXT();
+
+	LANE_OP(PEK)
+	{
+		Lanes& r = stack[sp - 1];
+		LANES(const Value address = r.v[l] % memSize;
+			r.v[l] = address == tAddress ? t.v[l] : address == mAddress ? m.v[l] : address == qAddress ? q.v[l] : state.mem[address]);
+	}
+	LANE_NEXT();
+
+	LANE_OP(GET)
+	{
+		Lanes& r = stack[sp - 1];
+		Lanes v;
+		bool failed = false;
+		LANES(failed = GetResult(r.v[l], results + l*size, size, v.v[l]) != RE_NONE || failed);
+		if (failed) LANE_FALLBACK();
+		r = v;
+	}
+	LANE_NEXT();
+
+	LANE_OP(PUT)
+	{
+		Lanes& address = stack[sp - op.val - 1];
+		bool failed = false;
+		LANES(failed = (address.v[l] != Wildcard::Value && address.v[l] >= size) || failed);
+		if (failed) LANE_FALLBACK();
+		// the same as PutResults, for the values of each lane
+		const Lanes* const args = stack + sp - op.val;
+		for (size_t l = 0; l < kLanes; ++l)
+		{
+			Value* const out = results + l*size;
+			const Value a = address.v[l];
+			if (a == Wildcard::Value)
+			{
+				Value sum = 0;
+				for (size_t i = 0; i < size; ++i)
+				{
+					out[i] = args[std::min((Value)i, op.val - 1)].v[l];
+					sum += out[i];
+				}
+				address.v[l] = sum;
+			}
+			else
+			{
+				for (Value i = 0; i < op.val && a + i < size; ++i)
+				{
+					out[a + i] = args[i].v[l];
+				}
+				address.v[l] = args[0].v[l];
+			}
+		}
+		sp -= op.val;
+	}
+	LANE_NEXT();
+
+	LANE_OP(CND)
+	{
+		const Lanes& c = stack[sp - 1];
+		size_t taken = 0;
+		LANES(taken += c.v[l] != 0);
+		if (taken != 0 && taken != kLanes) LANE_FALLBACK();
+		--sp;
+		if (taken == 0)
+		{
+			pc = op.val;
+			LANE_DISPATCH();
+		}
+	}
+	LANE_NEXT();
+
+	LANE_OP(JMP) pc = op.val; LANE_DISPATCH();
+
+	LANE_OP(DIV)
+	LANE_OP(MOD)
+	{
+		const Lanes& rb = stack[sp - 1];
+		bool zero = false;
+		LANES(zero = rb.v[l] == 0 || zero);
+		if (zero) LANE_FALLBACK();
+		--sp;
+		Lanes& r = stack[sp - 1];
+		if (op.code == Op::DIV) { LANES(r.v[l] /= rb.v[l]); }
+		else { LANES(r.v[l] %= rb.v[l]); }
+	}
+	LANE_NEXT();
+
+	LANE_OP(DVR)
+	LANE_OP(MDR)
+	{
+		const Divisor& d = state.divisors[op.val];
+		if (!d.value) LANE_FALLBACK();
+		Lanes& r = stack[sp - 1];
+		if (op.code == Op::DVR) { LANES(r.v[l] = d.Divide(r.v[l])); }
+		else { LANES(r.v[l] = r.v[l] - d.Divide(r.v[l])*d.value); }
+	}
+	LANE_NEXT();
+
+	LANE_OP(SEL)
+	{
+		sp -= 2;
+		Lanes& r = stack[sp - 1];
+		const Lanes& ra = stack[sp];
+		const Lanes& rb = stack[sp + 1];
+		LANES(r.v[l] = r.v[l] ? ra.v[l] : rb.v[l]);
+	}
+	LANE_NEXT();
+
+	LUNARY(NEG, -a);
+	LUNARY(NOT, !a);
+	LUNARY(COM, ~a);
+	LUNARY(SIN, Sine(a));
+	LUNARY(SQR, Square(a));
+	LUNARY(FRQ, Frequency(a));
+	LUNARY(TRI, Triangle(a));
+	LUNARY(CCV, GetCC(a));
+	LUNARY(VCV, GetVC(a));
+	// RunBlock only runs code with R in lanes with RM_COUNTER, where the numbers come from each lane's 't'
+	LUNARY(RND, a == 0 ? 0 : CounterRandom(state.randomSeed, t.v[l], op.val) % a);
+
+	LBINARY(MUL, a * b);
+	LBINARY(ADD, a + b);
+	LBINARY(SUB, a - b);
+	LBINARY(BSL, a << (b % 64));
+	LBINARY(BSR, a >> (b % 64));
+	LBINARY(AND, a & b);
+	LBINARY(OR, a | b);
+	LBINARY(XOR, a ^ b);
+	LBINARY(CEQ, a == b);
+	LBINARY(CNE, a != b);
+	LBINARY(CLT, a < b);
+	LBINARY(CLE, a <= b);
+	LBINARY(CGT, a > b);
+	LBINARY(CGE, a >= b);
+
+	// DVI and MDI never have a zero divisor
+	LIMMEDIATE(ADI, a + b);
+	LIMMEDIATE(SBI, a - b);
+	LIMMEDIATE(MLI, a * b);
+	LIMMEDIATE(DVI, a / b);
+	LIMMEDIATE(MDI, a % b);
+	LIMMEDIATE(ANI, a & b);
+	LIMMEDIATE(ORI, a | b);
+	LIMMEDIATE(XRI, a ^ b);
+	LIMMEDIATE(SLI, a << b);
+	LIMMEDIATE(SRI, a >> b);
+
+	// everything else is left for Exec
+#if COMPUTED_GOTO
+	lane_default:
+#else
+	default:
+#endif
+	LANE_FALLBACK();
+
+#if !COMPUTED_GOTO
+	}
+#endif
+
+done:
+	return RE_NONE;
+}
+
+#undef LANE_OP
+#undef LANE_DISPATCH
+#undef LANE_NEXT
+#undef LANE_FALLBACK
+#undef LANES
+#undef LUNARY
+#undef LBINARY
+#undef LIMMEDIATE
+
+#undef COMPUTED_GOTO
+#undef H
+#undef OP
+#undef DISPATCH
+#undef NEXT
+#undef OPERAND
+#undef JUMP
+#undef TPOP1
+#undef TPOP2
+#undef TPOPN
+#undef TPUSH
+#undef UNARY
+#undef BINARY
+#undef IMMEDIATE
+
+Program::RuntimeError Program::ExecuteLanesFrom(const size_t pc, const size_t sp, Value* results, const size_t size, const Lanes& t, const Lanes& m, const Lanes& q, RuntimeError& firstError)
+{
+	Value& tv = VarRef('t');
+	Value& mv = VarRef('m');
+	Value& qv = VarRef('q');
+	RuntimeError error = RE_NONE;
+	for (size_t l = 0; l < kLanes; ++l)
+	{
+		for (size_t i = 0; i < sp; ++i)
+		{
+			state.stack[i] = state.laneStack[i].v[l];
+		}
+		for (size_t i = 0; i < compiled->tempSize; ++i)
+		{
+			state.mem[compiled->memSize + i] = state.laneTemps[i].v[l];
+		}
+		tv = t.v[l];
+		mv = m.v[l];
+		qv = q.v[l];
+		state.sp = sp;
+		error = ExecuteFrom(pc, results + l*size, size);
+		if (firstError == RE_NONE)
+		{
+			firstError = error;
+		}
+	}
+
+	// the same as RunBlock, the error is that of the last frame
+	return error;
+}
+
+// the formula Frequency uses to fill its table, and falls back to for notes that are outside of it
+static Program::Value FrequencyOf(const Program::Value a, const Program::Value sampleRate)
+{
+	if (a == 0)
+	{
+		return 0;
+	}
+
+	// 3.023625 is a magic number arrived at by comparing our output to the Saw Wave in ReaSynth.
+	// 3.0 is what we'd expect to see if we were operating in floating point,
+	// but if we use 3.0 here, the pitch winds up being a little bit flat.
+	double f = round(4.0 * 3.023625 * pow(2.0, (double)a / 12.0) * (44100.0 / sampleRate));
+	return (Program::Value)f;
+}
+
+Program::Value Program::Frequency(const Value a)
+{
+	const Value sampleRate = VarRef('~');
+	if (a >= kFrequencyTableSize)
+	{
+		return FrequencyOf(a, sampleRate);
 	}
-	break;
 
-	case Op::CGT:
+	if (sampleRate != state.frequencyRate)
 	{
-		POP2;
-		stack.push(a > b);
+		state.frequencyRate = sampleRate;
+		// when the generation wraps around, entries from 2^32 changes ago could look valid, so clear them
+		if (++state.frequencyGeneration == 0)
+		{
+			memset(state.frequencyTable, 0, sizeof(state.frequencyTable));
+			state.frequencyGeneration = 1;
+		}
 	}
-	break;
 
-	case Op::CGE:
+	ExecutionState::FrequencyEntry& entry = state.frequencyTable[a];
+	if (entry.generation != state.frequencyGeneration)
 	{
-		POP2;
-		stack.push(a >= b);
+		entry.value = FrequencyOf(a, sampleRate);
+		entry.generation = state.frequencyGeneration;
 	}
-	break;
+	return entry.value;
+}
 
-	// number of operands is variable
-	case Op::POK:
+Program::RuntimeError Program::GetResult(const Value a, const Value* results, const size_t size, Value& out) const
+{
+	// wildcard GET should return the sum of all channels
+	if (a == Wildcard::Value)
 	{
-		// pop off all of the results
-		POP(op.val);
-		// pop off the address for the first result
-		POP1;
-
-		// the order of the args is last to first,
-		// ie: { 1, 2, 3 } winds up in args as { 3, 2, 1 }
-		// this is why we pop values for Poke from the back of args.
-		for (int i = 0; i < op.val; ++i)
+		Value v = 0;
+		for (size_t i = 0; i < size; ++i)
 		{
-			Value b = args.back();
-			args.pop_back();
-
-			Value address = a + i;
-			Poke(address, b);
+			v += results[i];
 		}
-
-		// the result of this operation should be what is now in the *first* memory address (ie 'a')
-		// this is to make chained assignment statements work as expected. 
-		// for example:
-		//
-		//	a = @1 = { 1, 2, 3 };
-		//
-		// should result in the value of 'a' being equal to the value of '@1'
-		stack.push(Peek(a));
+		out = v;
+	}
+	else if (a < size)
+	{
+		out = results[a];
+	}
+	else
+	{
+		out = 0;
+		return RE_GET_OUT_OF_BOUNDS;
 	}
-	break;
 
-	case Op::PUT:
+	return RE_NONE;
+}
+
+Program::Value Program::Assign(const Value a, const Value* args, const Value count)
+{
+	// args are in the order they were written in the program,
+	// ie: { 1, 2, 3 } winds up in args as { 1, 2, 3 }
+	for (Value i = 0; i < count; ++i)
 	{
-		// pop off all of the results
-		POP(op.val);
-		// pop off the address for the first result
-		POP1;
+		Poke(a + i, args[i]);
+	}
 
-		Value b = args.back();
-		args.pop_back();
+	// the result of this operation should be what is now in the *first* memory address (ie 'a')
+	// this is to make chained assignment statements work as expected. 
+	// for example:
+	//
+	//	a = @1 = { 1, 2, 3 };
+	//
+	// should result in the value of 'a' being equal to the value of '@1'
+	return Peek(a);
+}
 
-		// [*] = should fill the entire output
-		// so we assign results in order until we run out
-		// and then repeat the last one to the remaining outputs.
-		// so, if there is only 1 result, it is copied to all outputs.
-		if (a == Wildcard::Value)
-		{	
-			// since [*] returns the sum of all values (see GET), we need to sum up the output as we go
-			Value c = 0;
+Program::RuntimeError Program::PutResults(const Value a, const Value* args, const Value count, Value* results, const size_t size, Value& out)
+{
+	Value b = args[0];
 
-			for (size_t i = 0; i < size; ++i)
-			{
-				results[i] = b;
-				c += b;
-				if (!args.empty())
-				{
-					b = args.back();
-					args.pop_back();
-				}
-			}
+	// [*] = should fill the entire output
+	// so we assign results in order until we run out
+	// and then repeat the last one to the remaining outputs.
+	// so, if there is only 1 result, it is copied to all outputs.
+	if (a == Wildcard::Value)
+	{	
+		// since [*] returns the sum of all values (see GET), we need to sum up the output as we go
+		Value c = 0;
+		Value next = 1;
 
-			stack.push(c);
-		}
-		else if (a < size)
+		for (size_t i = 0; i < size; ++i)
 		{
-			// as with POK, the result of this operation should be equal to the first place we put a value.
-			// for example:
-			//
-			// a = [0] = { 1, 2 }
-			//
-			// should make a and [0] equal to 1, while [1] would be equal to 2
-			stack.push(b);
-
-			// begin assigning results starting from the provided index,
-			// but stop if we run out of args or get to the end of the output array.
-			results[a++] = b;
-			while (a < size && !args.empty())
+			results[i] = b;
+			c += b;
+			if (next < count)
 			{
-				b = args.back();
-				args.pop_back();
-				results[a++] = b;
+				b = args[next++];
 			}
 		}
-		else
-		{
-			error = RE_PUT_OUT_OF_BOUNDS;
-		}		
-	}
-	break;
 
-	// flow control.
-	// the pc is set to one less than the target address because it will be incremented after this method returns.
-	case Op::CND:
-	{
-		POP1;
-		if (!a) 
-		{ 
-			pc = op.val-1; 
-		}
+		out = c;
 	}
-	break;
-
-	case Op::JMP:
+	else if (a < size)
 	{
-		pc = op.val-1;
-	}
-	break;
+		// begin assigning results starting from the provided index,
+		// but stop if we run out of args or get to the end of the output array.
+		for (Value i = 0; i < count && a + i < size; ++i)
+		{
+			results[a + i] = args[i];
+		}
 
-	// perform a no-op, but set the error as a result
-	default:
-	{
-		error = RE_MISSING_OPCODE;
+		// as with POK, the result of this operation should be equal to the first place we put a value.
+		// for example:
+		//
+		// a = [0] = { 1, 2 }
+		//
+		// should make a and [0] equal to 1, while [1] would be equal to 2.
+		out = b;
 	}
-	break;
-
-bad_stack:
+	else
 	{
-		error = RE_MISSING_OPERAND;
-	}
-	break;
+		out = 0;
+		return RE_PUT_OUT_OF_BOUNDS;
 	}
 
-	return error;
+	return RE_NONE;
 }
 
 Program::Value Program::Get(const Char var) const
 {
-	return Peek(GetAddress(var, userMemSize));
+	return Peek(GetAddress(var, compiled->userMemSize));
 }
 
 void Program::Set(const Char var, const Value value)
 {
-	Poke(GetAddress(var, userMemSize), value);
+	Poke(GetAddress(var, compiled->userMemSize), value);
 }
 
 Program::Value Program::GetCC(const Value idx) const
 {
 	// prevent array reading overrun by wrapping around, since this is how accessing memory works
-	return cc[idx % kCCSize];
+	return state.cc[idx % kCCSize];
 }
 
 void Program::SetCC(const Value idx, const Value value)
 {
-	cc[idx % kCCSize] = value;
+	state.cc[idx % kCCSize] = value;
 }
 
 Program::Value Program::GetVC(const Value idx) const
 {
-	return vc[idx % kVCSize];
+	return state.vc[idx % kVCSize];
 }
 
 void Program::SetVC(const Value idx, const Value value)
 {
-	vc[idx % kVCSize] = value;
+	state.vc[idx % kVCSize] = value;
+}
+
+void Program::SetRandomMode(const RandomMode mode, const uint64_t seed)
+{
+	state.randomMode = mode;
+	state.randomSeed = seed;
 }
 
 Program::Value Program::Peek(const Value address) const
 {
 	// peeks wrap around so we never go outside of our memory space
-	return mem[address%memSize];
+	return state.mem[address%compiled->memSize];
 }
 
 
 void Program::Poke(const Value address, const Value value)
 {
 	// pokes wrap around so we never go outside of our memory space
-	mem[address%memSize] = value;
+	state.mem[address%compiled->memSize] = value;
+}
+
+#pragma endregion
+
+//////////////////////////////////////////////////////////////////////////
+// JIT
+//////////////////////////////////////////////////////////////////////////
+#pragma region JIT
+
+bool Program::SetExecutionEngine(const ExecutionEngine engine)
+{
+	if (engine == EE_JIT)
+	{
+		// the native code is shared by every Program running this code, so only the first one to select EE_JIT generates it
+		std::call_once(compiled->jitOnce, [this] { CompileJit(); });
+		jitCode = compiled->jitCode;
+	}
+
+	if (engine == EE_JIT && jitCode == nullptr)
+	{
+		execEngine = EE_THREADED;
+		return false;
+	}
+
+	execEngine = engine;
+	return true;
+}
+
+// static
+int Program::JitExec(Program* program, const Instruction* instruction, const size_t depth, Value* results, const size_t size)
+{
+	// the native code uses our stack memory, so all Exec needs is to know how deep it is
+	program->state.sp = depth;
+	// the native code only calls this once it knows there are enough values on the stack for the instruction
+	const RuntimeError error = program->Exec<false>(program->compiled->Decode(*instruction), results, size);
+	program->state.sp = 0;
+	return error;
+}
+
+#if JIT_AVAILABLE
+
+namespace
+{
+	enum Reg { RAX = 0, RCX, RDX, RBX, RSP, RBP, RSI, RDI, R8, R9, R10, R11, R12, R13, R14, R15 };
+
+	// the generated code keeps these in callee-saved registers for the whole run
+	const Reg kProgramReg = R12;
+	const Reg kStackReg = R13;
+	const Reg kMemReg = RBX;
+	const Reg kResultsReg = R14;
+	const Reg kSizeReg = R15;
+	const Reg kDivisorsReg = RBP;
+
+	// writes just enough x86-64 machine code for the JIT.
+	// stack operands are always addressed as [r13 + disp32], where r13 holds the base of the Program's stack
+	// and disp32 is computed from the depth the stack will be at, which is always known when generating the code.
+	class Assembler
+	{
+	public:
+		std::vector<uint8_t> code;
+
+		size_t Size() const { return code.size(); }
+		void Byte(uint8_t b) { code.push_back(b); }
+		void Bytes(std::initializer_list<uint8_t> bytes) { code.insert(code.end(), bytes); }
+		void Int32(int32_t v) { for (int i = 0; i < 4; ++i) Byte((uint8_t)(v >> (i * 8))); }
+		void Int64(uint64_t v) { for (int i = 0; i < 8; ++i) Byte((uint8_t)(v >> (i * 8))); }
+
+		static int32_t Slot(const size_t depth) { return (int32_t)(depth * sizeof(Program::Value)); }
+
+		// <opcode> reg, qword [r13 + slot] (or the reverse, depending on opcode). reg is the /digit for group opcodes.
+		void Stack(uint8_t opcode, int reg, const size_t depth)
+		{
+			Byte(0x48 | ((reg >> 3) << 2) | (kStackReg >> 3));
+			Byte(opcode);
+			Byte(0x80 | ((reg & 7) << 3) | (kStackReg & 7));
+			Int32(Slot(depth));
+		}
+
+		// same as Stack, but for two byte opcodes that begin with 0x0F
+		void Stack0F(uint8_t opcode, int reg, const size_t depth)
+		{
+			Byte(0x48 | ((reg >> 3) << 2) | (kStackReg >> 3));
+			Byte(0x0F);
+			Byte(opcode);
+			Byte(0x80 | ((reg & 7) << 3) | (kStackReg & 7));
+			Int32(Slot(depth));
+		}
+
+		void Load(Reg reg, const size_t depth) { Stack(0x8B, reg, depth); }
+		void Store(Reg reg, const size_t depth) { Stack(0x89, reg, depth); }
+
+		void Mov(Reg dst, Reg src)
+		{
+			Byte(0x48 | ((src >> 3) << 2) | (dst >> 3));
+			Byte(0x89);
+			Byte(0xC0 | ((src & 7) << 3) | (dst & 7));
+		}
+
+		void MovImm(Reg reg, uint64_t v)
+		{
+			Byte(0x48 | (reg >> 3));
+			Byte(0xB8 + (reg & 7));
+			Int64(v);
+		}
+
+		void Push(Reg reg) { if (reg >> 3) Byte(0x41); Byte(0x50 + (reg & 7)); }
+		void Pop(Reg reg) { if (reg >> 3) Byte(0x41); Byte(0x58 + (reg & 7)); }
+
+		// compare the stack value to zero
+		void TestZero(const size_t depth) { Stack(0x83, 7, depth); Byte(0); }
+		// setcc al, then zero extend it to all of rax
+		void SetFlag(uint8_t cc) { Bytes({ 0x0F, cc, 0xC0, 0x0F, 0xB6, 0xC0 }); }
+
+		// jumps are emitted with a placeholder offset that is patched when the address is known.
+		// these return where the offset is so it can be passed to Patch.
+		size_t Jump() { Byte(0xE9); Int32(0); return Size() - 4; }
+		size_t JumpIf(uint8_t cc) { Bytes({ 0x0F, cc }); Int32(0); return Size() - 4; }
+		void Patch(const size_t at, const size_t target)
+		{
+			const int32_t rel = (int32_t)(target - (at + 4));
+			memcpy(&code[at], &rel, sizeof(rel));
+		}
+	};
+
+	const uint8_t kJE = 0x84;
+	const uint8_t kJNE = 0x85;
+}
+
+bool Program::CompileJit()
+{
+	const size_t count = compiled->code.size();
+
+	// work out the depth of the stack before each op.
+	// this is the same walk as ComputeStackSize, but native code needs the depth to be the same
+	// on every path that reaches an op, so we give up if that isn't the case.
+	// ops that will always fail due to missing operands are still compiled, they just return the error.
+	const int unreached = -1;
+	std::vector<int> depthAt(count + 1, unreached);
+	depthAt[0] = 0;
+	for (size_t pc = 0; pc < count; ++pc)
+	{
+		const Op op = compiled->Decode(compiled->code[pc]);
+		const int depth = depthAt[pc];
+		if (depth == unreached || depth < StackInputs(op))
+		{
+			continue;
+		}
+
+		const int after = depth + StackEffect(op);
+		if (op.code == Op::POP && after > 0)
+		{
+			continue;
+		}
+
+		size_t targets[2] = { pc + 1, (size_t)op.val };
+		const size_t first = op.code == Op::JMP ? 1 : 0;
+		const size_t last = op.code == Op::JMP || op.code == Op::CND ? 2 : 1;
+		for (size_t t = first; t < last; ++t)
+		{
+			const size_t target = targets[t];
+			if (target <= pc || target > count || (depthAt[target] != unreached && depthAt[target] != after))
+			{
+				return false;
+			}
+			depthAt[target] = after;
+		}
+	}
+
+	// a PSH directly followed by PEK reads from a constant address, which can be wrapped here instead of at runtime,
+	// but only when nothing can jump to the PEK.
+	std::vector<bool> isTarget(count + 1, false);
+	for (const Instruction& instruction : compiled->code)
+	{
+		const Op op = compiled->Decode(instruction);
+		if ((op.code == Op::CND || op.code == Op::JMP) && op.val <= count)
+		{
+			isTarget[op.val] = true;
+		}
+	}
+
+	Assembler a;
+	// call JitExec for instruction with the stack at depth, leaving the error code in eax and the flags set from testing it
+	auto EmitExec = [](Assembler& a, const Instruction& instruction, const int depth)
+	{
+		a.Mov(RDI, kProgramReg);
+		a.MovImm(RSI, (uint64_t)&instruction);
+		a.Byte(0xBA); a.Int32(depth); // mov edx, depth
+		a.Mov(RCX, kResultsReg);
+		a.Mov(R8, kSizeReg);
+		a.MovImm(RAX, (uint64_t)&Program::JitExec);
+		a.Bytes({ 0xFF, 0xD0 }); // call rax
+		a.Bytes({ 0x85, 0xC0 }); // test eax, eax
+	};
+	std::vector<size_t> opAddress(count + 1);
+	// (where to patch, op index to jump to)
+	std::vector<std::pair<size_t, size_t>> jumps;
+	// jumps to the shared code that returns the error in eax
+	std::vector<size_t> exits;
+	std::vector<size_t> divideByZero;
+
+	// prologue: jitCode(program, stack, mem, results, size, divisors) arrives in rdi, rsi, rdx, rcx, r8, r9.
+	// pushing six registers and reserving eight more bytes leaves the stack 16 byte aligned for calls.
+	a.Push(RBX); a.Push(RBP); a.Push(R12); a.Push(R13); a.Push(R14); a.Push(R15);
+	a.Bytes({ 0x48, 0x83, 0xEC, 0x08 }); // sub rsp, 8
+	a.Mov(kProgramReg, RDI);
+	a.Mov(kStackReg, RSI);
+	a.Mov(kMemReg, RDX);
+	a.Mov(kResultsReg, RCX);
+	a.Mov(kSizeReg, R8);
+	a.Mov(kDivisorsReg, R9);
+
+	for (size_t pc = 0; pc < count; ++pc)
+	{
+		opAddress[pc] = a.Size();
+
+		const Instruction& instruction = compiled->code[pc];
+		const Op op = compiled->Decode(instruction);
+		const int d = depthAt[pc];
+		if (d == unreached)
+		{
+			continue;
+		}
+
+		if (d < StackInputs(op) || (op.code == Op::POP && d > 1))
+		{
+			a.Byte(0xB8); a.Int32(d < StackInputs(op) ? RE_MISSING_OPERAND : RE_INCONSISTENT_STACK); // mov eax, error
+			exits.push_back(a.Jump());
+			continue;
+		}
+
+		switch (op.code)
+		{
+		case Op::NOP:
+		case Op::POP:
+			break;
+
+		case Op::PSH:
+			if (pc + 1 < count && compiled->code[pc + 1].code == Op::PEK && !isTarget[pc + 1] && compiled->memSize*sizeof(Value) <= INT32_MAX)
+			{
+				const Value address = op.val % compiled->memSize;
+				a.Bytes({ 0x48, 0x8B, 0x83 }); a.Int32((int32_t)(address * sizeof(Value))); // mov rax, [rbx + disp32]
+				a.Store(RAX, d);
+				// skip the PEK
+				opAddress[++pc] = a.Size();
+			}
+			else if ((int64_t)op.val == (int32_t)op.val)
+			{
+				a.Stack(0xC7, 0, d); a.Int32((int32_t)op.val); // mov qword [slot], imm32
+			}
+			else
+			{
+				a.MovImm(RAX, op.val);
+				a.Store(RAX, d);
+			}
+			break;
+
+		case Op::NEG: a.Stack(0xF7, 3, d - 1); break;
+		case Op::COM: a.Stack(0xF7, 2, d - 1); break;
+		case Op::NOT:
+			a.TestZero(d - 1);
+			a.SetFlag(0x94); // sete
+			a.Store(RAX, d - 1);
+			break;
+
+		case Op::PEK:
+			// mem[address % memSize]
+			a.Load(RAX, d - 1);
+			a.Bytes({ 0x31, 0xD2 }); // xor edx, edx
+			a.MovImm(RCX, compiled->memSize);
+			a.Bytes({ 0x48, 0xF7, 0xF1 }); // div rcx
+			a.Bytes({ 0x48, 0x8B, 0x04, 0xD3 }); // mov rax, [rbx + rdx*8]
+			a.Store(RAX, d - 1);
+			break;
+
+		case Op::LDV:
+		case Op::STV:
+			if ((compiled->memSize + compiled->tempSize)*sizeof(Value) > INT32_MAX)
+			{
+				EmitExec(a, instruction, d);
+				exits.push_back(a.JumpIf(kJNE));
+			}
+			else if (op.code == Op::LDV)
+			{
+				a.Bytes({ 0x48, 0x8B, 0x83 }); a.Int32((int32_t)(op.val * sizeof(Value))); // mov rax, [rbx + disp32]
+				a.Store(RAX, d);
+			}
+			else
+			{
+				a.Load(RAX, d - 1);
+				a.Bytes({ 0x48, 0x89, 0x83 }); a.Int32((int32_t)(op.val * sizeof(Value))); // mov [rbx + disp32], rax
+			}
+			break;
+
+		// the group opcode digits for add, sub, and, or, xor with an immediate operand
+		case Op::ADI: case Op::SBI: case Op::ANI: case Op::ORI: case Op::XRI:
+		{
+			const int digit = op.code == Op::ADI ? 0 : op.code == Op::SBI ? 5 : op.code == Op::ANI ? 4 : op.code == Op::ORI ? 1 : 6;
+			if ((int64_t)op.val == (int32_t)op.val)
+			{
+				a.Stack(0x81, digit, d - 1); a.Int32((int32_t)op.val); // <op> qword [slot], imm32
+			}
+			else
+			{
+				// the register forms of the same instructions are 8 * digit + 1
+				a.MovImm(RAX, op.val);
+				a.Stack((uint8_t)(digit * 8 + 1), RAX, d - 1);
+			}
+		}
+		break;
+
+		case Op::MLI:
+			if ((int64_t)op.val == (int32_t)op.val)
+			{
+				a.Stack(0x69, RAX, d - 1); a.Int32((int32_t)op.val); // imul rax, [slot], imm32
+			}
+			else
+			{
+				a.MovImm(RAX, op.val);
+				a.Stack0F(0xAF, RAX, d - 1); // imul rax, [slot]
+			}
+			a.Store(RAX, d - 1);
+			break;
+
+		case Op::DVI:
+		case Op::MDI:
+			a.MovImm(RCX, op.val);
+			a.Load(RAX, d - 1);
+			a.Bytes({ 0x31, 0xD2 }); // xor edx, edx
+			a.Bytes({ 0x48, 0xF7, 0xF1 }); // div rcx
+			a.Store(op.code == Op::DVI ? RAX : RDX, d - 1);
+			break;
+
+		case Op::DVR:
+		case Op::MDR:
+		{
+			// the same as Divisor::Divide, with the divisor's fields addressed from rsi.
+			// the divisors belong to the Program running the code, so they are found from the pointer passed in rbp.
+			const int32_t divisor = (int32_t)(op.val * sizeof(Divisor));
+			const uint8_t value = (uint8_t)offsetof(Divisor, value);
+			const uint8_t magic = (uint8_t)offsetof(Divisor, magic);
+			const uint8_t shift = (uint8_t)offsetof(Divisor, shift);
+			const uint8_t add = (uint8_t)offsetof(Divisor, add);
+			// short forward jumps within this sequence, patched once we know where they land
+			auto shortJump = [&a](uint8_t opcode) { a.Bytes({ opcode, 0 }); return a.Size() - 1; };
+			auto land = [&a](const size_t at) { a.code[at] = (uint8_t)(a.Size() - (at + 1)); };
+
+			a.Bytes({ 0x48, 0x8D, 0xB5 }); a.Int32(divisor); // lea rsi, [rbp + divisor]
+			a.Bytes({ 0x48, 0x83, 0x7E, value, 0x00 }); // cmp qword [rsi + value], 0
+			divideByZero.push_back(a.JumpIf(kJE));
+			a.Load(RDI, d - 1);
+			a.Bytes({ 0x48, 0x8B, 0x46, magic }); // mov rax, [rsi + magic]
+			a.Bytes({ 0x48, 0x85, 0xC0 }); // test rax, rax
+			const size_t powerOfTwo = shortJump(0x74); // jz
+			a.Bytes({ 0x48, 0xF7, 0xE7 }); // mul rdi
+			a.Bytes({ 0x48, 0x89, 0xD0 }); // mov rax, rdx
+			a.Bytes({ 0x48, 0x83, 0x7E, add, 0x00 }); // cmp qword [rsi + add], 0
+			const size_t noAdd = shortJump(0x74); // je
+			a.Bytes({ 0x48, 0x89, 0xFA }); // mov rdx, rdi
+			a.Bytes({ 0x48, 0x29, 0xC2 }); // sub rdx, rax
+			a.Bytes({ 0x48, 0xD1, 0xEA }); // shr rdx, 1
+			a.Bytes({ 0x48, 0x01, 0xD0 }); // add rax, rdx
+			const size_t toShift = shortJump(0xEB); // jmp
+			land(powerOfTwo);
+			a.Bytes({ 0x48, 0x89, 0xF8 }); // mov rax, rdi
+			land(noAdd);
+			land(toShift);
+			a.Bytes({ 0x48, 0x8B, 0x4E, shift }); // mov rcx, [rsi + shift]
+			a.Bytes({ 0x48, 0xD3, 0xE8 }); // shr rax, cl
+			if (op.code == Op::MDR)
+			{
+				a.Bytes({ 0x48, 0x0F, 0xAF, 0x46, value }); // imul rax, [rsi + value]
+				a.Bytes({ 0x48, 0x29, 0xC7 }); // sub rdi, rax
+				a.Store(RDI, d - 1);
+			}
+			else
+			{
+				a.Store(RAX, d - 1);
+			}
+		}
+		break;
+
+		case Op::SLI: a.Stack(0xC1, 4, d - 1); a.Byte((uint8_t)op.val); break; // shl qword [slot], imm8
+		case Op::SRI: a.Stack(0xC1, 5, d - 1); a.Byte((uint8_t)op.val); break; // shr qword [slot], imm8
+
+		case Op::ADD: a.Load(RAX, d - 1); a.Stack(0x01, RAX, d - 2); break;
+		case Op::SUB: a.Load(RAX, d - 1); a.Stack(0x29, RAX, d - 2); break;
+		case Op::AND: a.Load(RAX, d - 1); a.Stack(0x21, RAX, d - 2); break;
+		case Op::OR:  a.Load(RAX, d - 1); a.Stack(0x09, RAX, d - 2); break;
+		case Op::XOR: a.Load(RAX, d - 1); a.Stack(0x31, RAX, d - 2); break;
+
+		case Op::MUL:
+			a.Load(RAX, d - 2);
+			a.Stack0F(0xAF, RAX, d - 1); // imul rax, [slot]
+			a.Store(RAX, d - 2);
+			break;
+
+		case Op::DIV:
+		case Op::MOD:
+			a.Load(RCX, d - 1);
+			a.Bytes({ 0x48, 0x85, 0xC9 }); // test rcx, rcx
+			divideByZero.push_back(a.JumpIf(kJE));
+			a.Load(RAX, d - 2);
+			a.Bytes({ 0x31, 0xD2 }); // xor edx, edx
+			a.Bytes({ 0x48, 0xF7, 0xF1 }); // div rcx
+			a.Store(op.code == Op::DIV ? RAX : RDX, d - 2);
+			break;
+
+		// the cpu masks the shift count to 6 bits, which is the same as b % 64
+		case Op::BSL: a.Load(RCX, d - 1); a.Stack(0xD3, 4, d - 2); break;
+		case Op::BSR: a.Load(RCX, d - 1); a.Stack(0xD3, 5, d - 2); break;
+
+		case Op::CEQ: case Op::CNE: case Op::CLT: case Op::CLE: case Op::CGT: case Op::CGE:
+		{
+			static const uint8_t setcc[] = { 0x94, 0x95, 0x92, 0x96, 0x97, 0x93 }; // sete, setne, setb, setbe, seta, setae
+			a.Load(RAX, d - 2);
+			a.Stack(0x3B, RAX, d - 1); // cmp rax, [slot]
+			a.SetFlag(setcc[op.code - Op::CEQ]);
+			a.Store(RAX, d - 2);
+		}
+		break;
+
+		case Op::SEL:
+			a.Load(RAX, d - 1);
+			a.TestZero(d - 3);
+			a.Stack0F(0x45, RAX, d - 2); // cmovne rax, [slot]
+			a.Store(RAX, d - 3);
+			break;
+
+		case Op::CND:
+			a.TestZero(d - 1);
+			jumps.push_back(std::make_pair(a.JumpIf(kJE), (size_t)op.val));
+			break;
+
+		case Op::JMP:
+			jumps.push_back(std::make_pair(a.Jump(), (size_t)op.val));
+			break;
+
+		default:
+			// everything else goes through Exec
+			EmitExec(a, instruction, d);
+			exits.push_back(a.JumpIf(kJNE));
+			break;
+		}
+	}
+
+	// the end of the program, which is the same check that Execute does
+	opAddress[count] = a.Size();
+	if (depthAt[count] > 1)
+	{
+		a.Byte(0xB8); a.Int32(RE_INCONSISTENT_STACK); // mov eax, error
+	}
+	else
+	{
+		a.Bytes({ 0x31, 0xC0 }); // xor eax, eax
+	}
+
+	const size_t epilogue = a.Size();
+	a.Bytes({ 0x48, 0x83, 0xC4, 0x08 }); // add rsp, 8
+	a.Pop(R15); a.Pop(R14); a.Pop(R13); a.Pop(R12); a.Pop(RBP); a.Pop(RBX);
+	a.Byte(0xC3); // ret
+
+	const size_t divideByZeroExit = a.Size();
+	a.Byte(0xB8); a.Int32(RE_DIVIDE_BY_ZERO);
+	exits.push_back(a.Jump());
+
+	for (auto& jump : jumps)
+	{
+		a.Patch(jump.first, opAddress[jump.second]);
+	}
+	for (size_t at : exits)
+	{
+		a.Patch(at, epilogue);
+	}
+	for (size_t at : divideByZero)
+	{
+		a.Patch(at, divideByZeroExit);
+	}
+
+	// copy the code into its own pages, which are made executable once they are no longer writable
+	const size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+	const size_t size = (a.Size() + pageSize - 1) / pageSize * pageSize;
+	int flags = MAP_PRIVATE | MAP_ANON;
+#ifdef MAP_JIT
+	flags |= MAP_JIT;
+#endif
+	void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+	if (pages == MAP_FAILED)
+	{
+		return false;
+	}
+
+	memcpy(pages, a.code.data(), a.Size());
+	if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0)
+	{
+		munmap(pages, size);
+		return false;
+	}
+
+	compiled->jitCode = (JitFunction)pages;
+	compiled->jitCodeSize = size;
+	return true;
+}
+
+#else
+
+bool Program::CompileJit()
+{
+	return false;
 }
 
+#endif // JIT_AVAILABLE
+
 #pragma endregion
@@ -9,8 +9,10 @@
 #pragma once
 
 #include <stdint.h>
+#include <atomic>
+#include <memory>
+#include <mutex>
 #include <vector>
-#include <stack>
 #include <random>
 
 class Program
@@ -43,6 +45,46 @@ public:
 		RE_PUT_OUT_OF_BOUNDS, // index for PUT was bigger than the size of the results array
 	};
 
+	// the ways a program can be executed. they all produce identical results.
+	enum ExecutionEngine
+	{
+		EE_SWITCH, // calls Exec for each instruction, which switches on the op code
+		EE_THREADED, // runs pre-decoded instructions whose handlers jump directly to the handler of the next instruction
+		EE_JIT, // runs native code generated from the ops, only available on x86-64 (excluding Windows)
+		EE_LANES, // RunBlock runs each op for kLanes frames at once when the program allows it (see CompiledProgram::lanes), otherwise the same as EE_THREADED
+	};
+
+	// optimization passes Compile can run, which can be combined.
+	// none of these change the results of running a program, only how many instructions it takes to get them.
+	enum Optimization
+	{
+		OPT_NONE = 0,
+		OPT_FOLD_CONSTANTS = 1 << 0, // evaluate operations on constants and remove operations that do nothing
+		OPT_FUSE_INSTRUCTIONS = 1 << 1, // combine common pairs of instructions into a single instruction
+		OPT_REDUCE_DIVISION = 1 << 2, // replace division by constants and block invariant values with shifts, masks, and reciprocals
+		OPT_ELIMINATE_COMMON_SUBEXPRESSIONS = 1 << 3, // compute repeated expressions once, keeping the result in a hidden temporary
+		OPT_HOIST_INVARIANTS = 1 << 4, // compute expressions that can't change during a block once before the block, keeping the result in a hidden temporary
+		OPT_SELECT = 1 << 5, // compute both sides of short ternaries that can't fail and keep one of them, instead of jumping, in code that can run in EE_LANES
+		OPT_ALL = 0xFFFFFFFF,
+	};
+
+	// how a program uses a variable, or user memory, from one frame to the next (see StateReport).
+	// t, m, and q are set by RunBlock for every frame, so what a program writes to them is never seen by the next frame.
+	enum VariableState
+	{
+		VS_UNUSED, // never read or written
+		VS_INPUT, // read but never written, so it always has the value it was given with Set or Poke
+		VS_LOCAL, // written before every read in a frame, so no frame sees what an earlier frame wrote
+		VS_CARRIED, // a read can see what an earlier frame wrote
+	};
+
+	// where the R operator gets its numbers from (see SetRandomMode)
+	enum RandomMode
+	{
+		RM_SEQUENTIAL, // the next number from a generator seeded from the clock, so every run is different. this is the default.
+		RM_COUNTER, // a hash of the seed, 't', and which R in the program it is, so a frame gets the same numbers no matter what ran before it
+	};
+
 	// type of the string expression for Compile
 	typedef char	 Char;
 	// type of the value returned by evaluation
@@ -83,27 +125,129 @@ public:
 			POP, // ; (pop a value from the stack and do nothing with it)
 			GET, // get the the current value of a result. eg [0] or [1].
 			PUT, // assign to an output result using [0] = expression.
-			RND, // random number operator - operand is used to wrap value returned by rand() - so like Random.Range(0, operand)
+			RND, // random number operator - operand is used to wrap the random value - so like Random.Range(0, operand). val is which R in the source it is (see RM_COUNTER)
 			CCV, // use the operand to look up the current value of a midi control change value, eg 'a = C1'
 			VCV, // use the operand to look up the current value of a "voltage" control value, eg 'a = V5'
 			NOT,
 			COM,
 			JMP, // JMP to the address indicated by val
+			// fused instructions generated by the optimizer (see Optimize).
+			// each of these does the work of a PSH and the op that follows it in a single dispatch.
+			LDV, // load the value at the memory address in val, which is always less than memSize, or is a temporary (PSH, PEK)
+			STV, // store the top of the stack at the memory address in val, leaving it on the stack (PSH address, ..., POK 1)
+			ADI, // the binary operators with the right operand in val (PSH, ADD)
+			SBI,
+			MLI,
+			DVI, // val is never zero
+			MDI, // val is never zero
+			ANI,
+			ORI,
+			XRI,
+			SLI, // val is the shift, already wrapped to less than 64
+			SRI, // val is the shift, already wrapped to less than 64
+			DVR, // divide by the divisor at index val in divisors, using its reciprocal (PSH constant, DIV or PSH address, PEK, DIV, etc)
+			MDR, // modulo by the divisor at index val in divisors, using its reciprocal
+			SEL, // pop c, a, and b and push a if c is non-zero, otherwise b. generated by the optimizer in place of ?: (see OPT_SELECT)
+			HLT, // stop execution. the compiler never generates this, engines append it to the end of the code they run.
 		};
 
 		// need default constructor or we can't use vector
 		Op() : code(PSH), val(0) {}
 		Op(Code _code, Value _val) : code(_code), val(_val) {}
 
-		const Code code;
-		// this is mutable because the compiler needs to be able to change it in some cases
+		// these are mutable because the compiler and optimizer need to be able to change them
+		Code code;
 		Value val;
 	};
 
+	// an Op the way a CompiledProgram keeps it, in half the space, so that running long programs touches less memory.
+	// operands that are a sign extended 32 bit value are kept inline, the rest are kept in CompiledProgram::constants.
+	struct Instruction
+	{
+		Instruction(Op::Code inCode, bool inPooled, int32_t inOperand) : code((uint8_t)inCode), pooled(inPooled), operand(inOperand) {}
+
+		uint8_t code; // an Op::Code
+		bool    pooled; // operand is the index of the value in constants rather than the value
+		int32_t operand;
+	};
+
+	// the time values a host advances once per sample frame.
+	// RunBlock uses this to set 't', 'm', and 'q' before running each frame
+	// and increments tick once per frame so that the next block picks up where this one left off.
+	struct TickState
+	{
+		TickState(Value inTick, double inMDenom, double inQDenom) : tick(inTick), mdenom(inMDenom), qdenom(inQDenom) {}
+
+		Value  tick;   // the value of 't' for the next frame
+		double mdenom; // samples per millisecond, used to derive 'm' from 't'
+		double qdenom; // samples per 128th note, used to derive 'q' from 't'
+	};
+
+	// a divisor that can't change while a block is running: a constant, a variable the program never assigns to, or a V control.
+	// DVR and MDR divide by multiplying with the precomputed reciprocal, which is derived again
+	// at the start of Run or RunBlock whenever the value of the source has changed.
+	struct Divisor
+	{
+		enum Source
+		{
+			DS_CONSTANT,
+			DS_MEMORY, // index is the address
+			DS_VC, // index is the V control
+		};
+
+		Divisor(Source inSource, Value inIndex) : source(inSource), index(inIndex), value(0), magic(0), shift(0), add(0) {}
+
+		// calculate the reciprocal for v
+		void Derive(const Value v);
+		// n / value, which must not be zero
+		Value Divide(const Value n) const;
+
+		Source source;
+		Value  index;
+		Value  value; // the divisor the reciprocal was derived from
+		Value  magic; // zero when value is a power of two, in which case the quotient is n >> shift
+		Value  shift;
+		Value  add;   // one when magic needed 65 bits, so the quotient needs an extra add and shift
+	};
+
+	// what Compile found out about the state a program carries from one frame to the next.
+	// addresses the program computes, like @(t%8), could be any address, so the report assumes they are.
+	struct StateReport
+	{
+		StateReport();
+
+		// a frame can't see anything an earlier frame did, so frames can run in any order, or at the same time, with the same results.
+		// R only carries state when it draws from the RM_SEQUENTIAL generator.
+		bool IsStateless(const RandomMode randomMode = RM_SEQUENTIAL) const;
+
+		VariableState variables[256]; // indexed by the variable, eg variables['a'], for every possible Char
+		VariableState userMemory; // the worst state of any address in user memory
+		bool usesRandom; // the code contains R, which reads 't' with RM_COUNTER and advances a generator with RM_SEQUENTIAL
+	};
+
+	// the code and everything else about a compiled program that doesn't change while it runs.
+	// Programs compiled from the same source share one of these (see Compile).
+	struct CompiledProgram;
+
 	// userMemorySize is used to determine the size of read/write memory used by the program.
 	// "user" memory is memory that is accessible only via the @ operator and is otherwise 
 	// not modified by the program (but can be externally modified from C++ by calling Peek).
-	static Program* Compile(const Char* source, const size_t userMemorySize, CompileError& outError, int& outErrorPosition);
+	// optimizations is a combination of Optimization flags.
+	// CompiledPrograms are cached by a hash of the source, userMemorySize, and optimizations.
+	// compiling source that is in the cache only has to create the new Program's state, sharing the CompiledProgram.
+	// the cache keeps every CompiledProgram that a Program is running and the 64 most recently used ones that none are.
+	static Program* Compile(const Char* source, const size_t userMemorySize, CompileError& outError, int& outErrorPosition, const uint32_t optimizations = OPT_ALL);
+
+	// how often Compile has found what it was asked to compile in the cache
+	struct CompileCacheStats
+	{
+		uint64_t hits;   // compiles that reused a CompiledProgram
+		uint64_t misses; // compiles that had to parse the source, including ones that failed
+		size_t   size;   // how many CompiledPrograms the cache holds
+	};
+	static CompileCacheStats GetCompileCacheStats();
+	// empty the cache and reset the counters. Programs keep running what they were compiled with.
+	static void ClearCompileCache();
 	// get the address in memory of a variable declared in a program with a particular userMemorySize.
 	static Value GetAddress(const Char var, size_t userMemorySize);
 
@@ -111,15 +255,44 @@ public:
 	static const char * GetErrorString(CompileError error);
 	static const char * GetErrorString(RuntimeError error);
 
-	Program(const std::vector<Op>& inOps, const size_t userMemorySize);
-	~Program();
+	// create a Program with its own memory and stack that runs the code in compiledProgram.
+	explicit Program(const std::shared_ptr<CompiledProgram>& compiledProgram);
 
-	uint64_t GetInstructionCount() const { return ops.size(); }
+	uint64_t GetInstructionCount() const;
+	// how the program carries state from one frame to the next
+	const StateReport& GetStateReport() const;
+	// whether frames can be run in any order, or at the same time, and give the same results with the current RandomMode
+	bool IsStateless() const;
+	// how many instructions the optimizer removed from what the parser generated
+	uint64_t GetRemovedInstructionCount() const;
+	size_t   GetStackSize() const;
+	// the code this runs, which is the same object for every Program compiled from the same source
+	const CompiledProgram& GetCompiledProgram() const { return *compiled; }
 
 	// run the program placing the value it evaluates to into the results array.
 	// count is provided so that we can prevent the program from overrunning the array.
 	RuntimeError Run(Value* results, const size_t size);
 
+	// run the program once for each of frames, advancing t/m/q from tickState as we go.
+	// inputs and outputs are interleaved by frame: channel c of frame f is at [f*channels + c].
+	// outputs for each frame are initialized from inputs before the program runs, just like results in Run.
+	// inputs and outputs can point to the same buffer.
+	// the returned error is that of the last frame, which matches what calling Run for each frame would report.
+	// when firstError is not null, it is set to the error of the first frame that had one, or RE_NONE.
+	RuntimeError RunBlock(const Value* inputs, Value* outputs, const size_t channels, const size_t frames, TickState& tickState, RuntimeError* firstError = nullptr);
+
+	// choose how Run and RunBlock execute the program, the default is EE_THREADED.
+	// selecting EE_JIT generates the native code, so it should not be done on the audio thread.
+	// if native code can't be generated for this program, EE_THREADED is used instead and false is returned.
+	bool SetExecutionEngine(const ExecutionEngine engine);
+	// the engine that is actually being used
+	ExecutionEngine GetExecutionEngine() const { return execEngine; }
+
+	// choose where R gets its numbers from, the default is RM_SEQUENTIAL. seed is only used by RM_COUNTER.
+	void SetRandomMode(const RandomMode mode, const uint64_t seed = 0);
+	RandomMode GetRandomMode() const { return state.randomMode; }
+	uint64_t   GetRandomSeed() const { return state.randomSeed; }
+
 	// get the current value of a var, eg Get('t')
 	Value Get(const Char var) const;
 	// set the value of a var, eg Set('m', 128)
@@ -140,29 +313,188 @@ public:
 
 private:
 
-	RuntimeError Exec(const Op& op, Value* results, size_t size);
+	// runs all instructions once with the selected engine, assumes that code is not empty
+	RuntimeError Execute(Value* results, const size_t size);
+	// Checked is false for code that was verified (see CompiledProgram::verified), which doesn't need to check the stack for each op
+	template<bool Checked> RuntimeError Exec(const Op& op, Value* results, size_t size);
+	// the EE_THREADED engine. when decode is true, this fills threadedOps from code instead of running.
+	template<bool Checked> RuntimeError ExecuteThreaded(Value* results, const size_t size, const bool decode);
+	// the EE_SWITCH engine, starting at pc with whatever is on the stack
+	RuntimeError ExecuteFrom(const size_t pc, Value* results, const size_t size);
+	// the EE_LANES engine, which runs the frames starting at results, each size values after the last, with those values of t, m, and q
+	struct Lanes;
+	// firstError is set to the error of the first of those frames that had one, if it is still RE_NONE.
+	RuntimeError ExecuteLanes(Value* results, const size_t size, const Lanes& t, const Lanes& m, const Lanes& q, RuntimeError& firstError);
+	// finish running the frames of ExecuteLanes one at a time from pc, with the depth of the stack at sp
+	RuntimeError ExecuteLanesFrom(const size_t pc, const size_t sp, Value* results, const size_t size, const Lanes& t, const Lanes& m, const Lanes& q, RuntimeError& firstError);
+
+	// generate native code for the EE_JIT engine, returns false if that isn't possible
+	bool CompileJit();
+	// called from native code to run instructions that are not generated inline.
+	// depth is the number of values on the stack when instruction runs, which the JIT always knows ahead of time.
+	static int JitExec(Program* program, const Instruction* instruction, const size_t depth, Value* results, const size_t size);
 
+	// implementations of the ops that are more than a line or two, shared by all engines.
+	// where their formula would divide by zero, which used to crash, they return zero instead.
+	Value Sine(const Value a);
+	Value Square(const Value a);
+	Value Triangle(Value a);
+	Value Frequency(const Value a);
+	// the number R evaluates to for the R at site (see Op::RND)
+	Value Random(const Value a, const Value site);
+	// recalculate what Sine, Square, and Triangle keep for the value of 'w'
+	void UpdateOscillators(const Value w);
+	// the memory of a variable, which is always inside of mem, so it doesn't need the wrapping done by Peek and Poke
+	Value& VarRef(const Char var);
+	RuntimeError GetResult(const Value a, const Value* results, const size_t size, Value& out) const;
+	Value Assign(const Value a, const Value* args, const Value count);
+	RuntimeError PutResults(const Value a, const Value* args, const Value count, Value* results, const size_t size, Value& out);
+
+	// the total size of memory for a program with userMemorySize, which includes the space for variables
+	static size_t GetMemorySize(const size_t userMemorySize);
+	// derive the reciprocals of divisors whose source has changed since the last time
+	void UpdateDivisors();
+	// run the invariant code, see CompiledProgram::invariantCode
+	void UpdateInvariants();
+
+	// Frequency keeps results for notes below this, which covers all of MIDI with room to transpose up
+	static const size_t kFrequencyTableSize = 256;
 	static const size_t kCCSize = 128;
 	static const size_t kVCSize = 8;
+	// how many frames EE_LANES runs at once, which is two AVX2 registers of Values
+	static const size_t kLanes = 8;
+
+	// a value for each frame run by EE_LANES
+	struct Lanes
+	{
+		Value v[kLanes];
+	};
+
+	// an instruction decoded for EE_THREADED, which is the same size as an Instruction.
+	// with computed goto this holds the offset of the handler for the op from the first handler,
+	// otherwise it holds the op code, which the handlers switch on.
+	struct ThreadedOp
+	{
+		union
+		{
+			int32_t  handler;
+			Op::Code code;
+		};
+		int32_t operand; // the same as Instruction::operand, which is never pooled (see ExecuteThreaded)
+	};
+
+	// native code for EE_JIT, called as jitCode(this, stack, mem, results, size, divisors)
+	typedef int(*JitFunction)(Program* program, Value* stack, Value* mem, Value* results, size_t size, Divisor* divisors);
+
+	// everything that running a program changes, which each Program has its own copy of
+	struct ExecutionState
+	{
+		explicit ExecutionState(const CompiledProgram& compiled);
+
+		// the divisors of the DVR and MDR instructions, which are derived again when their source changes (see UpdateDivisors)
+		std::vector<Divisor> divisors;
+		// SIN, SQR, and TRI divide by 'w' (or 'w' + 1) with these, which are derived when 'w' changes (see UpdateOscillators).
+		Value   oscillatorW;
+		Divisor squareDivisor;
+		Divisor sineDivisor;
+		// the table of Sine results for the current 'w', which is shared by every Program (see SineTableFor).
+		// null when 'w' isn't a power of two that has a table.
+		std::atomic<uint32_t>* sineTable;
+		// results of Frequency for small notes at the sample rate in frequencyRate ('~'), filled in as they are needed.
+		// an entry is only valid when its generation matches frequencyGeneration, which is incremented when '~' changes.
+		struct FrequencyEntry
+		{
+			Value    value;
+			uint32_t generation;
+		};
+		FrequencyEntry frequencyTable[kFrequencyTableSize];
+		Value    frequencyRate;
+		uint32_t frequencyGeneration;
+		size_t pc; // program counter, stored here because it can be changed by TRN and JMP
+		// the memory space - read/write memory for the program (use Peek/Poke from C++)
+		// this includes "user" memory accessible with @, where @0 maps to mem[0]
+		// and also includes "variable" memory accessible with lowercase letters like 'a', 'b', 'c', etc.
+		// it is also possible to access variable values with @ if you know the address of the variable.
+		// temporaries follow at mem[memSize], which only LDV and STV can reach.
+		// for safety, we always wrap the address to the size of the array to prevent invalid access.
+		std::vector<Value> mem;
+		// memory for storing MIDI CC values - readonly from within a program
+		Value cc[kCCSize];
+		// memory for storing VC values = readonly from within a program
+		Value vc[kVCSize];
+		// the execution stack (reused each time Run is called).
+		// this is allocated once with enough room for the deepest the program can go, so it never needs to grow.
+		std::vector<Value> stack;
+		// the number of values currently on the stack
+		size_t sp;
+		// rng because rand() doesn't generate a large enough range
+		std::default_random_engine rng;
+		RandomMode randomMode;
+		uint64_t   randomSeed;
+		// the stack and temporaries for EE_LANES, which are only allocated for programs that can use it
+		std::vector<Lanes> laneStack;
+		std::vector<Lanes> laneTemps;
+	};
+
+	// shared with every other Program compiled from the same source
+	std::shared_ptr<CompiledProgram> compiled;
+	ExecutionState state;
+	ExecutionEngine execEngine;
+	// compiled->jitCode once EE_JIT has been selected, kept here so Execute doesn't have to look for it
+	JitFunction jitCode;
+};
+
+struct Program::CompiledProgram
+{
+	// stackSize is the maximum number of values the code will ever have on the stack at once (see ComputeStackSize).
+	// temporaryCount is how many hidden memory slots to allocate after the addressable memory for LDV and STV to use.
+	// divisors are those referenced by DVR and MDR, with the reciprocals of constant divisors already derived.
+	// verified, lanes, and stateReport are what Compile found out about the code, see below.
+	CompiledProgram(std::vector<Instruction>&& inCode, std::vector<Instruction>&& inInvariantCode, std::vector<Value>&& inConstants, std::vector<Divisor>&& inDivisors, const size_t userMemorySize, const size_t stackSize, const bool verified, const bool lanes, const StateReport& stateReport, const size_t temporaryCount, const uint64_t removedCount);
+	~CompiledProgram();
+
+	// the Op an instruction was made from
+	Op Decode(const Instruction& instruction) const
+	{
+		return Op((Op::Code)instruction.code, instruction.pooled ? constants[instruction.operand] : (Value)(int64_t)instruction.operand);
+	}
 
-	// the compiled code
-	std::vector<Op> ops;
-	size_t pc; // program counter, stored here because it can be changed by TRN and JMP
+	const std::vector<Instruction> code;
+	// runs before code at the start of every block to fill in the temporaries for expressions that can't change during one.
+	// it only contains ops that can't fail, so none of the engines need to check it.
+	const std::vector<Instruction> invariantCode;
+	// the operands that don't fit in an Instruction, each of them once
+	const std::vector<Value> constants;
+	// what each Program starts its own copy of the divisors from
+	const std::vector<Divisor> divisors;
+	const uint64_t removedInstructionCount;
 	const size_t userMemSize; // how much of mem is "user" memory
-	const size_t memSize; // the actual size of mem
-	// the memory space - read/write memory for the program (use Peek/Poke from C++)
-	// this includes "user" memory accessible with @, where @0 maps to mem[0]
-	// and also includes "variable" memory accessible with lowercase letters like 'a', 'b', 'c', etc.
-	// it is also possible to access variable values with @ if you know the address of the variable.
-	// for safety, we always wrap the address to the size of the array to prevent invalid access.
-	Value* mem;
-	// memory for storing MIDI CC values - readonly from within a program
-	Value cc[kCCSize];
-	// memory for storing VC values = readonly from within a program
-	Value vc[kVCSize];
-	// the execution stack (reused each time Run is called)
-	std::stack<Value> stack;
-	// rng because rand() doesn't generate a large enough range
-	std::default_random_engine rng;
+	const size_t memSize; // the size of mem that the program can address, addresses wrap around at this size
+	const size_t tempSize; // how many hidden temporaries the optimizer put at the end of mem (see OPT_ELIMINATE_COMMON_SUBEXPRESSIONS and OPT_HOIST_INVARIANTS)
+	const size_t stackSize;
+	// Compile proved that the code can't run out of values to pop, that every POP empties the stack, and that every jump lands in the code,
+	// so the engines run it without checking for RE_MISSING_OPERAND or RE_INCONSISTENT_STACK
+	const bool verified;
+	// nothing the code does for one frame can be seen by a later frame,
+	// so RunBlock can run it for several frames at once with EE_LANES and get the same results.
+	// this is true when it only writes to temporaries, which are written before they are read in every frame.
+	// code that uses R only runs in lanes when the Program is using RM_COUNTER.
+	const bool lanes;
+	const StateReport stateReport;
+
+	// the code for the execution engines doesn't depend on the state of any one Program,
+	// so it is generated once, by the first Program that needs it, and used by all of them.
+	// code decoded for EE_THREADED, with an extra instruction at the end to stop execution
+	std::once_flag threadedOnce;
+	std::vector<ThreadedOp> threadedOps;
+	// native code for EE_JIT, which is null when it hasn't been generated or it isn't possible to generate it
+	std::once_flag jitOnce;
+	JitFunction jitCode;
+	size_t jitCodeSize;
 };
 
+inline uint64_t Program::GetInstructionCount() const { return compiled->code.size(); }
+inline uint64_t Program::GetRemovedInstructionCount() const { return compiled->removedInstructionCount; }
+inline const Program::StateReport& Program::GetStateReport() const { return compiled->stateReport; }
+inline bool     Program::IsStateless() const { return compiled->stateReport.IsStateless(state.randomMode); }
+inline size_t   Program::GetStackSize() const { return compiled->stackSize; }
@@ -6,11 +6,44 @@
 //
 //
 
+#include <algorithm>
 #include <iostream>
 #include <iomanip>
 #include <math.h>
 #include <cassert>
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
 #include "../Program.h"
+#include "../Presets.h"
+
+// count every allocation so we can check that running a program never allocates
+static size_t allocationCount = 0;
+
+void* operator new(size_t size)
+{
+    ++allocationCount;
+    void* ptr = malloc(size > 0 ? size : 1);
+    if ( ptr == nullptr )
+    {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void operator delete(void* ptr) noexcept
+{
+    free(ptr);
+}
 
 // Timer from http://stackoverflow.com/questions/1861294/how-to-calculate-execution-time-of-a-code-snippet-in-c
 class Timer
@@ -113,6 +146,17 @@ Test tests[] = {
     { "[*] = $(t*Fn) | t*n/10>>4 ^ p>>(m/250%12)", EVAL($(t*F(n)) | t*n/10>>4 ^ p>>(m/250%12)), EEE_NO_ERROR },
     { "[*] = (t*128 | t*17>>2) | ((t-4500)*64 | (t-4500)*5>>3) | p<<12", EVAL((t*128 | t*17>>2) | ((t-4500)*64 | (t-4500)*5>>3) | p<<12), EEE_NO_ERROR },
     
+    // test constant folding and algebraic simplification
+    { "[*] = (t+0)*1 | 0 ^ 0 + t<<0 & -1", EVAL((t|(t&~(Program::Value)0))), EEE_NO_ERROR },
+    { "[*] = 1*t - -n + 0*t", EVAL(t + n), EEE_NO_ERROR },
+    { "[*] = t + -n + --p + ~~m", EVAL(t - n + p + m), EEE_NO_ERROR },
+    { "[*] = t/(7-2) + 7%(1-3) + (3<<65)", EVAL(t/5 + 7%(Program::Value)-2 + (3<<1)), EEE_NO_ERROR },
+    { "[*] = t > 5 ? (2*3+1)*n : -(0-4)/(1+1)", EVAL(t > 5 ? 7*n : 2), EEE_NO_ERROR },
+    
+    // test common subexpressions, which must be computed again after one of their inputs is assigned to
+    { "a = (m/125)%3 + (m/125)%5; [*] = a + (m/125)%3*(m/125)%5", EVAL((m/125)%3 + (m/125)%5 + (m/125)%3*(m/125)%5), EEE_NO_ERROR },
+    { "[*] = t*Fn + (t = t + 1) + t*Fn", EVAL(t*F(n) + (t+1) + (t+1)*F(n)), EEE_NO_ERROR },
+    
     // test syntax errors
     { "[*] = 5*(2*$(1+3+1)", EVAL(0), EEE_PARENTHESIS },
     { "[*] = 5*/2", EVAL(0), Program::CE_FAILED_TO_PARSE_NUMBER },
@@ -132,6 +176,1151 @@ void set(Program& e, Program::Value _t, Program::Value _p)
     e.Set('p', _p);
 }
 
+// RunBlock should produce exactly what calling Run once per frame produces
+static void testRunBlock()
+{
+    const char * source = "a = a + 1; [0] = t*Fn + [1]; [1] = m^q^a";
+    const size_t frames = 512;
+    Program::CompileError err;
+    int errPos;
+    Program* block = Program::Compile(source, 1024, err, errPos);
+    Program* single = Program::Compile(source, 1024, err, errPos);
+    assert(err == Program::CE_NONE);
+    
+    Program::Value buffer[frames*2];
+    Program::Value expected[frames*2];
+    for(size_t i = 0; i < frames*2; ++i)
+    {
+        buffer[i] = expected[i] = i*7;
+    }
+    
+    const double mdenom = 44100/1000.0;
+    const double qdenom = 44100/(120/60.0)/128.0;
+    for(Program* program : { block, single })
+    {
+        program->Set('w', w);
+        program->Set('n', n);
+    }
+    
+    Program::TickState tickState(t, mdenom, qdenom);
+    block->RunBlock(buffer, buffer, 2, frames, tickState);
+    
+    for(size_t f = 0; f < frames; ++f)
+    {
+        single->Set('t', t+f);
+        single->Set('m', (Program::Value)round((t+f)/mdenom));
+        single->Set('q', (Program::Value)round((t+f)/qdenom));
+        single->Run(expected + f*2, 2);
+    }
+    
+    const bool passed = memcmp(buffer, expected, sizeof(buffer)) == 0 && tickState.tick == t+frames;
+    std::cout << "RunBlock over " << frames << " frames " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+    
+    delete block;
+    delete single;
+}
+
+// RunBlock returns the error of the last frame, and can also report the first frame's error, which is all a chunk of a render checks
+static void testRunBlockFirstError()
+{
+    // divides by zero only when t is 100, in the middle of a block and of a group of lanes
+    const char * source = "[*] = 1000/(t-100)";
+    const size_t frames = 257;
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT, Program::EE_LANES };
+    bool passed = true;
+    for(Program::ExecutionEngine engine : engines)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program* program = Program::Compile(source, 1024, err, errPos);
+        assert(err == Program::CE_NONE);
+        program->SetExecutionEngine(engine);
+        
+        Program::Value buffer[frames*2] = { 0 };
+        Program::TickState tickState(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+        Program::RuntimeError firstError = Program::RE_NONE;
+        const Program::RuntimeError lastError = program->RunBlock(buffer, buffer, 2, frames, tickState, &firstError);
+        passed = passed && lastError == Program::RE_NONE && firstError == Program::RE_DIVIDE_BY_ZERO;
+        delete program;
+    }
+    
+    std::cout << "RunBlock first error " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// Run happens on the audio thread, so it must never allocate, including for array assignment
+static void testRunDoesNotAllocate()
+{
+    const char * sources[] = {
+        "a = @1 = { 1, 2, 3 }; [*] = { a, @2, @3 }",
+        "@t = { t, t>>1, t>>2, t>>3 }; [0] = { @t, @(t+1) }; [1] = [0]",
+        "a = [0] = { t, m }; b = [1] = t*a; [*] = { a + b }",
+        "w = 1 << (t%17); [*] = $t + #t + Tt",
+    };
+    
+    for(const char * source : sources)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program* program = Program::Compile(source, 1024, err, errPos);
+        assert(err == Program::CE_NONE);
+        program->Set('w', w);
+        
+        Program::Value results[2] = { 0, 0 };
+        const size_t before = allocationCount;
+        for(int i = 0; i < testIterations; ++i)
+        {
+            program->Set('t', i);
+            program->Run(results, 2);
+        }
+        const size_t allocations = allocationCount - before;
+        
+        std::cout << '"' << source << '"' << (allocations == 0 ? " PASSED" : " FAILED") << " with " << allocations << " allocations during Run" << std::endl;
+        assert(allocations == 0);
+        delete program;
+    }
+}
+
+// the compiler works in an arena that it keeps between compiles, so compiling again only allocates what the Program keeps,
+// which doesn't depend on how long the program is
+static void testCompileAllocations()
+{
+    std::string source = "[0] = t";
+    for(int i = 0; i < 500; ++i)
+    {
+        source += " + (t*" + std::to_string(i) + " >> (a = t>>" + std::to_string(i % 13) + ") & 3 ? -a : a/3)";
+    }
+    
+    Program::CompileError err;
+    int errPos;
+    size_t allocations[2];
+    for(size_t& count : allocations)
+    {
+        Program::ClearCompileCache();
+        const size_t before = allocationCount;
+        Program* program = Program::Compile(source.c_str(), 1024, err, errPos);
+        count = allocationCount - before;
+        assert(err == Program::CE_NONE);
+        delete program;
+    }
+    
+    const bool passed = allocations[1] <= 16;
+    std::cout << "Compiling " << source.size() << " characters " << (passed ? "PASSED" : "FAILED") << " with " << allocations[0] << " allocations the first time and " << allocations[1] << " the second" << std::endl;
+    assert(passed);
+}
+
+// the parser keeps its own stack, so how deeply a program nests is only limited by memory
+static void testDeepNesting()
+{
+    const size_t depth = 200000;
+    std::string parens = "[0] = ";
+    std::string ternaries = "[0] = ";
+    for(size_t i = 0; i < depth; ++i)
+    {
+        parens += "-(t+";
+        ternaries += "t > " + std::to_string(i) + " ? ";
+    }
+    parens += "1" + std::string(depth, ')');
+    ternaries += "1 : 0";
+    
+    Program::CompileError err;
+    int errPos;
+    Program* program = Program::Compile(parens.c_str(), 0, err, errPos, Program::OPT_NONE);
+    assert(err == Program::CE_NONE);
+    // t is 0 and there's an even number of negations
+    Program::Value result = 0;
+    program->Run(&result, 1);
+    assert(result == 1);
+    delete program;
+    
+    program = Program::Compile(ternaries.c_str(), 0, err, errPos, Program::OPT_NONE);
+    assert(err == Program::CE_NONE);
+    delete program;
+    
+    // one paren short
+    parens.pop_back();
+    program = Program::Compile(parens.c_str(), 0, err, errPos, Program::OPT_NONE);
+    assert(err == Program::CE_MISSING_PAREN && program == nullptr);
+    
+    std::cout << "Nesting " << depth << " deep PASSED" << std::endl;
+}
+
+// division by constants, variables, and V controls is done with reciprocals, which must match the hardware divide exactly
+static void testDivisors()
+{
+    const Program::Value divisors[] = { 1, 2, 3, 5, 6, 7, 10, 12, 25, 641, 1000, 1024, 44100, 65535, 65537,
+        (Program::Value)1 << 31, ((Program::Value)1 << 32) + 1, 0x5555555555555555ULL, ((Program::Value)1 << 63) + 1, ~(Program::Value)0 };
+    const Program::Value numerators[] = { 0, 1, 2, 3, 1000, 44099, 1234567, 0xFFFFFFFFULL, 0x123456789ABCDEFULL, (Program::Value)1 << 63, ~(Program::Value)0 - 1, ~(Program::Value)0 };
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT };
+    
+    bool passed = true;
+    for(Program::Value d : divisors)
+    {
+        char source[128];
+        snprintf(source, sizeof(source), "[0] = t/w + t%%V1 + t/%llu; [1] = t%%w + t/V1 + t%%%llu", (unsigned long long)d, (unsigned long long)d);
+        Program::CompileError err;
+        int errPos;
+        Program* program = Program::Compile(source, 0, err, errPos);
+        assert(err == Program::CE_NONE);
+        for(Program::ExecutionEngine engine : engines)
+        {
+            if ( !program->SetExecutionEngine(engine) ) continue;
+            for(Program::Value n : numerators)
+            {
+                // every divisor is tried as a variable and a V control too, changing them between runs
+                const Program::Value v = d + 2;
+                program->Set('t', n);
+                program->Set('w', d);
+                program->SetVC(1, v);
+                Program::Value result[2];
+                program->Run(result, 2);
+                passed = passed && result[0] == n/d + n%v + n/d && result[1] == n%d + n/v + n%d;
+            }
+        }
+        delete program;
+    }
+    
+    // a divisor that changes to zero has to fail the same way division by zero does
+    Program::CompileError err;
+    int errPos;
+    Program* program = Program::Compile("[0] = t/w", 0, err, errPos);
+    Program::Value result[2];
+    program->Set('w', 3);
+    passed = passed && program->Run(result, 2) == Program::RE_NONE;
+    program->Set('w', 0);
+    passed = passed && program->Run(result, 2) == Program::RE_DIVIDE_BY_ZERO;
+    delete program;
+    
+    std::cout << "Division by reciprocals " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// expressions that can't change during a block are computed before it, so changing a control between blocks
+// has to give the same results as computing them for every frame
+static void testHoisting()
+{
+    const char * source = "[0] = t*(C1*C2 + (V0<<4)) + (w>>3)*$(t) + (t>>(n&7)); [1] = t & (n*3+1) ^ C1*C2";
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT, Program::EE_LANES };
+    const size_t frames = 64;
+    const int blocks = 16;
+    
+    bool passed = true;
+    for(Program::ExecutionEngine engine : engines)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program* hoisted = Program::Compile(source, 1024, err, errPos);
+        Program* unhoisted = Program::Compile(source, 1024, err, errPos, Program::OPT_ALL & ~Program::OPT_HOIST_INVARIANTS);
+        assert(err == Program::CE_NONE);
+        passed = passed && hoisted->GetInstructionCount() < unhoisted->GetInstructionCount();
+        if ( !hoisted->SetExecutionEngine(engine) ) continue;
+        
+        Program::TickState tickStates[2] = { Program::TickState(0, 44100/1000.0, 44100/(120/60.0)/128.0), Program::TickState(0, 44100/1000.0, 44100/(120/60.0)/128.0) };
+        Program* programs[2] = { hoisted, unhoisted };
+        for(int b = 0; b < blocks; ++b)
+        {
+            Program::Value buffers[2][frames*2] = {};
+            for(int i = 0; i < 2; ++i)
+            {
+                programs[i]->Set('w', 256 << (b % 4));
+                programs[i]->Set('n', 60 + b);
+                programs[i]->SetCC(1, b*7);
+                programs[i]->SetCC(2, 127 - b);
+                programs[i]->SetVC(0, b*3);
+                programs[i]->RunBlock(buffers[i], buffers[i], 2, frames, tickStates[i]);
+            }
+            passed = passed && memcmp(buffers[0], buffers[1], sizeof(buffers[0])) == 0;
+        }
+        
+        delete hoisted;
+        delete unhoisted;
+    }
+    
+    std::cout << "Hoisting block invariant expressions " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// EE_LANES has to match running every frame on its own, including when the frames take different branches,
+// fail part of the way through, or the block isn't a whole number of lanes
+static void testLanes()
+{
+    struct Case
+    {
+        const char * source;
+        bool lanes;
+    };
+    const Case cases[] =
+    {
+        { "[0] = t*(t>>8|t>>9)&46&t>>8; [1] = t/(w-t%5000) + @(t%3+1)", true },
+        { "[*] = (t>>6)%3 ? t*Fn : (t/(t%7)) + [2]", true },
+        { "[0] = t > 100 ? $(t) : #(t*2); [1] = C1 + V0*T(t)", true },
+        { "[t%3] = t; [1] = [0] + 1", true },
+        { "a = t*3; [*] = a + b", false },
+        { "[*] = t*R(4)", true },
+    };
+    const size_t frames = 1000 + 3;
+    
+    bool passed = true;
+    for(const Case& test : cases)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program* lanes = Program::Compile(test.source, 1024, err, errPos);
+        Program* single = Program::Compile(test.source, 1024, err, errPos, Program::OPT_ALL);
+        assert(err == Program::CE_NONE);
+        passed = passed && lanes->GetCompiledProgram().lanes == test.lanes;
+        lanes->SetExecutionEngine(Program::EE_LANES);
+        single->SetExecutionEngine(Program::EE_SWITCH);
+        
+        Program::Value buffers[2][frames*2];
+        Program::RuntimeError errors[2];
+        Program* programs[2] = { lanes, single };
+        for(int i = 0; i < 2; ++i)
+        {
+            programs[i]->Set('w', 4000);
+            programs[i]->Set('n', 60);
+            programs[i]->SetCC(1, 7);
+            programs[i]->SetVC(0, 3);
+            programs[i]->Poke(2, 99);
+            for(size_t f = 0; f < frames*2; ++f)
+            {
+                buffers[i][f] = f*3;
+            }
+            Program::TickState tickState(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+            errors[i] = programs[i]->RunBlock(buffers[i], buffers[i], 2, frames, tickState);
+        }
+        const bool random = strchr(test.source, 'R') != nullptr;
+        passed = passed && (random || memcmp(buffers[0], buffers[1], sizeof(buffers[0])) == 0) && errors[0] == errors[1];
+        passed = passed && lanes->Get('t') == single->Get('t') && lanes->Get('m') == single->Get('m');
+        
+        delete lanes;
+        delete single;
+    }
+    
+    std::cout << "Lanes " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// ternaries that are computed with SEL have to give the same results as jumping,
+// and the ones that could fail or change something in the branch that isn't taken have to keep jumping
+static void testSelect()
+{
+    struct Case
+    {
+        const char * source;
+        bool branches;
+    };
+    const Case cases[] =
+    {
+        { "[0] = t&256 ? t*3 : t>>2; [1] = (t&7)==3 ? 5", false },
+        { "[*] = t%5 ? (t%3 ? t : -t) : (t&64 ? $(t) : t/7)", false },
+        { "[*] = t%5 ? 1 : (t%3 ? 2 : 3)", false },
+        { "[*] = t%5 ? (t%3 ? 2 : 3) : 1", false },
+        { "[*] = t%5 ? t/(t%3) : 0", true },
+        { "[*] = t%5 ? (a = t) : a", true },
+        { "[*] = t%5 ? t*t*t*t*t*t*t*t*t : 0", true },
+        { "a = t; [*] = t%5 ? a*3 : a>>2", true },
+    };
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT, Program::EE_LANES };
+    const size_t frames = 257;
+    
+    bool passed = true;
+    for(const Case& test : cases)
+    {
+        for(Program::ExecutionEngine engine : engines)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* selected = Program::Compile(test.source, 1024, err, errPos);
+            Program* branched = Program::Compile(test.source, 1024, err, errPos, Program::OPT_ALL & ~Program::OPT_SELECT);
+            assert(err == Program::CE_NONE);
+            bool branches = false;
+            for(const Program::Instruction& instruction : selected->GetCompiledProgram().code)
+            {
+                branches = branches || instruction.code == Program::Op::CND;
+            }
+            passed = passed && branches == test.branches;
+            if ( !selected->SetExecutionEngine(engine) ) continue;
+            
+            Program::Value buffers[2][frames*2] = {};
+            Program::RuntimeError errors[2];
+            Program* programs[2] = { selected, branched };
+            for(int i = 0; i < 2; ++i)
+            {
+                Program::TickState tickState(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+                errors[i] = programs[i]->RunBlock(buffers[i], buffers[i], 2, frames, tickState);
+            }
+            passed = passed && memcmp(buffers[0], buffers[1], sizeof(buffers[0])) == 0 && errors[0] == errors[1];
+            
+            delete selected;
+            delete branched;
+        }
+    }
+    
+    std::cout << "Select " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// the state report has to find every variable a frame can see from an earlier frame,
+// and a stateless program has to give the same results when its frames are split between Programs
+static void testStateReport()
+{
+    struct Case
+    {
+        const char * source;
+        bool stateless;
+        Program::Char var;
+        Program::VariableState state;
+        Program::VariableState userMemory;
+    };
+    const Case cases[] =
+    {
+        { "t = t/5; [*] = t&t>>8", true, 't', Program::VS_LOCAL, Program::VS_UNUSED },
+        { "a = t*3; [*] = a + b", true, 'a', Program::VS_LOCAL, Program::VS_UNUSED },
+        { "a = t*3; [*] = a + b", true, 'b', Program::VS_INPUT, Program::VS_UNUSED },
+        { "a = t > 5 ? 1 : 2; [*] = a", true, 'a', Program::VS_LOCAL, Program::VS_UNUSED },
+        { "a = a + 1; [*] = a", false, 'a', Program::VS_CARRIED, Program::VS_UNUSED },
+        { "n = n + 1; [*] = t*n", false, 'n', Program::VS_CARRIED, Program::VS_UNUSED },
+        { "[*] = t > 5 ? (a = t) : a", false, 'a', Program::VS_CARRIED, Program::VS_UNUSED },
+        { "[*] = $(t); w = 256", false, 'w', Program::VS_CARRIED, Program::VS_UNUSED },
+        { "w = 256; [*] = $(t)", true, 'w', Program::VS_LOCAL, Program::VS_UNUSED },
+        { "[*] = @(t%4); @3 = t", false, 'a', Program::VS_INPUT, Program::VS_CARRIED },
+        { "@3 = t; [*] = @(t%4)", true, 'a', Program::VS_INPUT, Program::VS_LOCAL },
+        { "@3 = t; [*] = @3", true, 'a', Program::VS_UNUSED, Program::VS_LOCAL },
+        { "@1 = { t, t*2 }; [*] = @1 + @2", true, 'a', Program::VS_UNUSED, Program::VS_LOCAL },
+        { "[*] = @(t%4)", true, 'a', Program::VS_INPUT, Program::VS_INPUT },
+        { "@t = t; [*] = @(t-1)", false, 'a', Program::VS_CARRIED, Program::VS_CARRIED },
+        { "[*] = t*R(4)", false, 't', Program::VS_INPUT, Program::VS_UNUSED },
+    };
+    const uint32_t options[] = { Program::OPT_NONE, Program::OPT_ALL };
+    const size_t frames = 300;
+    const size_t split = 123;
+    
+    bool passed = true;
+    for(const Case& test : cases)
+    {
+        for(uint32_t option : options)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* whole = Program::Compile(test.source, 16, err, errPos, option);
+            assert(err == Program::CE_NONE);
+            const Program::StateReport& report = whole->GetStateReport();
+            passed = passed && whole->IsStateless() == test.stateless && report.variables[(unsigned char)test.var] == test.state && report.userMemory == test.userMemory;
+            passed = passed && report.usesRandom == (strchr(test.source, 'R') != nullptr);
+            if ( !test.stateless ) { delete whole; continue; }
+            
+            // the second Program starts where the first one stops, without running the frames before
+            Program* first = Program::Compile(test.source, 16, err, errPos, option);
+            Program* second = Program::Compile(test.source, 16, err, errPos, option);
+            Program::Value expected[frames*2] = {};
+            Program::Value actual[frames*2] = {};
+            Program::TickState wholeTicks(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+            whole->RunBlock(expected, expected, 2, frames, wholeTicks);
+            Program::TickState firstTicks(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+            first->RunBlock(actual, actual, 2, split, firstTicks);
+            Program::TickState secondTicks(split, 44100/1000.0, 44100/(120/60.0)/128.0);
+            second->RunBlock(actual + split*2, actual + split*2, 2, frames - split, secondTicks);
+            passed = passed && memcmp(expected, actual, sizeof(expected)) == 0;
+            
+            delete whole;
+            delete first;
+            delete second;
+        }
+    }
+    
+    std::cout << "State report " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// everything the compiler generates should pass the verifier and run without checking the stack,
+// but code that doesn't pass still has to report the errors those checks are for
+static void testVerifier()
+{
+    bool passed = true;
+    for(int i = 0; i < Presets::Count(); ++i)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program* program = Program::Compile(Presets::Get(i).program, 1024, err, errPos);
+        assert(err == Program::CE_NONE);
+        passed = passed && program->GetCompiledProgram().verified;
+        delete program;
+    }
+    
+    typedef Program::Instruction I;
+    struct Case { std::vector<I> code; Program::RuntimeError error; };
+    const Case cases[] = {
+        { { I(Program::Op::PSH, false, 1), I(Program::Op::ADD, false, 0) }, Program::RE_MISSING_OPERAND },
+        { { I(Program::Op::PSH, false, 1), I(Program::Op::PSH, false, 2), I(Program::Op::POP, false, 0) }, Program::RE_INCONSISTENT_STACK },
+        { { I(Program::Op::PSH, false, 1), I(Program::Op::PSH, false, 2) }, Program::RE_INCONSISTENT_STACK },
+    };
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT };
+    for(const Case& test : cases)
+    {
+        std::vector<I> code = test.code;
+        auto compiled = std::make_shared<Program::CompiledProgram>(std::move(code), std::vector<Program::Instruction>(), std::vector<Program::Value>(), std::vector<Program::Divisor>(), 0, 2, false, false, Program::StateReport(), 0, 0);
+        for(Program::ExecutionEngine engine : engines)
+        {
+            Program program(compiled);
+            program.SetExecutionEngine(engine);
+            Program::Value result = 0;
+            passed = passed && program.Run(&result, 1) == test.error;
+        }
+    }
+    
+    std::cout << "Verifier " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// F keeps a table of notes for the current sample rate, which has to match the formula exactly and follow changes to '~'
+// with RM_COUNTER, R has to give the same numbers for the same seed and 't' in every engine,
+// no matter what frames ran before, and different Rs in a frame have to give different numbers
+static void testRandom()
+{
+    const char * sources[] =
+    {
+        "[0] = R(1<<20); [1] = R(1<<20)",
+        "[*] = t%3 ? R(t+1) : t*R4",
+        "a = R9; [*] = a + R0",
+    };
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT, Program::EE_LANES };
+    const uint32_t options[] = { Program::OPT_NONE, Program::OPT_ALL };
+    const size_t frames = 301;
+    const size_t split = 123;
+    
+    bool passed = true;
+    for(const char * source : sources)
+    {
+        Program::CompileError err;
+        int errPos;
+        Program::Value expected[frames*2] = {};
+        Program* reference = Program::Compile(source, 16, err, errPos, Program::OPT_NONE);
+        assert(err == Program::CE_NONE);
+        passed = passed && !reference->IsStateless();
+        reference->SetRandomMode(Program::RM_COUNTER, 1234);
+        passed = passed && reference->IsStateless();
+        Program::TickState referenceTicks(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+        reference->RunBlock(expected, expected, 2, frames, referenceTicks);
+        delete reference;
+        
+        for(uint32_t option : options)
+        {
+            for(Program::ExecutionEngine engine : engines)
+            {
+                // the second Program starts where the first one stops, without running the frames before
+                Program* first = Program::Compile(source, 16, err, errPos, option);
+                Program* second = Program::Compile(source, 16, err, errPos, option);
+                Program::Value actual[frames*2] = {};
+                first->SetExecutionEngine(engine);
+                second->SetExecutionEngine(engine);
+                first->SetRandomMode(Program::RM_COUNTER, 1234);
+                second->SetRandomMode(Program::RM_COUNTER, 1234);
+                Program::TickState firstTicks(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+                first->RunBlock(actual, actual, 2, split, firstTicks);
+                Program::TickState secondTicks(split, 44100/1000.0, 44100/(120/60.0)/128.0);
+                second->RunBlock(actual + split*2, actual + split*2, 2, frames - split, secondTicks);
+                passed = passed && memcmp(expected, actual, sizeof(expected)) == 0;
+                delete first;
+                delete second;
+            }
+        }
+    }
+    
+    // a different seed gives different numbers, and the two Rs in a frame don't match
+    Program::CompileError err;
+    int errPos;
+    Program* program = Program::Compile(sources[0], 16, err, errPos);
+    Program::Value results[2][2] = {};
+    for(int i = 0; i < 2; ++i)
+    {
+        program->SetRandomMode(Program::RM_COUNTER, 1234 + i);
+        program->Set('t', 77);
+        program->Run(results[i], 2);
+    }
+    passed = passed && results[0][0] != results[0][1] && results[0][0] != results[1][0] && results[0][1] != results[1][1];
+    passed = passed && program->GetRandomMode() == Program::RM_COUNTER && program->GetRandomSeed() == 1235;
+    delete program;
+    
+    std::cout << "Counter random " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+static void testFrequencyTable()
+{
+    Program::CompileError err;
+    int errPos;
+    Program* program = Program::Compile("[0] = Ft", 0, err, errPos);
+    assert(err == Program::CE_NONE);
+    
+    bool passed = true;
+    const Program::Value rates[] = { 44100, 48000, 96000, 44100, 22050 };
+    for(Program::Value rate : rates)
+    {
+        program->Set('~', rate);
+        for(Program::Value note = 0; note < 600; ++note)
+        {
+            program->Set('t', note);
+            Program::Value result[2];
+            program->Run(result, 2);
+            const Program::Value expected = note == 0 ? 0 : (Program::Value)round(4.0 * 3.023625 * pow(2.0, (double)note / 12.0) * (44100.0 / rate));
+            passed = passed && result[0] == expected && (rate != 44100 || note == 0 || result[0] == F(note));
+        }
+    }
+    delete program;
+    
+    std::cout << "Frequency table " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// programs compiled from the same source share their code but not their state
+static void testSharedCompiledProgram()
+{
+    Program::CompileError err;
+    int errPos;
+    const char* source = "[0] = t/V0 + a; a = a + 1";
+    Program* first = Program::Compile(source, 16, err, errPos);
+    assert(err == Program::CE_NONE);
+    Program* second = Program::Compile(source, 16, err, errPos);
+    assert(err == Program::CE_NONE);
+    Program* otherMemory = Program::Compile(source, 32, err, errPos);
+    assert(err == Program::CE_NONE);
+    
+    bool passed = &first->GetCompiledProgram() == &second->GetCompiledProgram();
+    passed = passed && &first->GetCompiledProgram() != &otherMemory->GetCompiledProgram();
+    
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT };
+    for(Program::ExecutionEngine engine : engines)
+    {
+        first->SetExecutionEngine(engine);
+        second->SetExecutionEngine(engine);
+        first->Set('a', 0);
+        second->Set('a', 100);
+        first->SetVC(0, 3);
+        second->SetVC(0, 7);
+        for(Program::Value tick = 0; tick < 64; ++tick)
+        {
+            Program::Value a[2] = { 0, 0 };
+            Program::Value b[2] = { 0, 0 };
+            first->Set('t', tick);
+            second->Set('t', tick);
+            first->Run(a, 2);
+            second->Run(b, 2);
+            passed = passed && a[0] == tick/3 + tick && b[0] == tick/7 + 100 + tick;
+        }
+    }
+    delete first;
+    delete second;
+    delete otherMemory;
+    
+    std::cout << "Shared compiled program " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+static void testCompileCache()
+{
+    Program::CompileError err;
+    int errPos;
+    Program::ClearCompileCache();
+    
+    Program* program = Program::Compile("[0] = t*2", 0, err, errPos);
+    const Program::CompiledProgram* compiled = &program->GetCompiledProgram();
+    delete program;
+    // nothing is running it, but it should still be cached
+    program = Program::Compile("[0] = t*2", 0, err, errPos);
+    bool passed = &program->GetCompiledProgram() == compiled;
+    delete program;
+    // a different memory size is a different program
+    program = Program::Compile("[0] = t*2", 16, err, errPos);
+    passed = passed && &program->GetCompiledProgram() != compiled;
+    delete program;
+    // errors are never cached
+    program = Program::Compile("[0] = (t", 0, err, errPos);
+    passed = passed && program == nullptr && err == Program::CE_MISSING_PAREN;
+    program = Program::Compile("[0] = (t", 0, err, errPos);
+    passed = passed && program == nullptr && err == Program::CE_MISSING_PAREN;
+    
+    Program::CompileCacheStats stats = Program::GetCompileCacheStats();
+    passed = passed && stats.hits == 1 && stats.misses == 4 && stats.size == 2;
+    
+    // only programs that nothing is running get evicted
+    Program* running = Program::Compile("[0] = t", 0, err, errPos);
+    for(int i = 0; i < 100; ++i)
+    {
+        const std::string source = "[0] = t*" + std::to_string(i + 3);
+        delete Program::Compile(source.c_str(), 0, err, errPos);
+    }
+    stats = Program::GetCompileCacheStats();
+    // 64 unused, the running one, and the last one compiled, which was still running when it was added
+    passed = passed && stats.size == 66;
+    program = Program::Compile("[0] = t", 0, err, errPos);
+    passed = passed && &program->GetCompiledProgram() == &running->GetCompiledProgram();
+    delete program;
+    delete running;
+    
+    std::cout << "Compile cache " << (passed ? "PASSED" : "FAILED") << std::endl;
+    assert(passed);
+}
+
+// render a block of frames with the given program, returns the time it took in seconds
+static double renderPreset(Program& program, const Presets::Data& preset, Program::Value* buffer, const size_t frames)
+{
+    program.Set('w', (Program::Value)1 << preset.bitDepth);
+    program.Set('n', 60);
+    program.Set('v', 127);
+    const int* vc = &preset.V0;
+    for(int i = 0; i < 8; ++i)
+    {
+        program.SetVC(i, vc[i]);
+    }
+    for(size_t i = 0; i < frames*2; ++i)
+    {
+        buffer[i] = 1 << (preset.bitDepth - 1);
+    }
+    
+    Program::TickState tickState(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+    Timer timer;
+    program.RunBlock(buffer, buffer, 2, frames, tickState);
+    return timer.elapsed();
+}
+
+// compare the execution engines on all of the presets, checking that they produce the same output
+static void benchmarkEngines()
+{
+    const size_t frames = 44100;
+    const Program::ExecutionEngine engines[] = { Program::EE_SWITCH, Program::EE_THREADED, Program::EE_JIT, Program::EE_LANES };
+    const char * names[] = { "switch", "threaded", "jit", "lanes" };
+    const int engineCount = sizeof(engines) / sizeof(engines[0]);
+    std::vector<Program::Value> expected(frames*2);
+    std::vector<Program::Value> actual(frames*2);
+    double totals[engineCount] = { 0 };
+    
+    std::cout << "\nExecution engines, " << frames << " frames per preset:\n";
+    for(int i = 0; i < Presets::Count(); ++i)
+    {
+        const Presets::Data& preset = Presets::Get(i);
+        // the random operator is seeded from the clock, so we can't expect those to match
+        const bool random = strchr(preset.program, 'R') != nullptr;
+        std::cout << std::setw(32) << std::left << preset.name << std::right;
+        
+        double times[engineCount] = { 0 };
+        for(int e = 0; e < engineCount; ++e)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* program = Program::Compile(preset.program, 1024*64, err, errPos);
+            assert(err == Program::CE_NONE);
+            if ( !program->SetExecutionEngine(engines[e]) )
+            {
+                std::cout << ' ' << names[e] << " unavailable";
+                delete program;
+                continue;
+            }
+            
+            times[e] = renderPreset(*program, preset, e == 0 ? expected.data() : actual.data(), frames);
+            totals[e] += times[e];
+            std::cout << ' ' << names[e] << ' ' << std::setw(8) << (times[e]*1000) << " ms";
+            if ( e > 0 )
+            {
+                std::cout << " (" << std::setprecision(3) << (times[0] / times[e]) << std::setprecision(6) << "x)";
+                const bool matches = random || expected == actual;
+                if ( !matches )
+                {
+                    std::cout << " FAILED! outputs differ from " << names[0];
+                }
+                assert(matches);
+            }
+            delete program;
+        }
+        std::cout << std::endl;
+    }
+    
+    for(int e = 1; e < engineCount; ++e)
+    {
+        if ( totals[e] > 0 )
+        {
+            std::cout << "Total speedup of " << names[e] << " over " << names[0] << ' ' << (totals[0] / totals[e]) << "x" << std::endl;
+        }
+    }
+}
+
+// compare the presets compiled with and without fused instructions.
+// every instruction is one dispatch in the interpreters, so the instruction count is the number of dispatches per frame
+// (less whatever is skipped by ?: and ? in the presets that use them).
+static void benchmarkFusion()
+{
+    const size_t frames = 44100;
+    const uint32_t options[] = { Program::OPT_ALL & ~Program::OPT_FUSE_INSTRUCTIONS, Program::OPT_ALL };
+    std::vector<Program::Value> unfused(frames*2);
+    std::vector<Program::Value> fused(frames*2);
+    uint64_t totalCounts[2] = { 0 };
+    double totalTimes[2] = { 0 };
+    
+    std::cout << "\nFused instructions, threaded engine, " << frames << " frames per preset:\n";
+    for(int i = 0; i < Presets::Count(); ++i)
+    {
+        const Presets::Data& preset = Presets::Get(i);
+        const bool random = strchr(preset.program, 'R') != nullptr;
+        uint64_t counts[2];
+        double times[2];
+        for(int o = 0; o < 2; ++o)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* program = Program::Compile(preset.program, 1024*64, err, errPos, options[o]);
+            assert(err == Program::CE_NONE);
+            counts[o] = program->GetInstructionCount();
+            times[o] = renderPreset(*program, preset, o == 0 ? unfused.data() : fused.data(), frames);
+            totalCounts[o] += counts[o];
+            totalTimes[o] += times[o];
+            delete program;
+        }
+        assert(random || unfused == fused);
+        
+        std::cout << std::setw(32) << std::left << preset.name << std::right
+                  << ' ' << std::setw(4) << counts[0] << " -> " << std::setw(4) << counts[1] << " dispatches"
+                  << " (" << std::setprecision(3) << (100.0 - 100.0*counts[1]/counts[0]) << "% fewer)"
+                  << ' ' << (times[0] / times[1]) << std::setprecision(6) << "x" << std::endl;
+    }
+    std::cout << "Total dispatches " << totalCounts[0] << " -> " << totalCounts[1]
+              << " (" << std::setprecision(3) << (100.0 - 100.0*totalCounts[1]/totalCounts[0]) << "% fewer), "
+              << (totalTimes[0] / totalTimes[1]) << std::setprecision(6) << "x faster" << std::endl;
+}
+
+// compare the instructions run for every frame with and without computing block invariant expressions once per block
+static void benchmarkHoisting()
+{
+    const size_t frames = 44100;
+    const uint32_t options[] = { Program::OPT_ALL & ~Program::OPT_HOIST_INVARIANTS, Program::OPT_ALL };
+    std::vector<Program::Value> unhoisted(frames*2);
+    std::vector<Program::Value> hoisted(frames*2);
+    uint64_t totalCounts[2] = { 0 };
+    double totalTimes[2] = { 0 };
+    
+    std::cout << "\nHoisted invariants, threaded engine, " << frames << " frames per preset:\n";
+    for(int i = 0; i < Presets::Count(); ++i)
+    {
+        const Presets::Data& preset = Presets::Get(i);
+        const bool random = strchr(preset.program, 'R') != nullptr;
+        uint64_t counts[2];
+        double times[2];
+        for(int o = 0; o < 2; ++o)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* program = Program::Compile(preset.program, 1024*64, err, errPos, options[o]);
+            assert(err == Program::CE_NONE);
+            counts[o] = program->GetInstructionCount();
+            times[o] = renderPreset(*program, preset, o == 0 ? unhoisted.data() : hoisted.data(), frames);
+            totalCounts[o] += counts[o];
+            totalTimes[o] += times[o];
+            delete program;
+        }
+        assert(random || unhoisted == hoisted);
+        
+        std::cout << std::setw(32) << std::left << preset.name << std::right
+                  << ' ' << std::setw(4) << counts[0] << " -> " << std::setw(4) << counts[1] << " dispatches per frame"
+                  << " (" << std::setprecision(3) << (100.0 - 100.0*counts[1]/counts[0]) << "% fewer)"
+                  << ' ' << (times[0] / times[1]) << std::setprecision(6) << "x" << std::endl;
+    }
+    std::cout << "Total dispatches per frame " << totalCounts[0] << " -> " << totalCounts[1]
+              << " (" << std::setprecision(3) << (100.0 - 100.0*totalCounts[1]/totalCounts[0]) << "% fewer), "
+              << (totalTimes[0] / totalTimes[1]) << std::setprecision(6) << "x faster" << std::endl;
+}
+
+// OPT_SELECT is only used for code that can run in lanes, which none of the presets with a ternary can,
+// so this times ternaries that do, with conditions that change from frame to frame and ones that change every 16 frames
+static void benchmarkSelect()
+{
+    const char * sources[] =
+    {
+        "[*] = t%3 ? t*5 : t>>2",
+        "[*] = (t&1 ? t*3 : t*5) + (t%5 > 2 ? t>>3 : t<<1)",
+        "[0] = t*(t%7 > 3 ? 3 : 5) & t>>6; [1] = t*(t%11 > 5 ? 4 : 6) & t>>7",
+        "[*] = (t>>4)%3 ? t*3 : t>>2",
+    };
+    const size_t frames = 44100;
+    const uint32_t options[] = { Program::OPT_ALL & ~Program::OPT_SELECT, Program::OPT_ALL };
+    std::vector<Program::Value> buffers[2] = { std::vector<Program::Value>(frames*2), std::vector<Program::Value>(frames*2) };
+    
+    std::cout << "\nSelect, lanes engine, " << frames << " frames per program:\n";
+    for(const char * source : sources)
+    {
+        double times[2];
+        for(int o = 0; o < 2; ++o)
+        {
+            Program::CompileError err;
+            int errPos;
+            Program* program = Program::Compile(source, 1024, err, errPos, options[o]);
+            assert(err == Program::CE_NONE && program->GetCompiledProgram().lanes);
+            program->SetExecutionEngine(Program::EE_LANES);
+            program->Set('w', 1 << 15);
+            // the best of a few runs
+            times[o] = 1e9;
+            for(int run = 0; run < 3; ++run)
+            {
+                std::fill(buffers[o].begin(), buffers[o].end(), 0);
+                Program::TickState tickState(0, 44100/1000.0, 44100/(120/60.0)/128.0);
+                Timer timer;
+                program->RunBlock(buffers[o].data(), buffers[o].data(), 2, frames, tickState);
+                times[o] = std::min(times[o], timer.elapsed());
+            }
+            delete program;
+        }
+        assert(buffers[0] == buffers[1]);
+        
+        std::cout << std::setw(70) << std::left << source << std::right
+                  << ' ' << std::setprecision(3) << (times[0] / times[1]) << std::setprecision(6) << "x" << std::endl;
+    }
+}
+
+// compare how much memory the code of each preset takes as Instructions and their constants
+// to what it took when every instruction was a 16 byte Op
+static void benchmarkCodeSize()
+{
+    size_t totalSizes[2] = { 0 };
+    
+    std::cout << "\nCode size, Op -> Instruction + constants:\n";
+    for(int i = 0; i < Presets::Count(); ++i)
+    {
+        const Presets::Data& preset = Presets::Get(i);
+        Program::CompileError err;
+        int errPos;
+        Program* program = Program::Compile(preset.program, 1024*64, err, errPos);
+        assert(err == Program::CE_NONE);
+        const Program::CompiledProgram& compiled = program->GetCompiledProgram();
+        const size_t sizes[2] = {
+            compiled.code.size() * sizeof(Program::Op),
+            compiled.code.size() * sizeof(Program::Instruction) + compiled.constants.size() * sizeof(Program::Value)
+        };
+        totalSizes[0] += sizes[0];
+        totalSizes[1] += sizes[1];
+        std::cout << std::setw(32) << std::left << preset.name << std::right
+                  << ' ' << std::setw(5) << sizes[0] << " -> " << std::setw(5) << sizes[1] << " bytes"
+                  << " (" << compiled.constants.size() << " constants, " << std::setprecision(3) << (100.0 - 100.0*sizes[1]/sizes[0]) << std::setprecision(6) << "% smaller)" << std::endl;
+        delete program;
+    }
+    std::cout << "Total " << totalSizes[0] << " -> " << totalSizes[1] << " bytes"
+              << " (" << std::setprecision(3) << (100.0 - 100.0*totalSizes[1]/totalSizes[0]) << std::setprecision(6) << "% smaller)" << std::endl;
+}
+
+// a program of at least size characters made of statements like the ones people write by hand, with comments
+static std::string generateProgram(const size_t size)
+{
+    const char vars[] = "abcdefghijklopqrsuxyz";
+    std::string source;
+    for(size_t i = 0; source.size() < size; ++i)
+    {
+        const std::string k = std::to_string(i % 1000 + 1);
+        const char var = vars[i % (sizeof(vars) - 1)];
+        source += var;
+        source += " = (t*" + k + " >> (m>>" + std::to_string(i % 13) + " & 7)) % (n | " + k + ") + @(t&255) ^ ";
+        source += (i % 3 == 0) ? "$t;" : (i % 3 == 1) ? "(q > " + k + " ? Fn : -v);" : "~C" + std::to_string(i % 128) + ";";
+        source += (i % 8 == 0) ? " // step " + std::to_string(i) + "\n" : "\n";
+    }
+    source += "[*] = a + b";
+    return source;
+}
+
+// one expression nested in parens as deeply as it takes to reach the size
+static std::string generateNestedProgram(const size_t size)
+{
+    std::string source = "[*] = ";
+    size_t depth = 0;
+    for(; source.size() + depth < size; ++depth)
+    {
+        source += (depth % 2 == 0) ? "(t*" : "(m > " + std::to_string(depth) + " ? n : ";
+    }
+    source += "1" + std::string(depth, ')');
+    return source;
+}
+
+// a short program buried in comments
+static std::string generateCommentedProgram(const size_t size)
+{
+    std::string source;
+    for(size_t i = 0; source.size() < size; ++i)
+    {
+        source += "// line " + std::to_string(i) + " of a very long comment about how this works\n";
+    }
+    source += "[*] = t*(t>>8)";
+    return source;
+}
+
+// compile time should grow linearly with the size of the source no matter what shape the program is,
+// so the throughput of each shape should stay about the same as the size grows
+static void benchmarkCompile()
+{
+    const size_t sizes[] = { 16*1024, 64*1024, 256*1024, 1024*1024 };
+    const uint32_t options[] = { Program::OPT_NONE, Program::OPT_ALL };
+    struct Shape { const char * name; std::string (*generate)(size_t); };
+    const Shape shapes[] = {
+        { "statements", generateProgram },
+        { "nested", generateNestedProgram },
+        { "comments", generateCommentedProgram },
+    };
+    
+    std::cout << "\nCompile throughput:\n";
+    for(const Shape& shape : shapes)
+    {
+        for(size_t size : sizes)
+        {
+            const std::string source = shape.generate(size);
+            std::cout << std::setw(12) << shape.name << std::setw(6) << source.size() / 1024 << " KB";
+            for(uint32_t option : options)
+            {
+                // take the best of a few runs, clearing the cache so each one compiles from scratch
+                double best = 0;
+                for(int run = 0; run < 5; ++run)
+                {
+                    Program::ClearCompileCache();
+                    Program::CompileError err;
+                    int errPos;
+                    Timer timer;
+                    Program* program = Program::Compile(source.c_str(), 1024, err, errPos, option);
+                    const double elapsed = timer.elapsed();
+                    assert(err == Program::CE_NONE);
+                    delete program;
+                    best = run == 0 ? elapsed : std::min(best, elapsed);
+                }
+                std::cout << (option == Program::OPT_NONE ? "  unoptimized " : "  optimized ") << std::setw(8) << source.size() / best / (1024*1024) << " MB/s";
+            }
+            std::cout << std::endl;
+        }
+    }
+}
+
+// a timestamp in cpu cycles where we can get one, otherwise in nanoseconds
+static uint64_t cycles()
+{
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+    return __rdtsc();
+#else
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// measure what the SIN, SQR, and TRI ops cost per call compared to calculating the formula every time.
+// the cost of an op is the difference between a program that calls it many times per frame
+// and the same program with NEG in its place, which costs next to nothing.
+static void benchmarkOscillators()
+{
+    const size_t frames = 44100;
+    const int calls = 32;
+    // the formulas as the ops calculated them before they had tables.
+    // w is read through a volatile so that the compiler can't turn the divisions into shifts, which the ops couldn't do either.
+    static volatile Program::Value range;
+    range = w;
+    struct Oscillator { const char * name; char op; Program::Value (*formula)(Program::Value); };
+    const Oscillator oscillators[] = {
+        { "SIN", '$', [](Program::Value a) { Program::Value r = range; Program::Value hr = r/2; r += 1; return Program::Value(sin(2 * M_PI * ((double)(a%r)/r))*hr + hr); } },
+        { "SQR", '#', [](Program::Value a) { const Program::Value r = range; return a%r < r/2 ? 0 : r-1; } },
+        { "TRI", 'T', [](Program::Value a) { a *= 2; const Program::Value r = range; return a*((a / r) % 2) + (r - a - 1)*(1 - (a / r) % 2); } },
+    };
+    std::vector<Program::Value> buffer(frames*2);
+    
+    std::cout << "\nOscillators, cycles per call with w = " << w << ":\n";
+    for(const Oscillator& osc : oscillators)
+    {
+        uint64_t elapsed[2];
+        for(int k = 0; k < 2; ++k)
+        {
+            std::string source = "[*] = 0";
+            for(int c = 0; c < calls; ++c)
+            {
+                source += std::string(" + ") + (k == 0 ? osc.op : '-') + "(t*" + std::to_string(c + 1) + ")";
+            }
+            Program::CompileError err;
+            int errPos;
+            Program* program = Program::Compile(source.c_str(), 0, err, errPos);
+            assert(err == Program::CE_NONE);
+            program->Set('w', w);
+            // the first run fills the sine table, after that we take the best of a few runs
+            elapsed[k] = UINT64_MAX;
+            for(int run = 0; run < 4; ++run)
+            {
+                Program::TickState tickState(0, 44.1, 44.1);
+                const uint64_t begin = cycles();
+                program->RunBlock(buffer.data(), buffer.data(), 2, frames, tickState);
+                elapsed[k] = run == 0 ? elapsed[k] : std::min(elapsed[k], cycles() - begin);
+            }
+            delete program;
+        }
+        
+        Program::Value sum = 0;
+        uint64_t best = UINT64_MAX;
+        for(int run = 0; run < 3; ++run)
+        {
+            const uint64_t begin = cycles();
+            for(Program::Value f = 0; f < frames; ++f)
+            {
+                for(Program::Value c = 1; c <= calls; ++c)
+                {
+                    sum += osc.formula(f*c);
+                }
+            }
+            best = std::min(best, cycles() - begin);
+        }
+        const double formula = double(best) / (frames*calls);
+        const double op = double(elapsed[0] > elapsed[1] ? elapsed[0] - elapsed[1] : 0) / (frames*calls);
+        std::cout << osc.name << " formula " << std::setw(8) << formula << " op " << std::setw(8) << op
+                  << " saved " << std::setw(8) << (formula - op) << (sum == 42 ? " " : "") << std::endl;
+    }
+}
+
+// run the test expressions with the JIT and the interpreter side by side, checking that every result matches
+static void testJit()
+{
+    std::cout << "\nJIT vs interpreter:\n";
+    for(int i = 0; i < testCount; ++i)
+    {
+        Test& test = tests[i];
+        if ( test.error != EEE_NO_ERROR )
+        {
+            continue;
+        }
+        
+        Program::CompileError err;
+        int errPos;
+        Program* interpreted = Program::Compile(test.expr, 1024, err, errPos);
+        Program* jit = Program::Compile(test.expr, 1024, err, errPos);
+        std::cout << '"' << test.expr << '"';
+        if ( !jit->SetExecutionEngine(Program::EE_JIT) )
+        {
+            std::cout << " SKIPPED, the JIT is not available" << std::endl;
+            delete interpreted;
+            delete jit;
+            return;
+        }
+        
+        int mismatches = 0;
+        Program::Value result = 0;
+        for(Program::Value i = 0; i < testIterations; ++i)
+        {
+            Program::Value results[2][2] = { { 0, 0 }, { 0, 0 } };
+            Program* programs[2] = { interpreted, jit };
+            Program::RuntimeError errors[2];
+            for(int p = 0; p < 2; ++p)
+            {
+                programs[p]->Set('w', w);
+                programs[p]->Set('n', n);
+                programs[p]->Set('t', i*1000);
+                programs[p]->Set('m', i*1000 / (44100/1000));
+                programs[p]->Set('p', result);
+                errors[p] = programs[p]->Run(results[p], 2);
+            }
+            mismatches += results[0][0] != results[1][0] || results[0][1] != results[1][1] || errors[0] != errors[1];
+            result = results[0][0];
+        }
+        
+        std::cout << (mismatches == 0 ? " PASSED" : " FAILED!") << std::endl;
+        assert(mismatches == 0);
+        delete interpreted;
+        delete jit;
+    }
+}
+
 int main(int argc, const char * argv[])
 {
     Timer timer;
@@ -159,7 +1348,7 @@ int main(int argc, const char * argv[])
                 if ( err != EEE_NO_ERROR )
                 {
                     std::cout << " FAILED with error: "  << Program::GetErrorString(err) << '\n';
-                    auto off = errPos - (int)str;
+                    auto off = errPos;
                     for(int i = 0; i < off; ++i)
                     {
                         std::cout << ' ';
@@ -168,7 +1357,7 @@ int main(int argc, const char * argv[])
                 }
                 else
                 {
-                    std::cout << " compiled to " << program->GetInstructionCount() << " instructions.";
+                    std::cout << " compiled to " << program->GetInstructionCount() << " instructions (" << program->GetRemovedInstructionCount() << " optimized out).";
                     set(*program, 0, 0);
                     double elapsed = 0;
 					Program::Value result[2];
@@ -207,5 +1396,29 @@ int main(int argc, const char * argv[])
 
 		assert(err == test.error);
     }
+    
+    testRunBlock();
+    testRunBlockFirstError();
+    testRunDoesNotAllocate();
+    testCompileAllocations();
+    testDeepNesting();
+    testJit();
+    testDivisors();
+    testHoisting();
+    testLanes();
+    testSelect();
+    testStateReport();
+    testRandom();
+    testFrequencyTable();
+    testVerifier();
+    testSharedCompiledProgram();
+    testCompileCache();
+    benchmarkEngines();
+    benchmarkFusion();
+    benchmarkHoisting();
+    benchmarkSelect();
+    benchmarkCodeSize();
+    benchmarkOscillators();
+    benchmarkCompile();
     return 0;
 }
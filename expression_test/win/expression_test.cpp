@@ -8,5 +8,6 @@
 #pragma warning(disable:4146)
 
 #include "../../Program.cpp"
+#include "../../Presets.cpp"
 #include "../main.cpp"
 
@@ -0,0 +1,409 @@
+//
+//  main.cpp
+//  render
+//
+//  Renders an Evaluator program to a WAV file without a host.
+//  Programs that don't carry state from one frame to the next (see Program::IsStateless)
+//  are split into chunks that are rendered on every core, which gives the same samples
+//  as rendering them one after the other because each frame only depends on its tick.
+//
+//  build it alongside Program.cpp, eg: g++ -std=c++11 -O2 -pthread main.cpp ../Program.cpp -o evaluator-render
+//
+
+#include <algorithm>
+#include <fstream>
+#include <iterator>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <thread>
+#include <vector>
+#include "../Program.h"
+
+namespace
+{
+	// the same values the plugin uses, see Interface::GetProgramMemorySize and the tempo param
+	const size_t kProgramMemorySize = 1024 * 64;
+	const double kDefaultTempo = 120;
+	const int    kChannels = 2;
+	// how many frames a thread renders at a time.
+	// the output is the same for any chunk size, this only trades scheduling granularity against overhead.
+	const uint64_t kChunkFrames = 1 << 16;
+
+	struct Settings
+	{
+		Settings()
+			: programPath(nullptr), outputPath(nullptr)
+			, sampleRate(44100), bitDepth(15), seconds(10), volume(50), tempo(kDefaultTempo), threads(0)
+			, randomMode(Program::RM_SEQUENTIAL), randomSeed(0)
+		{
+			memset(vc, 0, sizeof(vc));
+			memset(ccSet, 0, sizeof(ccSet));
+			memset(cc, 0, sizeof(cc));
+		}
+
+		const char* programPath;
+		const char* outputPath;
+		int      sampleRate;
+		int      bitDepth;
+		double   seconds;
+		double   volume; // percent, like the volume param
+		double   tempo;  // bpm, used for q
+		unsigned threads; // 0 uses every core
+		Program::RandomMode randomMode;
+		uint64_t            randomSeed;
+		Program::Value vc[8];
+		bool           ccSet[128];
+		Program::Value cc[128];
+	};
+
+	void PrintUsage()
+	{
+		fprintf(stderr,
+			"usage: evaluator-render [options] <program file> <output.wav>\n"
+			"\n"
+			"  -r <hz>           sample rate (default 44100)\n"
+			"  -b <bits>         bit depth of the program, sets w = 1<<bits (1-24, default 15)\n"
+			"  -d <seconds>      duration (default 10)\n"
+			"  -g <percent>      volume (default 50)\n"
+			"  -t <bpm>          tempo used for q (default 120)\n"
+			"  -V <index>=<val>  set a V control (index 0-7, value 0-255), can be repeated\n"
+			"  -C <index>=<val>  set a MIDI control change (index 0-127, value 0-127), can be repeated\n"
+			"  -j <threads>      threads to render stateless programs with (default 0, every core)\n"
+			"  -s <seed>         make R a function of the seed and t, so renders repeat and programs using R can be split up\n");
+	}
+
+	bool ParseNumber(const char* text, double& out)
+	{
+		char* end = nullptr;
+		out = strtod(text, &end);
+		return end != text && *end == '\0';
+	}
+
+	bool ParseIndexValue(const char* text, int& outIndex, int& outValue)
+	{
+		char* end = nullptr;
+		outIndex = (int)strtol(text, &end, 10);
+		if (end == text || *end != '=') return false;
+		const char* valueText = end + 1;
+		outValue = (int)strtol(valueText, &end, 10);
+		return end != valueText && *end == '\0';
+	}
+
+	bool ParseArguments(int argc, char** argv, Settings& settings)
+	{
+		for (int i = 1; i < argc; ++i)
+		{
+			const char* arg = argv[i];
+			if (arg[0] != '-' || arg[1] == '\0')
+			{
+				if (settings.programPath == nullptr) settings.programPath = arg;
+				else if (settings.outputPath == nullptr) settings.outputPath = arg;
+				else return false;
+				continue;
+			}
+
+			if (arg[2] != '\0' || i + 1 >= argc)
+			{
+				return false;
+			}
+
+			const char* value = argv[++i];
+			double number = 0;
+			int index = 0;
+			int indexValue = 0;
+			switch (arg[1])
+			{
+			case 'r':
+				if (!ParseNumber(value, number) || number < 1 || number > 1000000) return false;
+				settings.sampleRate = (int)number;
+				break;
+			case 'b':
+				if (!ParseNumber(value, number) || number < 1 || number > 24) return false;
+				settings.bitDepth = (int)number;
+				break;
+			case 'd':
+				if (!ParseNumber(value, number) || number < 0) return false;
+				settings.seconds = number;
+				break;
+			case 'g':
+				if (!ParseNumber(value, number) || number < 0 || number > 100) return false;
+				settings.volume = number;
+				break;
+			case 't':
+				if (!ParseNumber(value, number) || number < 1 || number > 960) return false;
+				settings.tempo = number;
+				break;
+			case 'j':
+				if (!ParseNumber(value, number) || number < 0) return false;
+				settings.threads = (unsigned)number;
+				break;
+			case 's':
+			{
+				char* end = nullptr;
+				settings.randomSeed = strtoull(value, &end, 10);
+				if (end == value || *end != '\0') return false;
+				settings.randomMode = Program::RM_COUNTER;
+				break;
+			}
+			case 'V':
+				if (!ParseIndexValue(value, index, indexValue) || index < 0 || index > 7 || indexValue < 0 || indexValue > 255) return false;
+				settings.vc[index] = indexValue;
+				break;
+			case 'C':
+				if (!ParseIndexValue(value, index, indexValue) || index < 0 || index > 127 || indexValue < 0 || indexValue > 127) return false;
+				settings.ccSet[index] = true;
+				settings.cc[index] = indexValue;
+				break;
+			default:
+				return false;
+			}
+		}
+
+		return settings.programPath != nullptr && settings.outputPath != nullptr;
+	}
+
+	// sets everything the plugin sets before it starts running a program (see Evaluator::ProcessDoubleReplacing)
+	Program* CreateProgram(const std::string& source, const Settings& settings, Program::CompileError& outError, int& outErrorPosition)
+	{
+		// compiling the same source again is a cache hit, so every thread can have its own Program cheaply
+		Program* program = Program::Compile(source.c_str(), kProgramMemorySize, outError, outErrorPosition);
+		if (outError != Program::CE_NONE)
+		{
+			delete program;
+			return nullptr;
+		}
+
+		program->SetExecutionEngine(Program::EE_LANES);
+		program->SetRandomMode(settings.randomMode, settings.randomSeed);
+		for (int i = 0; i < 8; ++i)
+		{
+			program->SetVC(i, settings.vc[i]);
+		}
+		for (int i = 0; i < 128; ++i)
+		{
+			if (settings.ccSet[i])
+			{
+				program->SetCC(i, settings.cc[i]);
+			}
+		}
+		program->Set('w', (Program::Value)1 << settings.bitDepth);
+		program->Set('~', (Program::Value)settings.sampleRate);
+		return program;
+	}
+
+	struct Renderer
+	{
+		Renderer(const Settings& settings)
+			: range((Program::Value)1 << settings.bitDepth)
+			, gain(settings.volume / 100.)
+			, mdenom(settings.sampleRate / 1000.0)
+			, qdenom((settings.sampleRate / (settings.tempo / 60.0)) / 128.0)
+		{
+		}
+
+		// render frames starting at tick into output, which is interleaved stereo, and return the error of the first frame that had one.
+		// frames is at most kChunkFrames and block is the scratch space for the program, sized for kChunkFrames.
+		Program::RuntimeError Render(Program* program, const uint64_t tick, const uint64_t frames, Program::Value* block, float* output) const
+		{
+			// the plugin feeds the program its audio input, which is silence here
+			std::fill(block, block + frames*kChannels, range / 2);
+
+			Program::TickState tickState(tick, mdenom, qdenom);
+			Program::RuntimeError error;
+			program->RunBlock(block, block, kChannels, (size_t)frames, tickState, &error);
+
+			for (uint64_t i = 0; i < frames*kChannels; ++i)
+			{
+				output[i] = (float)(gain * (-1.0 + 2.0*((double)(block[i] % range) / (range - 1))));
+			}
+			return error;
+		}
+
+		const Program::Value range;
+		const double gain;
+		const double mdenom;
+		const double qdenom;
+	};
+
+	void WriteU16(std::ofstream& out, const uint16_t value)
+	{
+		const char bytes[2] = { (char)(value & 0xFF), (char)(value >> 8) };
+		out.write(bytes, 2);
+	}
+
+	void WriteU32(std::ofstream& out, const uint32_t value)
+	{
+		const char bytes[4] = { (char)(value & 0xFF), (char)((value >> 8) & 0xFF), (char)((value >> 16) & 0xFF), (char)(value >> 24) };
+		out.write(bytes, 4);
+	}
+
+	// 32-bit float, so the samples are what the plugin would hand the host
+	void WriteWavHeader(std::ofstream& out, const int sampleRate, const uint32_t frames)
+	{
+		const uint32_t dataSize = frames * kChannels * sizeof(float);
+		out.write("RIFF", 4);
+		WriteU32(out, 4 + (8 + 18) + (8 + 4) + (8 + dataSize));
+		out.write("WAVE", 4);
+
+		out.write("fmt ", 4);
+		WriteU32(out, 18);
+		WriteU16(out, 3); // WAVE_FORMAT_IEEE_FLOAT
+		WriteU16(out, kChannels);
+		WriteU32(out, sampleRate);
+		WriteU32(out, sampleRate * kChannels * sizeof(float));
+		WriteU16(out, kChannels * sizeof(float));
+		WriteU16(out, 32);
+		WriteU16(out, 0);
+
+		// non-PCM formats are supposed to say how many frames they have
+		out.write("fact", 4);
+		WriteU32(out, 4);
+		WriteU32(out, frames);
+
+		out.write("data", 4);
+		WriteU32(out, dataSize);
+	}
+
+	void WriteSamples(std::ofstream& out, const float* samples, const size_t count)
+	{
+		// wav is little-endian, so we only need to swap bytes on big-endian machines
+		const uint16_t endianTest = 1;
+		if (*(const char*)&endianTest == 1)
+		{
+			out.write((const char*)samples, count * sizeof(float));
+			return;
+		}
+
+		for (size_t i = 0; i < count; ++i)
+		{
+			uint32_t bits;
+			memcpy(&bits, samples + i, sizeof(bits));
+			WriteU32(out, bits);
+		}
+	}
+}
+
+int main(int argc, char** argv)
+{
+	Settings settings;
+	if (!ParseArguments(argc, argv, settings))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	std::ifstream file(settings.programPath, std::ios::in | std::ios::binary);
+	if (!file)
+	{
+		fprintf(stderr, "Couldn't open %s\n", settings.programPath);
+		return 1;
+	}
+	const std::string source((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+	Program::CompileError error;
+	int errorPosition;
+	Program* program = CreateProgram(source, settings, error, errorPosition);
+	if (program == nullptr)
+	{
+		const size_t line = 1 + std::count(source.begin(), source.begin() + errorPosition, '\n');
+		fprintf(stderr, "Compile Error at line %zu of %s:\n\n%s\n", line, settings.programPath, Program::GetErrorString(error));
+		return 1;
+	}
+
+	const uint64_t totalFrames = (uint64_t)(settings.seconds * settings.sampleRate + 0.5);
+	if (totalFrames * kChannels * sizeof(float) > 0xFFFFFFFF - 64)
+	{
+		fprintf(stderr, "%g seconds is too long to fit in a wav file\n", settings.seconds);
+		delete program;
+		return 1;
+	}
+
+	// frames of a program that carries state have to be run in order, so only stateless programs get more than one thread
+	std::vector<Program*> programs(1, program);
+	if (program->IsStateless())
+	{
+		unsigned threads = settings.threads != 0 ? settings.threads : std::thread::hardware_concurrency();
+		const uint64_t chunks = (totalFrames + kChunkFrames - 1) / kChunkFrames;
+		threads = (unsigned)std::min<uint64_t>(std::max(threads, 1u), std::max<uint64_t>(chunks, 1));
+		while (programs.size() < threads)
+		{
+			programs.push_back(CreateProgram(source, settings, error, errorPosition));
+		}
+	}
+
+	std::ofstream out(settings.outputPath, std::ios::out | std::ios::binary);
+	if (!out)
+	{
+		fprintf(stderr, "Couldn't open %s for writing\n", settings.outputPath);
+		for (Program* p : programs) delete p;
+		return 1;
+	}
+	WriteWavHeader(out, settings.sampleRate, (uint32_t)totalFrames);
+
+	// chunks are rendered a batch at a time and written in order, so memory use doesn't grow with the duration.
+	// a stateless program's frames only depend on their tick, so any thread can render any chunk by starting at its tick.
+	const Renderer renderer(settings);
+	const size_t threadCount = programs.size();
+	const size_t batchChunks = threadCount * 4;
+	std::vector<Program::Value> blocks(threadCount * kChunkFrames * kChannels);
+	std::vector<float> samples(batchChunks * kChunkFrames * kChannels);
+	std::vector<Program::RuntimeError> errors(batchChunks);
+	Program::RuntimeError firstError = Program::RE_NONE;
+
+	for (uint64_t batchStart = 0; batchStart < totalFrames; batchStart += batchChunks * kChunkFrames)
+	{
+		const uint64_t batchFrames = std::min<uint64_t>(batchChunks * kChunkFrames, totalFrames - batchStart);
+		const size_t chunks = (size_t)((batchFrames + kChunkFrames - 1) / kChunkFrames);
+		auto renderChunks = [&](const size_t thread)
+		{
+			Program::Value* block = blocks.data() + thread * kChunkFrames * kChannels;
+			for (size_t c = thread; c < chunks; c += threadCount)
+			{
+				const uint64_t start = c * kChunkFrames;
+				const uint64_t frames = std::min<uint64_t>(kChunkFrames, batchFrames - start);
+				errors[c] = renderer.Render(programs[thread], batchStart + start, frames, block, samples.data() + start * kChannels);
+			}
+		};
+
+		std::vector<std::thread> workers;
+		for (size_t t = 1; t < threadCount; ++t)
+		{
+			workers.push_back(std::thread(renderChunks, t));
+		}
+		renderChunks(0);
+		for (std::thread& worker : workers)
+		{
+			worker.join();
+		}
+
+		for (size_t c = 0; c < chunks && firstError == Program::RE_NONE; ++c)
+		{
+			firstError = errors[c];
+		}
+		WriteSamples(out, samples.data(), (size_t)batchFrames * kChannels);
+	}
+
+	for (Program* p : programs)
+	{
+		delete p;
+	}
+
+	if (!out)
+	{
+		fprintf(stderr, "Failed writing %s\n", settings.outputPath);
+		return 1;
+	}
+
+	// the plugin keeps playing when a program has a runtime error, so we write the whole render and only report it
+	if (firstError != Program::RE_NONE)
+	{
+		fprintf(stderr, "Runtime Error: %s\n", Program::GetErrorString(firstError));
+	}
+
+	printf("rendered %llu frames of %s to %s using %zu thread%s\n",
+		(unsigned long long)totalFrames, settings.programPath, settings.outputPath, threadCount, threadCount == 1 ? "" : "s");
+	return 0;
+}